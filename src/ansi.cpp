@@ -0,0 +1,262 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <algorithm> // std::min
+
+#include "ansi.h"
+#include "zepto8.h"
+
+namespace z8
+{
+
+// UTF-8 glyphs for the cells
+static char const upper_half[] = "▀";
+static char const lower_half[] = "▄";
+static char const full_block[] = "█";
+
+ansi_encoder::ansi_encoder(color_mode mode)
+  : m_mode(mode)
+{
+    // Large enough for a full frame in truecolor mode, with a colour
+    // change on every cell, so that encode() never reallocates
+    m_out.reserve(128 * 64 * 48);
+    reset();
+}
+
+void ansi_encoder::reset()
+{
+    m_cells.clear();
+    m_size = lol::ivec2(0);
+    m_x = m_y = -1;
+    m_fg = m_bg = no_color;
+}
+
+std::string_view ansi_encoder::encode(vm_base const &vm, lol::ivec2 term_size)
+{
+    m_out.clear();
+
+    int const width = std::min(128, term_size.x);
+    int const height = std::min(64, term_size.y);
+
+    // Start from a clean terminal when nothing is known about it
+    if (term_size != m_size)
+    {
+        reset();
+        m_size = term_size;
+        m_cells.assign(size_t(std::max(width, 0) * std::max(height, 0)), no_cell);
+        m_out += "\x1b[0m\x1b[2J";
+    }
+
+    // Other output may have moved the cursor since the last frame, and
+    // broadcast viewers may have started from a different encoder, so
+    // the first movement of each frame is always absolute
+    m_x = m_y = -1;
+
+    uint32_t colors[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        if (m_mode == color_mode::truecolor)
+        {
+            auto rgb = vm.get_rgb(uint8_t(i));
+            colors[i] = uint32_t(rgb.r) << 16 | uint32_t(rgb.g) << 8 | rgb.b;
+        }
+        else
+            colors[i] = uint32_t(vm.get_ansi_color(uint8_t(i)));
+    }
+
+    auto const &screen = vm.get_front_screen();
+    size_t const header = m_out.size();
+    m_out += "\x1b[?25l"; // hide cursor
+    size_t const start = m_out.size();
+
+    uint64_t row[128];
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+            row[x] = uint64_t(colors[screen.get(x, 2 * y)]) << 32
+                   | colors[screen.get(x, 2 * y + 1)];
+
+        uint64_t *cells = m_cells.data() + y * width;
+        for (int x = 0; x < width; ++x)
+        {
+            if (row[x] == cells[x])
+                continue;
+
+            move_to(x, y, row);
+            put_cell(uint32_t(row[x] >> 32), uint32_t(row[x]));
+            cells[x] = row[x];
+
+            // Writing to the last column may leave the cursor in a
+            // pending wrap state, so do not rely on its position
+            m_x = x + 1 < term_size.x ? x + 1 : -1;
+        }
+    }
+
+    if (m_out.size() == start)
+    {
+        // Nothing changed; only send what precedes the frame, if anything
+        m_out.resize(header);
+        return m_out;
+    }
+
+    m_out += "\x1b[0m\x1b[?25h"; // reset properties and show cursor
+    m_fg = m_bg = no_color;
+    return m_out;
+}
+
+void ansi_encoder::put_int(int n)
+{
+    char buf[12], *p = buf + sizeof(buf);
+    do
+        *--p = char('0' + n % 10);
+    while (n /= 10);
+    m_out.append(p, buf + sizeof(buf) - p);
+}
+
+void ansi_encoder::put_color(uint32_t color)
+{
+    if (m_mode == color_mode::truecolor)
+    {
+        m_out += "2;";
+        put_int(int(color >> 16));
+        m_out += ';';
+        put_int(int(color >> 8 & 0xff));
+        m_out += ';';
+        put_int(int(color & 0xff));
+    }
+    else
+    {
+        m_out += "5;";
+        put_int(int(color));
+    }
+}
+
+// Emit a single SGR sequence that changes only the colours that differ
+// from the current terminal state
+void ansi_encoder::set_colors(uint32_t fg, uint32_t bg)
+{
+    if (fg == m_fg && bg == m_bg)
+        return;
+
+    m_out += "\x1b[";
+    if (fg != m_fg)
+    {
+        m_out += "38;";
+        put_color(fg);
+        if (bg != m_bg)
+            m_out += ';';
+    }
+    if (bg != m_bg)
+    {
+        m_out += "48;";
+        put_color(bg);
+    }
+    m_out += 'm';
+
+    m_fg = fg;
+    m_bg = bg;
+}
+
+// Whether a cell can be drawn without changing the current colours
+bool ansi_encoder::cheap_cell(uint32_t top, uint32_t bottom) const
+{
+    if (top == bottom)
+        return top == m_fg || top == m_bg;
+    return (top == m_fg && bottom == m_bg) || (top == m_bg && bottom == m_fg);
+}
+
+void ansi_encoder::put_cell(uint32_t top, uint32_t bottom)
+{
+    if (top == bottom)
+    {
+        // A space or a full block, whichever matches the current colours
+        if (top == m_bg)
+            m_out += ' ';
+        else if (top == m_fg)
+            m_out += full_block;
+        else
+        {
+            set_colors(m_fg, top);
+            m_out += ' ';
+        }
+        return;
+    }
+
+    // Use the upper half-block unless the lower one needs fewer changes
+    int const upper_cost = (top != m_fg) + (bottom != m_bg);
+    int const lower_cost = (bottom != m_fg) + (top != m_bg);
+    if (lower_cost < upper_cost)
+    {
+        set_colors(bottom, top);
+        m_out += lower_half;
+    }
+    else
+    {
+        set_colors(top, bottom);
+        m_out += upper_half;
+    }
+}
+
+// Move the cursor to (x, y), given the contents of row y
+void ansi_encoder::move_to(int x, int y, uint64_t const *row)
+{
+    if (m_y == y && m_x == x)
+        return;
+
+    if (m_y == y && m_x >= 0 && m_x < x)
+    {
+        // Redrawing a short span of unchanged cells is cheaper than a
+        // cursor movement, as long as it needs no colour change
+        int const gap = x - m_x;
+        if (gap <= 2)
+        {
+            bool cheap = true;
+            for (int i = m_x; i < x && cheap; ++i)
+                cheap = cheap_cell(uint32_t(row[i] >> 32), uint32_t(row[i]));
+            if (cheap)
+            {
+                for (int i = m_x; i < x; ++i)
+                    put_cell(uint32_t(row[i] >> 32), uint32_t(row[i]));
+                m_x = x;
+                return;
+            }
+        }
+
+        // Cursor forward
+        m_out += "\x1b[";
+        if (gap > 1)
+            put_int(gap);
+        m_out += 'C';
+    }
+    else
+    {
+        // Cursor position
+        m_out += "\x1b[";
+        put_int(y + 1);
+        if (x > 0)
+        {
+            m_out += ';';
+            put_int(x + 1);
+        }
+        m_out += 'H';
+    }
+
+    m_x = x;
+    m_y = y;
+}
+
+} // namespace z8
+
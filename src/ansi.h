@@ -0,0 +1,77 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/vector>  // lol::ivec2
+#include <cstdint>     // uint32_t, uint64_t
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+
+// The ansi_encoder class
+// ——————————————————————
+// Encodes the front screen of a VM as ANSI escape sequences, using one
+// half-block character per pair of pixels. The encoder remembers what
+// the terminal currently shows and only sends the cells that changed,
+// moving the cursor over unchanged spans and choosing between the upper
+// and lower half-block so that as few colours as possible need to be
+// changed. Output goes to a buffer that is allocated once and reused.
+
+namespace z8
+{
+
+class vm_base;
+
+class ansi_encoder
+{
+public:
+    enum class color_mode
+    {
+        ansi256,   // xterm 256-colour palette approximations
+        truecolor, // exact 24-bit colours
+    };
+
+    ansi_encoder(color_mode mode = color_mode::ansi256);
+
+    // Forget the terminal state, so that the next frame clears the
+    // terminal and is sent in full
+    void reset();
+
+    // Return the bytes that update the terminal to the current front
+    // screen of vm; the result is valid until the next call
+    std::string_view encode(vm_base const &vm, lol::ivec2 term_size);
+
+private:
+    static uint32_t const no_color = ~uint32_t(0);
+    static uint64_t const no_cell = ~uint64_t(0);
+
+    void put_int(int n);
+    void put_color(uint32_t color);
+    void set_colors(uint32_t fg, uint32_t bg);
+    bool cheap_cell(uint32_t top, uint32_t bottom) const;
+    void put_cell(uint32_t top, uint32_t bottom);
+    void move_to(int x, int y, uint64_t const *row);
+
+    color_mode m_mode;
+    std::string m_out;
+
+    // What the terminal shows: the top and bottom colour of each cell,
+    // the cursor position (−1 when unknown) and the current colours
+    std::vector<uint64_t> m_cells;
+    lol::ivec2 m_size = lol::ivec2(0);
+    int m_x = -1, m_y = -1;
+    uint32_t m_fg = no_color, m_bg = no_color;
+};
+
+} // namespace z8
+
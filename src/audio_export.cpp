@@ -0,0 +1,239 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/file>   // lol::file
+#include <lol/msg>    // lol::msg
+#include <lol/thread> // lol::timer
+#include <algorithm>  // std::min, std::max
+#include <atomic>     // std::atomic
+#include <cstring>    // std::memcpy
+#include <iterator>   // std::size
+#include <memory>     // std::unique_ptr
+#include <thread>     // std::thread
+
+#include "audio_export.h"
+#include "pico8/vm.h"
+
+namespace z8
+{
+
+audio_export::audio_export(int threads, bool wavetable)
+  : m_threads(threads > 0 ? threads : std::max(1, int(std::thread::hardware_concurrency()))),
+    m_wavetable(wavetable)
+{
+}
+
+bool audio_export::load(std::string const &filename)
+{
+    return m_cart.load(filename);
+}
+
+bool audio_export::music(int pattern, int max_seconds)
+{
+    if (pattern < 0 || pattern > 63)
+        return false;
+
+    // Follow the song from the given pattern, using the same rules as the
+    // music player, until it stops or comes back to a known pattern.
+    auto const &song = m_cart.get_rom().song;
+    std::vector<job> jobs;
+    bool seen[64] = {};
+    while (pattern >= 0 && pattern <= 63 && !seen[pattern])
+    {
+        seen[pattern] = true;
+        jobs.push_back(job { true, pattern, {} });
+
+        int next_pattern = pattern + 1;
+        if (song[pattern].stop)
+            next_pattern = -1;
+        else if (song[pattern].loop)
+            while (--next_pattern > 0 && !song[next_pattern].start)
+                ;
+        pattern = next_pattern;
+    }
+
+    int const max_samples = max_seconds * 22050;
+    run(jobs, max_samples);
+
+    // A pattern with no sound stops the music
+    m_samples.clear();
+    for (auto const &j : jobs)
+    {
+        if (j.samples.empty())
+            break;
+        m_samples.insert(m_samples.end(), j.samples.begin(), j.samples.end());
+    }
+    m_samples.resize(std::min(m_samples.size(), size_t(max_samples)));
+    return true;
+}
+
+bool audio_export::sfx(std::vector<int> const &list, int max_seconds)
+{
+    std::vector<job> jobs;
+    for (int n : list)
+    {
+        if (n < 0 || n > 63)
+            return false;
+        jobs.push_back(job { false, n, {} });
+    }
+
+    run(jobs, max_seconds * 22050);
+
+    m_samples.clear();
+    for (auto const &j : jobs)
+        m_samples.insert(m_samples.end(), j.samples.begin(), j.samples.end());
+    return true;
+}
+
+bool audio_export::save(std::string const &filename) const
+{
+    auto le32 = [](uint32_t x) -> std::string
+    {
+        return { char(x), char(x >> 8), char(x >> 16), char(x >> 24) };
+    };
+
+    uint32_t const data_size = uint32_t(m_samples.size() * sizeof(int16_t));
+
+    std::string data = "RIFF" + le32(36 + data_size) + "WAVE";
+    data += std::string("fmt \x10\0\0\0" /* subchunk size */ "\x01\0" /* format (PCM) */
+                        "\x01\0" /* channels (1) */, 12);
+    data += le32(22050) /* sample rate */ + le32(22050 * 2) /* byte rate */;
+    data += std::string("\x02\0" /* block align */ "\x10\0" /* bits per sample */ "data", 8);
+    data += le32(data_size);
+
+    for (int16_t sample : m_samples)
+    {
+        data += char(sample);
+        data += char(uint16_t(sample) >> 8);
+    }
+
+    return lol::file::write(filename, data);
+}
+
+void audio_export::run(std::vector<job> &jobs, int max_samples) const
+{
+    // Create the VMs from this thread, and destroy them from here too,
+    // because their destructor saves the configuration file
+    int const thread_count = std::min(m_threads, std::max(1, int(jobs.size())));
+    std::vector<std::unique_ptr<pico8::vm>> vms;
+    for (int i = 0; i < thread_count; ++i)
+        vms.push_back(std::make_unique<pico8::vm>());
+
+    lol::timer t;
+
+    std::atomic<size_t> next_job = 0;
+    std::vector<std::thread> threads;
+    for (auto &vm : vms)
+    {
+        threads.emplace_back([&, vm = vm.get()]()
+        {
+            for (size_t n = next_job++; n < jobs.size(); n = next_job++)
+                render(*vm, jobs[n], max_samples);
+        });
+    }
+
+    for (auto &th : threads)
+        th.join();
+
+    float const time = t.get();
+
+    size_t total = 0;
+    for (auto const &j : jobs)
+        total += j.samples.size();
+    lol::msg::info("rendered %d samples on %d threads in %.3f s (%.0f samples/s)\n",
+                   int(total), thread_count, time, time > 0.f ? total / time : 0.f);
+}
+
+void audio_export::render(pico8::vm &vm, job &j, int max_samples) const
+{
+    // Start each job from a fresh audio state, with fixed volumes and
+    // noise seeds so that the output does not depend on the configuration
+    std::memcpy(&vm.m_ram, &m_cart.get_rom(), offsetof(pico8::memory, code));
+    vm.m_state = pico8::state();
+    vm.reset_audio(0);
+    vm.m_wavetable_synth = m_wavetable;
+
+    int16_t buffer[256];
+
+    if (j.is_music)
+    {
+        vm.apply_music(int16_t(j.index), 0, 0);
+        if (vm.m_state.music.pattern == -1)
+            return;
+
+        // Count the samples before the music player moves to the next
+        // pattern, using the same arithmetic as vm::step_music().
+        double const offset_per_frame = (22050.0 / 183.0) * (1.0 / 22050.0);
+        double offset = 0.0;
+        int count = 0;
+        while ((offset += offset_per_frame) < vm.m_state.music.length)
+            ++count;
+
+        count = std::min(count, max_samples);
+        j.samples.resize(count);
+        for (int done = 0; done < count; )
+        {
+            int const chunk = std::min(count - done, int(std::size(buffer)));
+            vm.get_audio(buffer, chunk * sizeof(int16_t));
+            std::copy(buffer, buffer + chunk, j.samples.begin() + done);
+            done += chunk;
+        }
+    }
+    else
+    {
+        vm.apply_sfx(int16_t(j.index), 0, 0, 0);
+        auto &main_sfx = vm.m_state.channels[0].main_sfx;
+
+        // A looping SFX never stops by itself, so stop it after its first
+        // pass through the loop end. Count the samples of that pass using
+        // the same arithmetic as vm::update_sfx_state().
+        auto const &sfx = vm.m_audio_data.sfx[j.index];
+        int first_pass = max_samples;
+        if (sfx.loop_end > sfx.loop_start)
+        {
+            double const offset_per_frame = (22050.0 / (183.0 * std::max(1, int(sfx.speed)))) * (1.0 / 22050.0);
+            double offset = 0.0;
+            first_pass = 1;
+            while ((offset += offset_per_frame) < sfx.loop_end)
+                ++first_pass;
+        }
+
+        // Render until the SFX stops, plus a tail for the reverb and the
+        // final fade out
+        int tail = 1024;
+        while (tail > 0 && int(j.samples.size()) < max_samples)
+        {
+            int chunk = int(std::size(buffer));
+            if (main_sfx.sfx != -1)
+            {
+                int const left = first_pass - int(j.samples.size());
+                if (left > 0)
+                    chunk = std::min(chunk, left);
+                else
+                    main_sfx.sfx = -1;
+            }
+
+            vm.get_audio(buffer, chunk * sizeof(int16_t));
+            j.samples.insert(j.samples.end(), buffer, buffer + chunk);
+            if (main_sfx.sfx == -1)
+                tail -= chunk;
+        }
+        j.samples.resize(std::min(j.samples.size(), size_t(max_samples)));
+    }
+}
+
+} // namespace z8
+
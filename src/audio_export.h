@@ -0,0 +1,69 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstdint> // int16_t
+#include <string>  // std::string
+#include <vector>  // std::vector
+
+#include "pico8/cart.h"
+
+namespace z8::pico8 { class vm; }
+
+// The audio_export class
+// ——————————————————————
+// Offline renderer for the music and SFX of a cart. It drives the synth
+// directly, without running any Lua code and without wall-clock timing,
+// and renders each pattern or SFX on a pool of threads before stitching
+// the results together. The output only depends on the cart data, which
+// makes it suitable for golden file tests.
+
+namespace z8
+{
+
+class audio_export
+{
+public:
+    audio_export(int threads, bool wavetable);
+
+    bool load(std::string const &filename);
+
+    // Render the song starting at the given pattern, until it stops or
+    // loops back to a pattern that was already played
+    bool music(int pattern, int max_seconds);
+
+    // Render the given SFX one after the other
+    bool sfx(std::vector<int> const &list, int max_seconds);
+
+    // Save the rendered audio as a 22050 Hz mono 16-bit WAV file
+    bool save(std::string const &filename) const;
+
+private:
+    struct job
+    {
+        bool is_music;
+        int index;
+        std::vector<int16_t> samples;
+    };
+
+    void run(std::vector<job> &jobs, int max_samples) const;
+    void render(pico8::vm &vm, job &j, int max_samples) const;
+
+    pico8::cart m_cart;
+    std::vector<int16_t> m_samples;
+    int m_threads;
+    bool m_wavetable;
+};
+
+} // namespace z8
+
@@ -0,0 +1,540 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/math>   // lol::rand
+#include <lol/thread> // lol::timer
+#include <lol/vector> // lol::u8vec4
+#include <vector>     // std::vector
+#include <cstring>    // std::memcmp, std::memcpy
+#include <iterator>   // std::size
+#include <cmath>      // std::exp2, std::fabs, std::sqrt
+#include <cstddef>    // offsetof
+#include <algorithm>  // std::max
+#include <string>     // std::string
+
+#if HAVE_SYS_EPOLL_H
+#   include <arpa/inet.h>
+#   include <fcntl.h>
+#   include <netinet/in.h>
+#   include <sys/socket.h>
+#   include <unistd.h>
+#endif
+
+#include "benchmark.h"
+#include "ansi.h"
+#include "pico8/vm.h"
+#include "pico8/pico8.h"
+#include "synth.h"
+#include "telnet_server.h"
+
+namespace z8
+{
+
+bool benchmark::render(int frames)
+{
+    pico8::vm vm;
+    std::vector<lol::u8vec4> expected(128 * 128), actual(128 * 128);
+    std::vector<uint32_t> actual32(128 * 128);
+    std::vector<uint16_t> actual16(128 * 128);
+
+    // Random screen contents and screen palette with a few secret colours,
+    // written directly to the frame that the renderer reads
+    auto &front = vm.m_frames.front();
+    for (auto &line : front.screen.data)
+        for (auto &p : line)
+            p = uint8_t(lol::rand(256));
+    for (int c = 0; c < 16; ++c)
+        front.draw_state.screen_palette[c] = uint8_t(c < 12 ? c : 128 + c);
+
+    // Test raster modes too: off, alternate palette, gradient
+    auto &raster = front.hw_state.raster;
+    for (int c = 0; c < 16; ++c)
+        raster.palette[c] = uint8_t(15 - c);
+    for (int y = 0; y < 128; ++y)
+        raster.bits[y] = lol::rand(2) != 0;
+    uint8_t const raster_modes[] = { 0x00, 0x10, 0x37 };
+
+    double ref_time = 0.0, new_time = 0.0;
+    int errors = 0;
+
+    for (uint8_t raster_mode : raster_modes)
+    {
+        raster.mode = raster_mode;
+        for (int mode = 0; mode < 256; ++mode)
+        {
+            front.draw_state.screen_mode = uint8_t(mode);
+
+            // Reference: one call to pixel() per output pixel
+            lol::timer t;
+            for (int f = 0; f < frames; ++f)
+            {
+                auto *dst = expected.data();
+                for (int y = 0; y < 128; ++y)
+                    for (int x = 0; x < 128; ++x)
+                    {
+                        uint8_t c = vm.pixel(x, y, vm.get_front_screen());
+                        *dst++ = pico8::palette::get8(c & 0x80 ? 16 + (c & 0xf) : c & 0xf);
+                    }
+            }
+            ref_time += t.get();
+
+            for (int f = 0; f < frames; ++f)
+                vm.render(actual.data());
+            new_time += t.get();
+
+            if (std::memcmp(expected.data(), actual.data(), expected.size() * sizeof(expected[0])))
+            {
+                printf("render: mismatch for screen_mode 0x%02x raster_mode 0x%02x\n",
+                       mode, raster_mode);
+                ++errors;
+            }
+
+            // The libretro formats must match the RGBA output too
+            vm.render_xrgb8888(actual32.data(), 128);
+            vm.render_rgb565(actual16.data(), 128);
+            for (int i = 0; i < 128 * 128; ++i)
+            {
+                auto c = expected[i];
+                if (actual32[i] != (0xff000000u | uint32_t(c.r) << 16 | uint32_t(c.g) << 8 | c.b)
+                     || actual16[i] != uint16_t((c.r >> 3) << 11 | (c.g >> 2) << 5 | c.b >> 3))
+                {
+                    printf("render: packed format mismatch for screen_mode 0x%02x raster_mode 0x%02x\n",
+                           mode, raster_mode);
+                    ++errors;
+                    break;
+                }
+            }
+        }
+    }
+
+    int total = frames * 256 * int(std::size(raster_modes));
+    printf("render: reference %.3f ms/frame, optimised %.3f ms/frame, speedup %.2fx\n",
+           ref_time * 1000.0 / total, new_time * 1000.0 / total,
+           new_time > 0.0 ? ref_time / new_time : 0.0);
+    printf("render: %d errors\n", errors);
+    return errors == 0;
+}
+
+bool benchmark::print(int frames)
+{
+    pico8::vm vm;
+    vm.private_init_ram();
+
+    auto &ds = vm.m_ram.draw_state;
+    ds.clip.x1 = ds.clip.y1 = 0;
+    ds.clip.x2 = ds.clip.y2 = 128;
+    for (int c = 0; c < 16; ++c)
+        ds.draw_palette[c] = ds.screen_palette[c] = uint8_t(c);
+
+    // 20 lines of 100 characters, mixing ASCII and wide glyphs
+    std::vector<pico8::rich_string> lines(20);
+    for (auto &line : lines)
+        for (int i = 0; i < 100; ++i)
+            line += char(lol::rand(8) ? 0x20 + lol::rand(0x5f) : 0x80 + lol::rand(0x20));
+
+    struct { char const *name; bool wide, tall, dotty, solid, invert; } const styles[] =
+    {
+        { "plain",  false, false, false, false, false },
+        { "wide",   true,  false, false, false, false },
+        { "tall",   false, true,  false, false, false },
+        { "dotty",  true,  true,  true,  false, false },
+        { "solid",  false, false, false, true,  false },
+        { "invert", false, false, false, false, true  },
+    };
+
+    int errors = 0;
+    for (auto const &style : styles)
+    {
+        auto &ps = vm.m_ram.hw_state.print_state;
+        ps = {};
+        ps.active = 1;
+        ps.padding = 1;
+        ps.wide = style.wide;
+        ps.tall = style.tall;
+        ps.dotty = style.dotty;
+        ps.solid = style.solid;
+        ps.invert = style.invert;
+
+        // Check the span renderer against the per-pixel reference for
+        // every glyph, at every horizontal offset including odd ones
+        uint32_t const color_bits = vm.to_color_bits(fix32(7)) & 0xf'0000;
+        uint32_t const background_bits = vm.raw_to_bits(0);
+        int style_errors = 0;
+        for (int ch = 1; ch < 256; ++ch)
+        {
+            int16_t const width = ch < 0x80 ? 4 : 8;
+            pico8::vm::glyph_draw glyph { {}, width, 5, width, 6, 0, int16_t(ch % 19 * 7 - 6) };
+            for (int16_t dy = 0; dy < 8; ++dy)
+                glyph.rows[dy] = vm.m_bios->get_glyph_row(uint8_t(ch), dy);
+
+            for (glyph.x = -10; glyph.x < 128; ++glyph.x)
+            {
+                u4mat2<128, 128> expected = {}, actual = {};
+                vm.draw_glyph_pixels(expected, glyph, ps, color_bits, background_bits);
+                vm.draw_glyph_spans(actual, glyph, ps, color_bits, background_bits);
+                style_errors += std::memcmp(&expected, &actual, sizeof(expected)) != 0;
+            }
+        }
+        errors += style_errors;
+
+        lol::timer t;
+        for (int f = 0; f < frames; ++f)
+        {
+            vm.api_cls(0);
+            for (size_t n = 0; n < lines.size(); ++n)
+                vm.api_print(lines[n], fix32(-int(f % 32)), fix32(int(n * 7) - 8), fix32(7 + n % 8));
+        }
+        float time = t.get();
+
+        int chars = frames * int(lines.size()) * 100;
+        printf("print: %-6s %.3f ms/frame, %.0f chars/s, %d errors\n", style.name,
+               time * 1000.f / frames, time > 0.f ? chars / time : 0.f, style_errors);
+    }
+
+    return errors == 0;
+}
+
+bool benchmark::synth(int seconds)
+{
+    static char const *names[] =
+    {
+        "triangle", "tilted", "saw", "square", "pulse", "organ", "noise", "phaser",
+    };
+
+    int const samples = seconds * 22050;
+    int errors = 0;
+
+    for (int inst = 0; inst < 8; ++inst)
+    {
+        if (inst == z8::synth::INST_NOISE)
+            continue;
+
+        for (int buzz = 0; buzz < 2; ++buzz)
+        {
+            pico8::state::synth_param params;
+            params.instrument = uint8_t(inst);
+            params.filters = buzz ? 0x4 : 0;
+
+            // Sweep all 64 keys, resetting the phase at each note
+            double ref_time = 0.0, new_time = 0.0, sum = 0.0, max_error = 0.0;
+            std::vector<float> expected(samples);
+            for (int key = 0; key < 64; ++key)
+            {
+                float freq = 440.f * std::exp2((key - 33.f) / 12.f);
+
+                lol::timer t;
+                params.phi = 0.f;
+                for (auto &x : expected)
+                {
+                    params.phi += freq / 22050.f;
+                    x = z8::synth::waveform(params);
+                }
+                ref_time += t.get();
+
+                params.phi = 0.f;
+                for (auto &x : expected)
+                {
+                    params.phi += freq / 22050.f;
+                    double error = std::fabs(z8::synth::fast_waveform(params) - x);
+                    sum += error * error;
+                    max_error = std::max(max_error, error);
+                }
+                new_time += t.get();
+            }
+
+            double rms = std::sqrt(sum / (64.0 * samples));
+            printf("synth: %-8s %s reference %.1f Msamples/s, wavetable %.1f Msamples/s, "
+                   "max error %.4f, rms error %.5f\n", names[inst], buzz ? "buzz " : "plain",
+                   ref_time > 0.0 ? 64e-6 * samples / ref_time : 0.0,
+                   new_time > 0.0 ? 64e-6 * samples / new_time : 0.0, max_error, rms);
+
+            // Discontinuous waveforms have a large error on the one sample
+            // that straddles each step, but the overall error must stay
+            // around −40 dB or lower.
+            if (rms > 0.01)
+                ++errors;
+        }
+    }
+
+    printf("synth: %d errors\n", errors);
+    return errors == 0;
+}
+
+bool benchmark::audio(std::vector<std::string> const &carts, int seconds)
+{
+    int errors = 0;
+    double total_time = 0.0, total_seconds = 0.0;
+
+    for (auto const &filename : carts)
+    {
+        pico8::cart cart;
+        if (!cart.load(filename))
+        {
+            printf("audio: %s: could not load cart\n", filename.c_str());
+            ++errors;
+            continue;
+        }
+
+        // Same setup as audio_export: only the audio state is used. The
+        // second VM renders without the steady-note fast path, as a
+        // reference.
+        pico8::vm vm, ref;
+        for (auto *v : { &vm, &ref })
+        {
+            std::memcpy(&v->m_ram, &cart.get_rom(), offsetof(pico8::memory, code));
+            v->reset_audio(0);
+            v->apply_music(0, 0, 0);
+        }
+        if (vm.m_state.music.pattern == -1)
+        {
+            printf("audio: %s: no music\n", filename.c_str());
+            continue;
+        }
+
+        // Use a typical audio callback size
+        int16_t buffer[512], expected[512];
+        uint64_t ref_ns[4] = {};
+        double time = 0.0, ref_time = 0.0;
+        int mismatches = 0;
+        for (int n = 0; n < seconds * 22050; n += int(std::size(buffer)))
+        {
+            lol::timer t;
+            ref.render_audio<false>(expected, std::size(expected), ref_ns);
+            ref_time += t.get();
+            vm.get_audio(buffer, sizeof(buffer));
+            time += t.get();
+            for (size_t i = 0; i < std::size(buffer); ++i)
+                mismatches += buffer[i] != expected[i];
+        }
+        errors += mismatches > 0;
+
+        total_time += time;
+        total_seconds += seconds;
+        printf("audio: %s: %.1fx real time, reference %.1fx, %d mismatched samples (%s)\n",
+               filename.c_str(), time > 0.0 ? seconds / time : 0.0,
+               ref_time > 0.0 ? seconds / ref_time : 0.0, mismatches,
+               vm.audio_stats_summary().c_str());
+    }
+
+    printf("audio: overall %.1fx real time, %d errors\n",
+           total_time > 0.0 ? total_seconds / total_time : 0.0, errors);
+    return errors == 0;
+}
+
+bool benchmark::ansi(std::vector<std::string> const &carts, int frames)
+{
+    static char const *names[] = { "full 256", "diff 256", "full rgb", "diff rgb" };
+
+    for (auto const &filename : carts)
+    {
+        pico8::vm vm;
+        vm.load(filename);
+        vm.run();
+
+        ansi_encoder encoders[] =
+        {
+            ansi_encoder(ansi_encoder::color_mode::ansi256),
+            ansi_encoder(ansi_encoder::color_mode::ansi256),
+            ansi_encoder(ansi_encoder::color_mode::truecolor),
+            ansi_encoder(ansi_encoder::color_mode::truecolor),
+        };
+        double time[4] = {};
+        size_t bytes[4] = {};
+
+        for (int f = 0; f < frames; ++f)
+        {
+            vm.step(1.f / 60.f);
+            vm.acquire_frame();
+            for (int n = 0; n < 4; ++n)
+            {
+                // Even encoders start from scratch every frame
+                if (n % 2 == 0)
+                    encoders[n].reset();
+                lol::timer t;
+                bytes[n] += encoders[n].encode(vm, lol::ivec2(128, 64)).size();
+                time[n] += t.get();
+            }
+        }
+
+        for (int n = 0; n < 4; ++n)
+            printf("ansi: %s: %s %.0f bytes/frame, %.1f µs/frame\n", filename.c_str(), names[n],
+                   double(bytes[n]) / frames, time[n] * 1e6 / frames);
+    }
+
+    return true;
+}
+
+bool benchmark::broadcast(std::string const &cart, int viewers, int frames)
+{
+#if HAVE_SYS_EPOLL_H
+    // The hand-off check needs at least three viewers
+    viewers = std::max(viewers, 3);
+
+    telnet_server server(cart, true);
+    if (!server.listen("127.0.0.1:0"))
+        return false;
+
+    sockaddr_in addr = {};
+    socklen_t addr_len = sizeof(addr);
+    getsockname(server.m_listen_fd, (sockaddr *)&addr, &addr_len);
+
+    // Client side of each connection, in connection order, and all the
+    // data it received
+    struct viewer { int fd; std::string data; };
+    std::vector<viewer> clients;
+    int errors = 0;
+
+    auto connect_viewer = [&]()
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (sockaddr *)&addr, addr_len) != 0
+             || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) != 0)
+        {
+            printf("broadcast: cannot connect viewer %d\n", int(clients.size()));
+            if (fd >= 0)
+                ::close(fd);
+            ++errors;
+            return;
+        }
+        clients.push_back({ fd, {} });
+        server.accept_clients();
+    };
+
+    // Server side descriptor of a client, found by matching ports
+    auto server_fd = [&](viewer const &v)
+    {
+        sockaddr_in local = {}, peer = {};
+        socklen_t len = sizeof(local);
+        getsockname(v.fd, (sockaddr *)&local, &len);
+        for (auto const &[fd, s] : server.m_sessions)
+        {
+            len = sizeof(peer);
+            if (getpeername(fd, (sockaddr *)&peer, &len) == 0 && peer.sin_port == local.sin_port)
+                return fd;
+        }
+        return -1;
+    };
+
+    // Send all pending output and read it on the client side, until a
+    // whole pass reads nothing
+    size_t total_bytes = 0;
+    auto drain = [&]()
+    {
+        for (bool more = true; more; )
+        {
+            more = false;
+            for (auto const &[fd, s] : server.m_sessions)
+                server.flush_client(*s);
+            for (auto &v : clients)
+            {
+                char buf[65536];
+                for (ssize_t ret; (ret = ::read(v.fd, buf, sizeof(buf))) > 0; more = true)
+                {
+                    v.data.append(buf, size_t(ret));
+                    total_bytes += size_t(ret);
+                }
+            }
+        }
+    };
+
+    for (int n = 0; n < viewers; ++n)
+        connect_viewer();
+    if (int(server.m_sessions.size()) != viewers)
+    {
+        printf("broadcast: %d of %d viewers accepted\n", int(server.m_sessions.size()), viewers);
+        return false;
+    }
+
+    // One more viewer joins halfway through
+    int const join = frames / 2;
+    size_t early_at_join = 0, late_at_join = 0;
+
+    lol::timer t;
+    for (int f = 0; f < frames; ++f)
+    {
+        if (f == join)
+            connect_viewer();
+
+        server.step_broadcast();
+        drain();
+
+        if (f == join)
+        {
+            // The late viewer got the latest keyframe and the deltas since
+            // then, which the first viewer already received in order
+            std::string catchup, deltas;
+            for (size_t n = 0; n < server.m_since_keyframe.size(); ++n)
+            {
+                catchup += *server.m_since_keyframe[n];
+                if (n > 0)
+                    deltas += *server.m_since_keyframe[n];
+            }
+
+            auto const &early = clients.front().data, &late = clients.back().data;
+            if (!late.ends_with(catchup) || !early.ends_with(deltas)
+                 || late.compare(0, late.size() - catchup.size(), early, 0, late.size() - catchup.size()))
+            {
+                printf("broadcast: late viewer did not get a keyframe and contiguous deltas\n");
+                ++errors;
+            }
+            early_at_join = early.size();
+            late_at_join = late.size();
+        }
+    }
+    float time = t.get();
+
+    // Every early viewer saw the same stream, and the late viewer the
+    // same deltas once it had caught up
+    auto const &early = clients.front().data, &late = clients.back().data;
+    int mismatches = 0;
+    for (int n = 1; n < viewers; ++n)
+        mismatches += clients[n].data != early;
+    if (late.compare(late_at_join, std::string::npos, early, early_at_join, std::string::npos))
+        ++mismatches;
+    errors += mismatches;
+
+    // Host hand-off: disconnect the second viewer and let a new one
+    // connect, reusing the freed descriptors, then close the host. The
+    // third viewer is now the oldest and must take over.
+    server.close_client(server_fd(clients[1]));
+    ::close(clients[1].fd);
+    clients[1].fd = -1;
+    connect_viewer();
+    if (server.m_host_fd != server_fd(clients[0]))
+        ++errors;
+    server.close_client(server.m_host_fd);
+    if (server.m_host_fd != server_fd(clients[2]))
+    {
+        printf("broadcast: host was not handed over to the oldest viewer\n");
+        ++errors;
+    }
+
+    for (auto const &v : clients)
+        if (v.fd >= 0)
+            ::close(v.fd);
+
+    printf("broadcast: %d viewers, %.3f ms/frame, %.0f bytes/frame/viewer, %d mismatched streams, %d errors\n",
+           viewers, time * 1000.f / frames, double(total_bytes) / frames / (viewers + 1), mismatches, errors);
+    return errors == 0;
+#else
+    (void)cart; (void)viewers; (void)frames;
+    printf("broadcast: not available on this system\n");
+    return false;
+#endif
+}
+
+} // namespace z8
+
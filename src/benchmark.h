@@ -0,0 +1,66 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string> // std::string
+#include <vector> // std::vector
+
+// The benchmark class
+// ———————————————————
+// Micro-benchmarks for the performance sensitive parts of the VM. Each
+// benchmark also checks its results against a reference implementation
+// and returns false on mismatch.
+
+namespace z8
+{
+
+class benchmark
+{
+public:
+    benchmark()
+    {}
+
+    // Compare vm::render() with the per-pixel reference for every
+    // possible screen mode
+    bool render(int frames);
+
+    // Measure print() throughput with 2000 characters per frame, for
+    // each text style, after checking the output against the per-pixel
+    // reference renderer
+    bool print(int frames);
+
+    // Compare the wavetable oscillators with the analytic waveforms, using
+    // the given number of seconds of audio per instrument
+    bool synth(int seconds);
+
+    // Play the music of each cart from pattern 0 for the given number of
+    // seconds, without running any Lua code, and report how much faster
+    // than real time the audio engine runs. The output must match the
+    // per-sample SFX update sample for sample.
+    bool audio(std::vector<std::string> const &carts, int seconds);
+
+    // Run each cart for the given number of frames and report the size
+    // and encoding time of the ANSI output, for full and incremental
+    // frames, in 256-colour and truecolor modes
+    bool ansi(std::vector<std::string> const &carts, int frames);
+
+    // Connect the given number of viewers to a broadcast telnet server on
+    // the loopback interface, plus one more halfway through, and check
+    // that they receive identical streams, that the late viewer gets a
+    // keyframe and contiguous deltas, and that the host role goes to the
+    // oldest remaining viewer
+    bool broadcast(std::string const &cart, int viewers, int frames);
+};
+
+} // namespace z8
+
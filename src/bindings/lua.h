@@ -121,7 +121,7 @@ public:
         *static_cast<vm**>(lua_getextraspace(l)) = that;
 #else
         lua_pushlightuserdata(l, that);
-        lua_setglobal(l, "\x01");
+        lua_rawsetp(l, LUA_REGISTRYINDEX, &this_key);
 #endif
 
         auto lib = typename T::template exported_api<lua>().data;
@@ -131,6 +131,20 @@ public:
         luaL_setfuncs(l, lib.data(), 0);
     }
 
+    // Retrieve the pointer stored by init()
+    template<typename T>
+    static T *get_this(lua_State *l)
+    {
+#if HAVE_LUA_GETEXTRASPACE
+        return *static_cast<T**>(lua_getextraspace(l));
+#else
+        lua_rawgetp(l, LUA_REGISTRYINDEX, &this_key);
+        T *that = (T *)lua_touserdata(l, -1);
+        lua_pop(l, 1);
+        return that;
+#endif
+    }
+
     // Helper to dispatch C++ functions to Lua C bindings
     template<auto FN> struct bind
     {
@@ -160,6 +174,10 @@ public:
     };
 
 private:
+    // The pointer is kept in the registry rather than in a global, so
+    // that carts cannot reach it; only the address of this key matters
+    static inline char const this_key = 0;
+
     // Call a T::* member function with arguments pulled from the Lua stack,
     // and push the result to the Lua stack.
     template<typename T, typename R, typename... A, size_t... IS>
@@ -167,13 +185,7 @@ private:
                                std::index_sequence<IS...>)
     {
         // Retrieve “this” from the Lua state.
-    #if HAVE_LUA_GETEXTRASPACE
-        T *that = *static_cast<T**>(lua_getextraspace(l));
-    #else
-        lua_getglobal(l, "\x01");
-        T *that = (T *)lua_touserdata(l, -1);
-        lua_remove(l, -1);
-    #endif
+        T *that = get_this<T>(l);
 
         // Store this for API functions that we don’t know yet how to wrap
         that->m_sandbox_lua = l;
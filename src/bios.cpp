@@ -28,6 +28,24 @@ bios::bios()
     // Initialize BIOS
     if (!m_cart.load(filename))
         lol::msg::error("unable to load BIOS file %s\n", filename);
+
+    // Extract glyph bitmasks from the font; characters 0x80 and above
+    // are twice as wide and use two consecutive font cells.
+    for (int ch = 0; ch < 256; ++ch)
+    {
+        int offset = ch < 0x80 ? ch : 2 * ch - 0x80;
+        int16_t font_x = offset % 32 * 4;
+        int16_t font_y = offset / 32 * 6;
+
+        for (int16_t dy = 0; dy < 8; ++dy)
+        {
+            uint8_t row = 0;
+            for (int16_t dx = 0; dx < 8; ++dx)
+                if (get_spixel(font_x + dx, font_y + dy))
+                    row |= 1 << dx;
+            m_glyphs[ch][dy] = row;
+        }
+    }
 }
 
 } // namespace z8
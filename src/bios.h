@@ -40,8 +40,17 @@ public:
         return m_cart.get_rom().gfx.get(x, y);
     }
 
+    // Row dy of the font glyph for character ch, as a bitmask where bit n
+    // is set if the pixel in column n is on. Precomputed at load time so
+    // that print() does not need to read the font pixel by pixel.
+    uint8_t get_glyph_row(uint8_t ch, int16_t dy) const
+    {
+        return m_glyphs[ch][dy & 7];
+    }
+
 private:
     cart m_cart;
+    uint8_t m_glyphs[256][8];
 };
 
 } // namespace z8
@@ -12,8 +12,15 @@
 
 #include "filter.h"
 
-#include <lol/math> // lol::rand
+#include <lol/math> // lol::F_TAU
 #include <cmath> // std::fabs, std::fmod, std::sin
+#if defined __SSE__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 1)
+#   include <xmmintrin.h>
+#   define HAVE_FILTER4_SSE 1
+#elif defined __ARM_NEON
+#   include <arm_neon.h>
+#   define HAVE_FILTER4_NEON 1
+#endif
 
 namespace z8
 {
@@ -95,4 +102,59 @@ float filter::run(float input)
     return output;
 }
 
+filter4::filter4(filter::type t, float freq, float q, float gain)
+{
+    filter f(t, freq, q, gain);
+    c1 = f.c1;
+    c2 = f.c2;
+    c3 = f.c3;
+    c4 = f.c4;
+    c5 = f.c5;
+}
+
+void filter4::run(float const input[4], float output[4])
+{
+    // The order of operations matches filter::run() so that results are
+    // bit-identical to four separate filters.
+#if HAVE_FILTER4_SSE
+    __m128 in = _mm_loadu_ps(input);
+    __m128 li = _mm_load_ps(linput);
+    __m128 lo = _mm_load_ps(loutput);
+    __m128 out = _mm_mul_ps(_mm_set1_ps(c1), in);
+    out = _mm_add_ps(out, _mm_mul_ps(_mm_set1_ps(c2), li));
+    out = _mm_add_ps(out, _mm_mul_ps(_mm_set1_ps(c3), _mm_load_ps(llinput)));
+    out = _mm_sub_ps(out, _mm_mul_ps(_mm_set1_ps(c4), lo));
+    out = _mm_sub_ps(out, _mm_mul_ps(_mm_set1_ps(c5), _mm_load_ps(lloutput)));
+    _mm_store_ps(llinput, li);
+    _mm_store_ps(linput, in);
+    _mm_store_ps(lloutput, lo);
+    _mm_store_ps(loutput, out);
+    _mm_storeu_ps(output, out);
+#elif HAVE_FILTER4_NEON
+    float32x4_t in = vld1q_f32(input);
+    float32x4_t li = vld1q_f32(linput);
+    float32x4_t lo = vld1q_f32(loutput);
+    float32x4_t out = vmulq_f32(vdupq_n_f32(c1), in);
+    out = vaddq_f32(out, vmulq_f32(vdupq_n_f32(c2), li));
+    out = vaddq_f32(out, vmulq_f32(vdupq_n_f32(c3), vld1q_f32(llinput)));
+    out = vsubq_f32(out, vmulq_f32(vdupq_n_f32(c4), lo));
+    out = vsubq_f32(out, vmulq_f32(vdupq_n_f32(c5), vld1q_f32(lloutput)));
+    vst1q_f32(llinput, li);
+    vst1q_f32(linput, in);
+    vst1q_f32(lloutput, lo);
+    vst1q_f32(loutput, out);
+    vst1q_f32(output, out);
+#else
+    for (int i = 0; i < 4; ++i)
+    {
+        float out = c1 * input[i] + c2 * linput[i] + c3 * llinput[i] - c4 * loutput[i] - c5 * lloutput[i];
+        llinput[i] = linput[i];
+        linput[i] = input[i];
+        lloutput[i] = loutput[i];
+        loutput[i] = out;
+        output[i] = out;
+    }
+#endif
+}
+
 } // namespace z8
@@ -41,5 +41,25 @@ public:
     float lloutput = 0;
 };
 
+//
+// Four biquad filters sharing the same coefficients, with their state
+// stored as structure of arrays so that they run in parallel
+//
+
+class filter4
+{
+public:
+    filter4(filter::type t, float freq, float q, float gain);
+
+    // Filter one sample for each of the four lanes
+    void run(float const input[4], float output[4]);
+
+    float c1, c2, c3, c4, c5;
+    alignas(16) float linput[4] = {};
+    alignas(16) float llinput[4] = {};
+    alignas(16) float loutput[4] = {};
+    alignas(16) float lloutput[4] = {};
+};
+
 } // namespace z8
 
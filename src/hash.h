@@ -0,0 +1,59 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstddef>     // size_t
+#include <cstdint>     // uint64_t
+#include <cstring>     // memcpy
+#include <type_traits> // std::is_trivially_copyable_v
+
+// The hasher class
+// ————————————————
+// A 64-bit FNV-style hash that consumes eight bytes at a time. It is fast
+// enough to run over the whole PICO-8 memory every frame, but it is not
+// meant to resist deliberate collisions.
+
+namespace z8
+{
+
+class hasher
+{
+public:
+    void add(void const *data, size_t size)
+    {
+        auto p = (uint8_t const *)data;
+        for (; size >= 8; size -= 8, p += 8)
+        {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            m_hash = (m_hash ^ word) * 0x100000001b3u;
+        }
+        for (; size; --size)
+            m_hash = (m_hash ^ *p++) * 0x100000001b3u;
+    }
+
+    // Only for values without padding, since padding bytes are undefined
+    template<typename T>
+    void add(T const &value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        add(&value, sizeof(value));
+    }
+
+    uint64_t get() const { return m_hash; }
+
+private:
+    uint64_t m_hash = 0xcbf29ce484222325u;
+};
+
+} // namespace z8
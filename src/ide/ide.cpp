@@ -69,7 +69,8 @@ void ide::load(std::string const &name)
     m_vm = m_player->get_vm();
 
     m_text_editor->attach(m_vm);
-    m_ram_editor->attach(m_vm->ram());
+    // Edits bypass the VM, which must refresh its caches
+    m_ram_editor->attach(m_vm->ram(), [vm = m_vm]() { vm->ram_changed(); });
     m_rom_editor->attach(m_vm->rom());
 }
 
@@ -122,7 +123,7 @@ void ide::tick_game(float seconds)
         // Mark all 256-char ranges covered by the PICO-8 charset
         std::unordered_set<uint32_t> pico8_ranges;
         for (int i = 0; i < 256; ++i)
-            for (char32_t ch : pico8::charset::to_utf32[i])
+            for (char32_t ch : pico8::charset::to_utf32(uint8_t(i)))
                 pico8_ranges.insert(ch >> 8);
 
         // Create an array of char ranges for AddFontFromFileTTF()
@@ -444,11 +445,14 @@ void ide::tick_draw(float seconds, lol::Scene &scene)
         m_commands[1] = false;
     }
 
-    std::vector<lol::u8vec4> buf(128 * 128);
-    if (m_vm)
+    // Only upload the screen when the VM completed a new frame
+    if (m_vm && m_vm->acquire_frame())
+    {
+        std::vector<lol::u8vec4> buf(128 * 128);
         m_vm->render(buf.data());
-    m_screen->Bind();
-    m_screen->SetData(buf.data());
+        m_screen->Bind();
+        m_screen->SetData(buf.data());
+    }
 }
 
 } // namespace z8
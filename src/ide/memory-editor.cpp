@@ -33,14 +33,40 @@ memory_editor::~memory_editor()
 {
 }
 
-void memory_editor::attach(std::tuple<uint8_t *, size_t> area)
+void memory_editor::attach(std::tuple<uint8_t *, size_t> area,
+                           std::function<void()> on_write)
 {
     m_area = area;
+    m_on_write = std::move(on_write);
 }
 
 void memory_editor::render()
 {
-    m_editor.DrawContents(std::get<0>(m_area), std::get<1>(m_area));
+    auto [data, size] = m_area;
+    if (!m_on_write)
+    {
+        m_editor.DrawContents(data, size);
+        return;
+    }
+
+    // Edit a copy, so that the bytes the user changed can be told apart
+    // from those the VM changed in the meantime
+    m_before.assign(data, data + size);
+    m_after = m_before;
+    m_editor.DrawContents(m_after.data(), size);
+
+    bool changed = false;
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (m_after[i] != m_before[i])
+        {
+            data[i] = m_after[i];
+            changed = true;
+        }
+    }
+
+    if (changed)
+        m_on_write();
 }
 
 } // namespace z8
@@ -13,6 +13,8 @@
 #pragma once
 
 #include <lol/engine.h> // for the ImGui headers and much more stuff
+#include <functional>    // std::function
+#include <vector>        // std::vector
 #include "3rdparty/imgui-club/imgui_memory_editor/imgui_memory_editor.h"
 
 namespace z8
@@ -24,11 +26,15 @@ public:
     memory_editor();
     ~memory_editor();
 
-    void attach(std::tuple<uint8_t *, size_t> area);
+    // If on_write is set, it is called after the user modified the area
+    void attach(std::tuple<uint8_t *, size_t> area,
+                std::function<void()> on_write = nullptr);
     void render();
 
 private:
     std::tuple<uint8_t *, size_t> m_area;
+    std::function<void()> m_on_write;
+    std::vector<uint8_t> m_before, m_after;
     MemoryEditor m_editor;
 };
 
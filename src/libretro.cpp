@@ -15,65 +15,106 @@
 #endif
 
 #include <lol/msg>    // lol::msg
-#include <lol/narray> // lol::array2d
 #include <lol/utils> // lol::ends_with
+#include <algorithm>  // std::min, std::sort, std::unique
 #include <array>      // std::array
 #include <cstring>    // std::memset
-#include <memory>     // std::shared_ptr
+#include <memory>     // std::shared_ptr, std::unique_ptr
+#include <string>     // std::string
 #include <vector>     // std::vector
 
 #include "zepto8.h"
 #include "pico8/vm.h"
 #include "pico8/pico8.h"
 #include "raccoon/vm.h"
+#include "hash.h"
+#include "resampler.h"
 
 #include "libretro.h"
 
 #define EXPORT extern "C" RETRO_API
 
-// Callbacks provided by retroarch
-static retro_video_refresh_t video_cb;
-static retro_audio_sample_t audio_cb;
-static retro_audio_sample_batch_t audio_batch_cb;
-static retro_environment_t enviro_cb;
-static retro_input_poll_t input_poll_cb;
-static retro_input_state_t input_state_cb;
+namespace
+{
+
+// Everything that belongs to a loaded game. It only exists between
+// retro_load_game() and retro_unload_game(), and the VM is only created
+// there, once we know which kind of cart to run.
+struct game
+{
+    bool is_raccoon = false;
+    std::shared_ptr<z8::vm_base> vm;
+    // Fallback framebuffer, large enough for either pixel format
+    std::vector<uint32_t> fb;
+    // Audio is rendered at 22050 Hz and upsampled to the advertised 44100 Hz
+    z8::upsampler upsampler;
+    int audio_remainder = 0;
+    std::vector<int16_t> audio_in, audio_out;
+    // Memory map descriptors, kept alive for the frontend
+    std::vector<retro_memory_descriptor> memory_descriptors;
+};
+
+// The whole core state. The libretro API has no instance handle, so
+// there is exactly one of these per loaded copy of the core; the VM
+// itself keeps no process-wide state, so several copies of the core
+// can run in the same process.
+struct core
+{
+    // Callbacks provided by the frontend
+    retro_video_refresh_t video_cb = nullptr;
+    retro_audio_sample_t audio_cb = nullptr;
+    retro_audio_sample_batch_t audio_batch_cb = nullptr;
+    retro_environment_t enviro_cb = nullptr;
+    retro_input_poll_t input_poll_cb = nullptr;
+    retro_input_state_t input_state_cb = nullptr;
+
+    retro_pixel_format pixel_format = RETRO_PIXEL_FORMAT_RGB565;
+    // Whether the frontend accepts a NULL frame to mean "same as before"
+    bool can_dupe = false;
+
+    std::unique_ptr<game> current;
+};
+
+core ctx;
+
+std::array<int, 7> const buttons
+{
+    RETRO_DEVICE_ID_JOYPAD_LEFT,
+    RETRO_DEVICE_ID_JOYPAD_RIGHT,
+    RETRO_DEVICE_ID_JOYPAD_UP,
+    RETRO_DEVICE_ID_JOYPAD_DOWN,
+    RETRO_DEVICE_ID_JOYPAD_A,
+    RETRO_DEVICE_ID_JOYPAD_B,
+    RETRO_DEVICE_ID_JOYPAD_START,
+};
 
-// Global core state
-static bool is_raccoon;
-static std::shared_ptr<z8::vm_base> vm;
-static lol::array2d<lol::u8vec4> fb32;
-static lol::array2d<uint16_t> fb16;
+} // anonymous namespace
 
 EXPORT void retro_set_environment(retro_environment_t cb)
 {
-    enviro_cb = cb;
+    ctx.enviro_cb = cb;
     // We can run without a cartridge
     bool no_rom = true;
-    enviro_cb(RETRO_ENVIRONMENT_SET_SUPPORT_NO_GAME, &no_rom);
+    ctx.enviro_cb(RETRO_ENVIRONMENT_SET_SUPPORT_NO_GAME, &no_rom);
     // Looks good to me
     char const *system_dir;
-    enviro_cb(RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY, &system_dir);
+    ctx.enviro_cb(RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY, &system_dir);
 }
 
-EXPORT void retro_set_video_refresh(retro_video_refresh_t cb) { video_cb = cb; }
-EXPORT void retro_set_audio_sample(retro_audio_sample_t cb) { audio_cb = cb; }
-EXPORT void retro_set_audio_sample_batch(retro_audio_sample_batch_t cb) { audio_batch_cb = cb; }
-EXPORT void retro_set_input_poll(retro_input_poll_t cb) { input_poll_cb = cb; }
-EXPORT void retro_set_input_state(retro_input_state_t cb) { input_state_cb = cb; }
+EXPORT void retro_set_video_refresh(retro_video_refresh_t cb) { ctx.video_cb = cb; }
+EXPORT void retro_set_audio_sample(retro_audio_sample_t cb) { ctx.audio_cb = cb; }
+EXPORT void retro_set_audio_sample_batch(retro_audio_sample_batch_t cb) { ctx.audio_batch_cb = cb; }
+EXPORT void retro_set_input_poll(retro_input_poll_t cb) { ctx.input_poll_cb = cb; }
+EXPORT void retro_set_input_state(retro_input_state_t cb) { ctx.input_state_cb = cb; }
 
 EXPORT void retro_init()
 {
-    // Allocate framebuffer and VM
-    vm = std::make_shared<z8::pico8::vm>();
-    fb32.resize(lol::ivec2(128, 128));
-    fb16.resize(lol::ivec2(128, 128));
+    // Nothing to do until a game is loaded
 }
 
 EXPORT void retro_deinit()
 {
-    fb32.clear();
-    fb16.clear();
+    ctx.current.reset();
 }
 
 EXPORT unsigned retro_api_version()
@@ -101,49 +142,108 @@ EXPORT void retro_get_system_av_info(struct retro_system_av_info *info)
     info->timing.fps = 60.f;
     info->timing.sample_rate = 44100.f;
 
-    retro_pixel_format pf = RETRO_PIXEL_FORMAT_RGB565;
-    enviro_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pf);
+    // Prefer XRGB8888 and fall back to RGB565, which all frontends support
+    ctx.pixel_format = RETRO_PIXEL_FORMAT_XRGB8888;
+    if (!ctx.enviro_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &ctx.pixel_format))
+    {
+        ctx.pixel_format = RETRO_PIXEL_FORMAT_RGB565;
+        ctx.enviro_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &ctx.pixel_format);
+    }
+
+    if (!ctx.enviro_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &ctx.can_dupe))
+        ctx.can_dupe = false;
 }
 
 EXPORT void retro_set_controller_port_device(unsigned port, unsigned device)
 {
 }
 
+static void reset_audio(game &g)
+{
+    g.upsampler.reset();
+    g.audio_remainder = 0;
+}
+
 EXPORT void retro_reset()
 {
+    if (ctx.current)
+        reset_audio(*ctx.current);
 }
 
-static std::array<int, 7> buttons
+static void render_video(game &g, lol::ivec2 res)
 {
-    RETRO_DEVICE_ID_JOYPAD_LEFT,
-    RETRO_DEVICE_ID_JOYPAD_RIGHT,
-    RETRO_DEVICE_ID_JOYPAD_UP,
-    RETRO_DEVICE_ID_JOYPAD_DOWN,
-    RETRO_DEVICE_ID_JOYPAD_A,
-    RETRO_DEVICE_ID_JOYPAD_B,
-    RETRO_DEVICE_ID_JOYPAD_START,
-};
+    size_t const bpp = ctx.pixel_format == RETRO_PIXEL_FORMAT_XRGB8888 ? 4 : 2;
+
+    retro_framebuffer frame = {};
+    frame.width = unsigned(res.x);
+    frame.height = unsigned(res.y);
+    frame.access_flags = RETRO_MEMORY_ACCESS_WRITE;
+
+    void *data;
+    size_t pitch;
+    if (ctx.enviro_cb(RETRO_ENVIRONMENT_GET_CURRENT_SOFTWARE_FRAMEBUFFER, &frame)
+         && frame.data && frame.format == ctx.pixel_format && frame.pitch % bpp == 0)
+    {
+        data = frame.data;
+        pitch = frame.pitch;
+    }
+    else
+    {
+        g.fb.resize(size_t(res.x * res.y));
+        data = g.fb.data();
+        pitch = bpp * res.x;
+    }
+
+    if (ctx.pixel_format == RETRO_PIXEL_FORMAT_XRGB8888)
+        g.vm->render_xrgb8888((uint32_t *)data, int(pitch / bpp));
+    else
+        g.vm->render_rgb565((uint16_t *)data, int(pitch / bpp));
+    ctx.video_cb(data, unsigned(res.x), unsigned(res.y), pitch);
+}
 
 EXPORT void retro_run()
 {
+    if (!ctx.current)
+        return;
+
+    auto &g = *ctx.current;
+
     // Update input
-    input_poll_cb();
+    ctx.input_poll_cb();
     for (int n = 0; n < 8; ++n)
         for (int k = 0; k < 7; ++k)
-            vm->button(n, k, input_state_cb(n, RETRO_DEVICE_JOYPAD, 0, buttons[k]));
+            g.vm->button(n, k, ctx.input_state_cb(n, RETRO_DEVICE_JOYPAD, 0, buttons[k]));
 
-    // Step VM
-    vm->step(1.f / 60);
-
-    // Render video, convert to RGB565, send back to frontend
-    vm->render(fb32.data());
-    for (int y = 0; y < 128; ++y)
-    for (int x = 0; x < 128; ++x)
-        fb16(x, y) = uint16_t(lol::dot(lol::ivec3(fb32(x, y).rgb) / lol::ivec3(8, 4, 8),
-                                       lol::ivec3(2048, 32, 1)));
-    video_cb(fb16.data(), 128, 128, 2 * 128);
+    // The frontend may have written to the memory we exposed, e.g. to
+    // apply cheats, so the VM must drop whatever it derived from it
+    g.vm->ram_changed();
 
-    // Render audio
+    // Step VM
+    g.vm->step(1.f / 60);
+
+    // Render video in the negotiated pixel format. If the frontend lends
+    // us its own framebuffer, render there directly; otherwise use ours.
+    // When the frame did not change, let the frontend reuse the last one.
+    bool const changed = g.vm->acquire_frame();
+    auto res = g.vm->get_screen_resolution();
+    if (!changed && ctx.can_dupe)
+        ctx.video_cb(nullptr, unsigned(res.x), unsigned(res.y), 0);
+    else
+        render_video(g, res);
+
+    // Render audio. One video frame is 22050 / 60 = 367.5 synth samples,
+    // so keep the remainder of the division from one frame to the next
+    // in order to alternate between 367 and 368 samples. This adds up
+    // to exactly 44100 output frames per second and never drifts.
+    g.audio_remainder += 22050;
+    size_t const count = size_t(g.audio_remainder / 60);
+    g.audio_remainder %= 60;
+
+    g.audio_in.resize(count);
+    g.audio_out.resize(count * 4);
+    g.vm->get_audio(g.audio_in.data(), count * sizeof(int16_t));
+    g.upsampler.run(g.audio_in.data(), count, g.audio_out.data());
+    ctx.audio_batch_cb(g.audio_out.data(), count * 2);
 }
 
 EXPORT size_t retro_serialize_size()
@@ -169,13 +269,71 @@ EXPORT void retro_cheat_set(unsigned index, bool enabled, const char *code)
 {
 }
 
+// Describe the VM memory to the frontend, for achievements and cheats.
+// The RAM is split at the save data, which gets its own flag, and at
+// 0x8000, where the extended memory starts. Frontends write there
+// between two calls to retro_run(), which calls ram_changed().
+static void set_memory_maps(game &g)
+{
+    auto [ram, ram_size] = g.vm->ram();
+    auto [save, save_size] = g.vm->save_ram();
+    size_t const save_start = save ? size_t(save - ram) : ram_size;
+    size_t const save_end = save_start + save_size;
+
+    std::vector<size_t> bounds { 0, save_start, save_end, 0x8000, ram_size };
+    for (auto &b : bounds)
+        b = std::min(b, ram_size);
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+    g.memory_descriptors.clear();
+    for (size_t i = 0; i + 1 < bounds.size(); ++i)
+    {
+        retro_memory_descriptor desc = {};
+        desc.flags = bounds[i] == save_start && save_size ? RETRO_MEMDESC_SAVE_RAM
+                                                          : RETRO_MEMDESC_SYSTEM_RAM;
+        desc.ptr = ram;
+        desc.offset = bounds[i];
+        desc.start = bounds[i];
+        desc.len = bounds[i + 1] - bounds[i];
+        g.memory_descriptors.push_back(desc);
+    }
+
+    retro_memory_map map = { g.memory_descriptors.data(), unsigned(g.memory_descriptors.size()) };
+    ctx.enviro_cb(RETRO_ENVIRONMENT_SET_MEMORY_MAPS, &map);
+}
+
 EXPORT bool retro_load_game(struct retro_game_info const *info)
 {
-    is_raccoon = lol::ends_with(info->path, ".rcn.json");
-    is_raccoon ? vm = std::make_shared<z8::raccoon::vm>()
-               : vm = std::make_shared<z8::pico8::vm>();
-    vm->load(info->path);
-    vm->run();
+    // No game info means that the frontend wants us to run without a cart
+    std::string const path = info && info->path ? info->path : "";
+
+    auto g = std::make_unique<game>();
+    g->is_raccoon = lol::ends_with(path, ".rcn.json");
+    if (g->is_raccoon)
+        g->vm = std::make_shared<z8::raccoon::vm>();
+    else
+        g->vm = std::make_shared<z8::pico8::vm>();
+
+    // The frontend persists the cart data through RETRO_MEMORY_SAVE_RAM
+    g->vm->set_external_save(true);
+    // retro_run() pulls the audio of each frame with get_audio()
+    g->vm->set_audio_consumer(true);
+    if (!path.empty())
+        g->vm->load(path);
+
+    // Netplay peers must compute the same frames from the same input.
+    // libretro cannot share a random seed, so derive it from the cart.
+    auto [rom, rom_size] = g->vm->rom();
+    z8::hasher seed;
+    seed.add(rom, rom_size);
+    g->vm->set_deterministic(true, uint32_t(seed.get()));
+
+    g->vm->run();
+    reset_audio(*g);
+    set_memory_maps(*g);
+
+    ctx.current = std::move(g);
     return true;
 }
 
@@ -187,6 +345,7 @@ EXPORT bool retro_load_game_special(unsigned game_type,
 
 EXPORT void retro_unload_game()
 {
+    ctx.current.reset();
 }
 
 EXPORT unsigned retro_get_region()
@@ -194,13 +353,27 @@ EXPORT unsigned retro_get_region()
     return 0;
 }
 
+// Both regions point directly into the VM memory; see set_memory_maps()
+// for how writes from the frontend are handled
+static std::tuple<uint8_t *, size_t> get_memory(unsigned id)
+{
+    if (ctx.current)
+    {
+        switch (id)
+        {
+        case RETRO_MEMORY_SAVE_RAM: return ctx.current->vm->save_ram();
+        case RETRO_MEMORY_SYSTEM_RAM: return ctx.current->vm->ram();
+        }
+    }
+    return std::make_tuple(nullptr, 0);
+}
+
 EXPORT void *retro_get_memory_data(unsigned id)
 {
-    return nullptr;
+    return std::get<0>(get_memory(id));
 }
 
 EXPORT size_t retro_get_memory_size(unsigned id)
 {
-    return 0;
+    return std::get<1>(get_memory(id));
 }
-
@@ -0,0 +1,89 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <algorithm> // std::max, std::max_element
+#include <cmath>     // std::abs
+#include <thread>    // std::this_thread
+
+#include "pacer.h"
+
+namespace z8
+{
+
+// Exponential smoothing of the published statistics
+static void smooth(std::atomic<float> &stat, float value)
+{
+    float const old = stat.load();
+    stat = old + (value - old) * 0.1f;
+}
+
+static float to_ms(pacer::clock::duration d)
+{
+    return std::chrono::duration<float, std::milli>(d).count();
+}
+
+pacer::pacer(double fps)
+  : m_period(std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / fps)))
+{
+}
+
+void pacer::tick()
+{
+    auto const now = clock::now();
+
+    // How far the tick started from where the nominal period says
+    if (m_tick_start != clock::time_point())
+    {
+        auto const interval = now - m_tick_start;
+        smooth(m_jitter_ms, std::abs(to_ms(interval - m_period)));
+    }
+    m_tick_start = now;
+
+    // Leave room for the recent worst-case step plus 25%, and for
+    // the draw thread to convert and upload the frame
+    auto const worst = *std::max_element(std::begin(m_steps), std::end(m_steps));
+    auto delay = clock::duration(0);
+    if (m_jit)
+        delay = std::max(m_period - worst - worst / 4 - draw_margin, clock::duration(0));
+    m_delay_ms = to_ms(delay);
+
+    if (delay > clock::duration(0))
+        std::this_thread::sleep_until(now + delay);
+}
+
+void pacer::begin_step()
+{
+    m_step_start = clock::now();
+    m_input_time = m_step_start;
+}
+
+void pacer::end_step()
+{
+    auto const duration = clock::now() - m_step_start;
+    m_steps[m_step_index] = duration;
+    m_step_index = (m_step_index + 1) % history;
+    smooth(m_step_ms, to_ms(duration));
+}
+
+void pacer::presented(clock::time_point input_time)
+{
+    if (input_time == clock::time_point())
+        return;
+
+    smooth(m_latency_ms, to_ms(clock::now() - input_time + m_period));
+}
+
+} // namespace z8
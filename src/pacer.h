@@ -0,0 +1,82 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <atomic> // std::atomic
+#include <chrono> // std::chrono
+
+// The pacer class
+// ———————————————
+// Measures the timing of the game loop and, optionally, schedules each
+// VM step just in time: instead of sampling input and stepping as soon
+// as the tick starts, it waits so that the step ends shortly before the
+// next tick is due, based on the recent worst-case step duration. Input
+// is then as fresh as possible when the frame is displayed.
+//
+// It also estimates input-to-photon latency: the time at which input was
+// sampled travels with the frame built from it, and when that frame is
+// uploaded, the time to the next buffer swap and to the middle of the
+// scan-out (one period on average) is added.
+//
+// All statistics are in milliseconds and may be read from any thread.
+
+namespace z8
+{
+
+class pacer
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    pacer(double fps = 60.0);
+
+    void set_jit(bool enabled) { m_jit = enabled; }
+
+    // Game thread: call tick() when the tick starts, then begin_step()
+    // right before sampling input, and end_step() after the VM step
+    void tick();
+    void begin_step();
+    void end_step();
+
+    // When the input for the latest step was sampled
+    clock::time_point input_time() const { return m_input_time.load(); }
+
+    // Draw thread: a frame built from input sampled at input_time was
+    // just uploaded
+    void presented(clock::time_point input_time);
+
+    float jitter_ms() const { return m_jitter_ms; }
+    float step_ms() const { return m_step_ms; }
+    float delay_ms() const { return m_delay_ms; }
+    float latency_ms() const { return m_latency_ms; }
+
+private:
+    // Time left for conversion, upload and buffer swap after the step
+    static constexpr auto draw_margin = std::chrono::milliseconds(4);
+    static int const history = 32;
+
+    clock::duration m_period;
+    bool m_jit = false;
+
+    clock::time_point m_tick_start, m_step_start;
+    clock::duration m_steps[history] = {};
+    int m_step_index = 0;
+
+    std::atomic<clock::time_point> m_input_time;
+    std::atomic<float> m_jitter_ms = 0.f;
+    std::atomic<float> m_step_ms = 0.f;
+    std::atomic<float> m_delay_ms = 0.f;
+    std::atomic<float> m_latency_ms = 0.f;
+};
+
+} // namespace z8
@@ -198,8 +198,17 @@ static std::string printable(char ch)
                                      : std::format("${:d}", uint8_t(ch));
 }
 
-static uint8_t const *compress_lut = nullptr;
-static char const *decompress_lut = "\n 0123456789abcdefghijklmnopqrstuvwxyz!#%(){}[]<>+=/*:;.,~_";
+static constexpr char decompress_lut[] = "\n 0123456789abcdefghijklmnopqrstuvwxyz!#%(){}[]<>+=/*:;.,~_";
+
+// Reverse of decompress_lut, built at compile time so that concurrent
+// compressions share it without any initialisation race
+static constexpr auto compress_lut = []()
+{
+    std::array<uint8_t, 256> ret {};
+    for (int i = 0; i < 0x3b; ++i)
+        ret[(uint8_t)decompress_lut[i]] = i + 1;
+    return ret;
+}();
 
 static std::string pxa_decompress(uint8_t const *input)
 {
@@ -309,7 +318,7 @@ static std::string legacy_decompress(uint8_t const *input)
 
 static std::vector<uint8_t> pxa_compress(std::string const& input, bool fast)
 {
-    static int compress_bits[16] =
+    static int const compress_bits[16] =
     {
         // this[n/16] is the number of bits required to encode n
         4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7, 8
@@ -589,15 +598,6 @@ static std::vector<uint8_t> legacy_compress(std::string const &input)
         0, 0 // FIXME: what is this?
     });
 
-    // Ensure the compression LUT is initialised
-    if (!compress_lut)
-    {
-        static uint8_t tmp[256] = { 0 };
-        for (int i = 0; i < 0x3b; ++i)
-            tmp[(uint8_t)decompress_lut[i]] = i + 1;
-        compress_lut = tmp;
-    }
-
     // FIXME: PICO-8 appears to be adding an implicit \n at the end of the code, and ignoring it
     // when compressing code. So for the moment we write one char too many.
     for (int i = 0; i < (int)input.length(); ++i)
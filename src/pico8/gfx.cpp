@@ -16,6 +16,7 @@
 
 #include <lol/math>  // lol::round, lol::mix
 #include <algorithm> // std::swap
+#include <bit>       // std::countr_zero
 #include <cmath>     // std::min, std::max
 
 #include "pico8/vm.h"
@@ -74,17 +75,17 @@ uint32_t vm::raw_to_bits(uint8_t c) const
     return bits;
 }
 
-uint8_t vm::get_pixel(int16_t x, int16_t y) const
+uint8_t vm::get_pixel(u4mat2<128, 128> const &screen, int16_t x, int16_t y) const
 {
     auto &ds = m_ram.draw_state;
 
     if (x < ds.clip.x1 || x >= ds.clip.x2 || y < ds.clip.y1 || y >= ds.clip.y2)
         return 0;
 
-    return get_current_screen().get(x, y);
+    return screen.get(x, y);
 }
 
-void vm::set_pixel(int16_t x, int16_t y, uint32_t color_bits)
+void vm::set_pixel(u4mat2<128, 128> &screen, int16_t x, int16_t y, uint32_t color_bits)
 {
     auto &ds = m_ram.draw_state;
     auto &hw = m_ram.hw_state;
@@ -104,15 +105,55 @@ void vm::set_pixel(int16_t x, int16_t y, uint32_t color_bits)
 
     if (hw.bit_mask)
     {
-        uint8_t old = get_current_screen().get(x, y);
+        uint8_t old = screen.get(x, y);
         color = (old & ~(hw.bit_mask & 7))
               | (color & (hw.bit_mask & 7) & (hw.bit_mask >> 4));
     }
 
-    get_current_screen().set(x, y, color);
+    screen.set(x, y, color);
 }
 
-void vm::hline(int16_t x1, int16_t x2, int16_t y, uint32_t color_bits)
+// Test a shape's bounding box (inclusive) against the clip rectangle once,
+// so that callers can skip it entirely or write pixels without clipping.
+// A box is only reported as visible if plain colour writes can be used,
+// i.e. there is no fill pattern and no bit mask.
+vm::clip_state vm::clip_test(int x0, int y0, int x1, int y1, uint32_t color_bits) const
+{
+    auto &ds = m_ram.draw_state;
+    auto &hw = m_ram.hw_state;
+
+    if (x1 < ds.clip.x1 || x0 >= ds.clip.x2 || y1 < ds.clip.y1 || y0 >= ds.clip.y2
+         || x0 > x1 || y0 > y1)
+        return clip_state::hidden;
+
+    if (x0 < ds.clip.x1 || x1 >= ds.clip.x2 || y0 < ds.clip.y1 || y1 >= ds.clip.y2
+         || (color_bits & 0xffff) || hw.bit_mask)
+        return clip_state::partial;
+
+    return clip_state::visible;
+}
+
+// Fill pixels x1 to x2 (inclusive) of a screen row with a solid colour,
+// writing whole bytes for the aligned interior.
+static inline void fill_row(uint8_t *p, int x1, int x2, uint8_t color)
+{
+    if (x1 & 1)
+    {
+        p[x1 / 2] = (p[x1 / 2] & 0x0f) | (color << 4);
+        ++x1;
+    }
+
+    if ((x2 & 1) == 0)
+    {
+        p[x2 / 2] = (p[x2 / 2] & 0xf0) | color;
+        --x2;
+    }
+
+    if (x2 > x1)
+        ::memset(p + x1 / 2, color * 0x11, (x2 - x1 + 1) / 2);
+}
+
+void vm::hline(u4mat2<128, 128> &screen, int16_t x1, int16_t x2, int16_t y, uint32_t color_bits)
 {
     using std::min, std::max;
 
@@ -135,30 +176,85 @@ void vm::hline(int16_t x1, int16_t x2, int16_t y, uint32_t color_bits)
     if ((color_bits & 0xffff) || hw.bit_mask)
     {
         for (int16_t x = x1; x <= x2; ++x)
-            set_pixel(x, y, color_bits);
+            set_pixel(screen, x, y, color_bits);
     }
     else
     {
-        uint8_t *p = get_current_screen().data[y];
-        uint8_t color = (color_bits >> 16) & 0xf;
+        fill_row(screen.data[y], x1, x2, (color_bits >> 16) & 0xf);
+    }
+}
 
-        if (x1 & 1)
+// Copy w pixels from a source row starting at sx to a screen row starting
+// at dx, a whole byte at a time when both start on the same nibble.
+static inline void copy_row(uint8_t *dst, int dx, uint8_t const *src, int sx, int w)
+{
+    if (((dx ^ sx) & 1) == 0)
+    {
+        if (dx & 1)
         {
-            p[x1 / 2] = (p[x1 / 2] & 0x0f) | (color << 4);
-            ++x1;
+            dst[dx / 2] = (dst[dx / 2] & 0x0f) | (src[sx / 2] & 0xf0);
+            ++dx; ++sx; --w;
         }
 
-        if ((x2 & 1) == 0)
+        ::memcpy(dst + dx / 2, src + sx / 2, w / 2);
+
+        if (w & 1)
         {
-            p[x2 / 2] = (p[x2 / 2] & 0xf0) | color;
-            --x2;
+            dx += w - 1; sx += w - 1;
+            dst[dx / 2] = (dst[dx / 2] & 0xf0) | (src[sx / 2] & 0x0f);
         }
+        return;
+    }
 
-        ::memset(p + x1 / 2, color * 0x11, (x2 - x1 + 1) / 2);
+    for (int i = 0; i < w; ++i)
+    {
+        int x = sx + i, y = dx + i;
+        uint8_t c = x & 1 ? src[x / 2] >> 4 : src[x / 2] & 0xf;
+        uint8_t &p = dst[y / 2];
+        p = y & 1 ? (p & 0x0f) | (c << 4) : (p & 0xf0) | c;
     }
 }
 
-void vm::vline(int16_t x, int16_t y1, int16_t y2, uint32_t color_bits)
+// Draw the pixels of a horizontal span of up to 64 pixels starting at x;
+// bit n of mask selects pixel x + n.
+void vm::hspan(u4mat2<128, 128> &screen, int16_t x, int16_t y, uint64_t mask, uint32_t color_bits)
+{
+    auto &ds = m_ram.draw_state;
+    auto &hw = m_ram.hw_state;
+
+    if (!mask || y < ds.clip.y1 || y >= ds.clip.y2)
+        return;
+
+    // Clip the mask horizontally
+    int lo = ds.clip.x1 - x, hi = ds.clip.x2 - x;
+    if (lo > 0)
+        mask = lo >= 64 ? 0 : mask & (~uint64_t(0) << lo);
+    if (hi < 64)
+        mask = hi <= 0 ? 0 : mask & (~uint64_t(0) >> (64 - hi));
+
+    // Cannot use shortcut code when fillp or bitplanes are active
+    if ((color_bits & 0xffff) || hw.bit_mask)
+    {
+        for (; mask; mask &= mask - 1)
+            set_pixel(screen, int16_t(x + std::countr_zero(mask)), y, color_bits);
+    }
+    else
+    {
+        uint8_t *p = screen.data[y];
+        uint8_t color = (color_bits >> 16) & 0xf;
+
+        // Fill each run of consecutive bits in one go
+        while (mask)
+        {
+            int start = std::countr_zero(mask);
+            int len = std::countr_one(mask >> start);
+            fill_row(p, x + start, x + start + len - 1, color);
+            mask = start + len >= 64 ? 0 : mask & (~uint64_t(0) << (start + len));
+        }
+    }
+}
+
+void vm::vline(u4mat2<128, 128> &screen, int16_t x, int16_t y1, int16_t y2, uint32_t color_bits)
 {
     using std::min, std::max;
 
@@ -181,7 +277,7 @@ void vm::vline(int16_t x, int16_t y1, int16_t y2, uint32_t color_bits)
     if ((color_bits & 0xffff) || hw.bit_mask)
     {
         for (int16_t y = y1; y <= y2; ++y)
-            set_pixel(x, y, color_bits);
+            set_pixel(screen, x, y, color_bits);
     }
     else
     {
@@ -191,7 +287,7 @@ void vm::vline(int16_t x, int16_t y1, int16_t y2, uint32_t color_bits)
 
         for (int16_t y = y1; y <= y2; ++y)
         {
-            auto &data = get_current_screen().data[y][x / 2];
+            auto &data = screen.data[y][x / 2];
             data = (data & mask) | p;
         }
     }
@@ -216,6 +312,124 @@ tup<uint8_t, uint8_t, uint8_t> vm::api_cursor(uint8_t x, uint8_t y, opt<uint8_t>
     return std::make_tuple(x, y, c);
 }
 
+// Expand each bit of a 32-bit mask to two adjacent bits (wide text)
+static uint64_t spread(uint32_t mask)
+{
+    uint64_t x = mask;
+    x = (x | x << 16) & 0x0000ffff0000ffff;
+    x = (x | x << 8) & 0x00ff00ff00ff00ff;
+    x = (x | x << 4) & 0x0f0f0f0f0f0f0f0f;
+    x = (x | x << 2) & 0x3333333333333333;
+    x = (x | x << 1) & 0x5555555555555555;
+    return x | x << 1;
+}
+
+// Same as spread(), but only keep the first bit of each pair (dotty text)
+static uint64_t spread_even(uint32_t mask)
+{
+    return spread(mask) & 0x5555555555555555;
+}
+
+// Draw a glyph as masked spans: build foreground and background masks
+// for each glyph row, expand them for wide and tall modes, then draw
+// them with hspan(). The cell, including padding, must be at most 32
+// columns wide.
+void vm::draw_glyph_spans(u4mat2<128, 128> &screen, glyph_draw const &glyph, print_state_t const &ps,
+                          uint32_t color_bits, uint32_t background_bits)
+{
+    int16_t const start = ps.padding ? -1 : 0;
+    int16_t const columns = glyph.width - start;
+    uint32_t const domain = columns == 32 ? ~0u : (1u << columns) - 1;
+    uint32_t const glyph_mask = glyph.w >= 8 ? 0xff : glyph.w > 0 ? (1u << glyph.w) - 1 : 0;
+    int16_t const span_x = glyph.x + start * (ps.wide ? 2 : 1);
+    bool const wide = ps.wide, tall = ps.tall;
+    bool const dotty = ps.dotty, solid = ps.solid;
+
+    for (int16_t dy = start; dy < glyph.height; ++dy)
+    {
+        uint32_t on = 0;
+        if (dy >= 0 && dy < glyph.h)
+            on = (uint32_t(glyph.rows[dy] & glyph_mask) << -start) & domain;
+        if (ps.invert)
+            on = ~on & domain;
+        uint32_t off = domain & ~on;
+
+        uint64_t fg0, bg0, fg1 = 0, bg1 = 0;
+        if (wide)
+        {
+            fg0 = dotty ? spread_even(on) : spread(on);
+            bg0 = solid ? spread(off) | (dotty ? spread_even(on) << 1 : 0) : 0;
+            if (tall)
+            {
+                fg1 = dotty ? 0 : spread(on);
+                bg1 = solid ? spread(dotty ? domain : off) : 0;
+            }
+        }
+        else
+        {
+            fg0 = on;
+            bg0 = solid ? off : 0;
+            if (tall)
+            {
+                fg1 = dotty ? 0 : on;
+                bg1 = solid ? (dotty ? domain : off) : 0;
+            }
+        }
+
+        int16_t screen_y = glyph.y + dy * (tall ? 2 : 1);
+        hspan(screen, span_x, screen_y, fg0, color_bits);
+        hspan(screen, span_x, screen_y, bg0, background_bits);
+        if (tall)
+        {
+            hspan(screen, span_x, screen_y + 1, fg1, color_bits);
+            hspan(screen, span_x, screen_y + 1, bg1, background_bits);
+        }
+    }
+}
+
+// Draw a glyph pixel by pixel; used for very wide characters, and as
+// the reference for draw_glyph_spans() in the benchmark
+void vm::draw_glyph_pixels(u4mat2<128, 128> &screen, glyph_draw const &glyph, print_state_t const &ps,
+                           uint32_t color_bits, uint32_t background_bits)
+{
+    int16_t const start = ps.padding ? -1 : 0;
+    int16_t const wide_scale = ps.wide ? 2 : 1;
+    int16_t const tall_scale = ps.tall ? 2 : 1;
+
+    for (int16_t dy = start; dy < glyph.height; ++dy)
+        for (int16_t dx = start; dx < glyph.width; ++dx)
+        {
+            int16_t screen_x = glyph.x + dx * wide_scale;
+            int16_t screen_y = glyph.y + dy * tall_scale;
+
+            bool is_on = dy >= 0 && dy < glyph.h && dx >= 0 && dx < glyph.w && dx < 8
+                          && ((glyph.rows[dy] >> dx) & 0x1);
+            if (is_on != ps.invert)
+            {
+                set_pixel(screen, screen_x, screen_y, color_bits);
+                if (!ps.dotty)
+                {
+                    if (ps.wide) set_pixel(screen, screen_x + 1, screen_y, color_bits);
+                    if (ps.tall) set_pixel(screen, screen_x, screen_y + 1, color_bits);
+                    if (ps.wide && ps.tall) set_pixel(screen, screen_x + 1, screen_y + 1, color_bits);
+                }
+                else if (ps.solid)
+                {
+                    if (ps.wide) set_pixel(screen, screen_x + 1, screen_y, background_bits);
+                    if (ps.tall) set_pixel(screen, screen_x, screen_y + 1, background_bits);
+                    if (ps.wide && ps.tall) set_pixel(screen, screen_x + 1, screen_y + 1, background_bits);
+                }
+            }
+            else if (ps.solid)
+            {
+                set_pixel(screen, screen_x, screen_y, background_bits);
+                if (ps.wide) set_pixel(screen, screen_x + 1, screen_y, background_bits);
+                if (ps.tall) set_pixel(screen, screen_x, screen_y + 1, background_bits);
+                if (ps.wide && ps.tall) set_pixel(screen, screen_x + 1, screen_y + 1, background_bits);
+            }
+        }
+}
+
 uint8_t get_p8scii_value(uint8_t ch)
 {
     if (ch >= 0x30 && ch <= 0x39) return ch - 0x30; // 0 to 9
@@ -232,9 +446,10 @@ fix32 get_p8scii_cursor_value(uint8_t ch)
 void vm::scrool_screen(int16_t scroll_amount)
 {
     // FIXME: is this affected by the camera?
-    uint8_t* s = get_current_screen().data[0];
-    memmove(s, s + scroll_amount * 64, sizeof(get_current_screen()) - scroll_amount * 64);
-    ::memset(s + sizeof(get_current_screen()) - scroll_amount * 64, 0, scroll_amount * 64);
+    auto &screen = get_current_screen();
+    uint8_t* s = screen.data[0];
+    memmove(s, s + scroll_amount * 64, sizeof(screen) - scroll_amount * 64);
+    ::memset(s + sizeof(screen) - scroll_amount * 64, 0, scroll_amount * 64);
 }
 
 tup<opt<fix32>, opt<fix32> > vm::api_print(opt<rich_string> str, opt<fix32> opt_x, opt<fix32> opt_y,
@@ -408,7 +623,7 @@ tup<opt<fix32>, opt<fix32> > vm::api_print(opt<rich_string> str, opt<fix32> opt_
             bool sfx_playing[4] = {};
             for (uint8_t audio_channel = 0; audio_channel <= 3; ++audio_channel)
             {
-                int16_t csfx = m_state.channels[audio_channel].main_sfx.sfx;
+                int16_t csfx = m_audio_status.sfx[audio_channel];
                 if (csfx == -1)
                 {
                     if (sfx_channel < 0) sfx_channel = audio_channel;
@@ -555,6 +770,7 @@ tup<opt<fix32>, opt<fix32> > vm::api_print(opt<rich_string> str, opt<fix32> opt_
                 if (chi != str.value().end()) ++chi;
                 if (sfx_time >= 32) break; // too many notes
             }
+            m_audio_data_dirty = true;
             api_sfx(sfx_index, sfx_channel, 0, 0);
             break;
         }
@@ -658,7 +874,6 @@ tup<opt<fix32>, opt<fix32> > vm::api_print(opt<rich_string> str, opt<fix32> opt_
         default:
             {
                 int16_t wide_scale = print_state.wide ? 2 : 1;
-                int16_t tall_scale = print_state.tall ? 2 : 1;
                 
                 font_width = print_state.custom ? font.width : 4;
                 font_extwidth = print_state.custom ? font.extended_width : 8;
@@ -742,51 +957,34 @@ tup<opt<fix32>, opt<fix32> > vm::api_print(opt<rich_string> str, opt<fix32> opt_
                     
                 auto& g = draw_one_off ? one_off_glyph : font.glyphs[ch - 1];
 
-                for (int16_t dy = print_state.padding ? -1 : 0; dy < draw_height; ++dy)
-                    for (int16_t dx = print_state.padding ? -1 : 0; dx < draw_width; ++dx)
+                // Glyph rows as bitmasks, where bit n is column n
+                glyph_draw glyph { {}, w, h, draw_width, draw_height, base_x, base_y };
+                for (int16_t dy = 0; dy < 8; ++dy)
+                {
+                    if (draw_one_off || print_state.custom)
+                        glyph.rows[dy] = g[dy];
+                    else
+                        glyph.rows[dy] = m_bios->get_glyph_row(ch, dy);
+                }
+                #if __NX__
+                if (ch == 142 || ch == 151)
+                    for (int16_t dy = 0; dy < 8; ++dy)
                     {
-                        int16_t screen_x = base_x + dx * wide_scale;
-                        int16_t screen_y = base_y + dy * tall_scale;
-
-                        bool is_on = false;
-                        if (dy >= 0 && dy < h && dx >= 0 && dx < w)
-                        {
-                            // inside the font
-                            if (draw_one_off || print_state.custom)
-                            {                
-                                auto font_line = g[dy];
-                                uint8_t gl = font_line >>= dx;
-                                is_on = gl & 0x1;
-                            }
-                            else
-                            {
-                                is_on = (bool)m_bios->get_spixel(font_x + dx, font_y + dy);
-                            }
-                        }
-                        if (is_on != print_state.invert)
-                        {
-                            set_pixel(screen_x, screen_y, color_bits);
-                            if (!print_state.dotty)
-                            {
-                                if (print_state.wide) set_pixel(screen_x + 1, screen_y, color_bits);
-                                if (print_state.tall) set_pixel(screen_x, screen_y + 1, color_bits);
-                                if (print_state.wide && print_state.tall) set_pixel(screen_x + 1, screen_y + 1, color_bits);
-                            }
-                            else if (print_state.solid)
-                            {
-                                if (print_state.wide) set_pixel(screen_x + 1, screen_y, background_bits);
-                                if (print_state.tall) set_pixel(screen_x, screen_y + 1, background_bits);
-                                if (print_state.wide && print_state.tall) set_pixel(screen_x + 1, screen_y + 1, background_bits);
-                            }
-                        }
-                        else if(print_state.solid)
-                        {
-                            set_pixel(screen_x, screen_y, background_bits);
-                            if (print_state.wide) set_pixel(screen_x + 1, screen_y, background_bits);
-                            if (print_state.tall) set_pixel(screen_x, screen_y + 1, background_bits);
-                            if (print_state.wide && print_state.tall) set_pixel(screen_x + 1, screen_y + 1, background_bits);
-                        }
+                        glyph.rows[dy] = 0;
+                        for (int16_t dx = 0; dx < 8; ++dx)
+                            if (m_bios->get_spixel(font_x + dx, font_y + dy))
+                                glyph.rows[dy] |= 1 << dx;
                     }
+                #endif
+
+                // P8SCII control codes may poke the screen mapping, so
+                // resolve the draw target for each glyph
+                auto &screen = get_current_screen();
+                int16_t columns = draw_width + (print_state.padding ? 1 : 0);
+                if (columns > 0 && columns <= 32)
+                    draw_glyph_spans(screen, glyph, print_state, color_bits, background_bits);
+                else
+                    draw_glyph_pixels(screen, glyph, print_state, color_bits, background_bits);
 
                 last_character_width = draw_width * wide_scale;
                 x += fix32(last_character_width);
@@ -855,28 +1053,48 @@ void vm::api_circ(int16_t x, int16_t y, int16_t r, opt<fix32> c)
     if (x + r < 0 || x - r >= 128 || y + r < 0 || y - r >= 128) return;
 
     uint32_t color_bits = to_color_bits(c);
-    // seems to come from https://rosettacode.org/wiki/Bitmap/Midpoint_circle_algorithm#BASIC256
-    for (int16_t dx = r, dy = 0, err = 0; dx >= dy; )
-    {
-        set_pixel(x + dx, y + dy, color_bits);
-        set_pixel(x + dy, y + dx, color_bits);
-        set_pixel(x - dy, y + dx, color_bits);
-        set_pixel(x - dx, y + dy, color_bits);
-        set_pixel(x - dx, y - dy, color_bits);
-        set_pixel(x - dy, y - dx, color_bits);
-        set_pixel(x + dy, y - dx, color_bits);
-        set_pixel(x + dx, y - dy, color_bits);
 
-        dy += 1;
-        if (err < r - 1)
-        {
-            err += 1 + 2 * dy;
-        }
-        else
+    // Emit the 8 symmetric octant points for each step
+    auto draw = [&](auto plot)
+    {
+        // seems to come from https://rosettacode.org/wiki/Bitmap/Midpoint_circle_algorithm#BASIC256
+        for (int16_t dx = r, dy = 0, err = 0; dx >= dy; )
         {
-            dx -= 1;
-            err += 1 + 2 * (dy-dx);
+            plot(x + dx, y + dy);
+            plot(x + dy, y + dx);
+            plot(x - dy, y + dx);
+            plot(x - dx, y + dy);
+            plot(x - dx, y - dy);
+            plot(x - dy, y - dx);
+            plot(x + dy, y - dx);
+            plot(x + dx, y - dy);
+
+            dy += 1;
+            if (err < r - 1)
+            {
+                err += 1 + 2 * dy;
+            }
+            else
+            {
+                dx -= 1;
+                err += 1 + 2 * (dy-dx);
+            }
         }
+    };
+
+    auto &screen = get_current_screen();
+    switch (clip_test(x - r, y - r, x + r, y + r, color_bits))
+    {
+    case clip_state::hidden:
+        break;
+    case clip_state::visible: {
+        uint8_t color = (color_bits >> 16) & 0xf;
+        draw([&](int16_t px, int16_t py) { screen.set(px, py, color); });
+        break;
+    }
+    case clip_state::partial:
+        draw([&](int16_t px, int16_t py) { set_pixel(screen, px, py, color_bits); });
+        break;
     }
 }
 
@@ -890,14 +1108,19 @@ void vm::api_circfill(int16_t x, int16_t y, int16_t r, opt<fix32> c)
     if (x + r < 0 || x - r >= 128 || y + r < 0 || y - r >= 128) return;
 
     uint32_t color_bits = to_color_bits(c);
+    if (clip_test(x - r, y - r, x + r, y + r, color_bits) == clip_state::hidden)
+        return;
+
+    auto &screen = get_current_screen();
+
     // seems to come from https://rosettacode.org/wiki/Bitmap/Midpoint_circle_algorithm#BASIC256
     for (int16_t dx = r, dy = 0, err = 0; dx >= dy; )
     {
         // Some minor overdraw here when dx == 0 or dx == dy, but nothing serious
-        hline(x - dx, x + dx, y - dy, color_bits);
-        hline(x - dx, x + dx, y + dy, color_bits);
-        hline(x - dy, x + dy, y - dx, color_bits);
-        hline(x - dy, x + dy, y + dx, color_bits);
+        hline(screen, x - dx, x + dx, y - dy, color_bits);
+        hline(screen, x - dx, x + dx, y + dy, color_bits);
+        hline(screen, x - dy, x + dy, y - dx, color_bits);
+        hline(screen, x - dy, x + dy, y + dx, color_bits);
 
         dy += 1;
         if (err < r - 1)
@@ -940,7 +1163,8 @@ tup<uint8_t, uint8_t, uint8_t, uint8_t> vm::api_clip(int16_t x, int16_t y,
 
 void vm::api_cls(uint8_t c)
 {
-    ::memset(&get_current_screen(), c % 0x10 * 0x11, sizeof(get_current_screen()));
+    auto &screen = get_current_screen();
+    ::memset(&screen, c % 0x10 * 0x11, sizeof(screen));
 
     // Documentation: “Clear the screen and reset the clipping rectangle”.
     auto &ds = m_ram.draw_state;
@@ -1061,24 +1285,43 @@ void vm::api_line(opt<fix32> arg0, opt<fix32> arg1, opt<fix32> arg2,
     int16_t xend = lol::clamp(int(x1), -1, 128);
     int16_t yend = lol::clamp(int(y1), -1, 128);
 
-    for (;;)
+    auto draw = [&](auto plot)
     {
-        set_pixel(x, y, color_bits);
-
-        if (horiz)
-        {
-            if (x == xend)
-                break;
-            x += dx;
-            y = (int16_t)lol::round(lol::mix((double)y0, (double)y1, (double)(x - x0) / (x1 - x0)));
-        }
-        else
+        for (;;)
         {
-            if (y == yend)
-                break;
-            y += dy;
-            x = (int16_t)lol::round(lol::mix((double)x0, (double)x1, (double)(y - y0) / (y1 - y0)));
+            plot(x, y);
+
+            if (horiz)
+            {
+                if (x == xend)
+                    break;
+                x += dx;
+                y = (int16_t)lol::round(lol::mix((double)y0, (double)y1, (double)(x - x0) / (x1 - x0)));
+            }
+            else
+            {
+                if (y == yend)
+                    break;
+                y += dy;
+                x = (int16_t)lol::round(lol::mix((double)x0, (double)x1, (double)(y - y0) / (y1 - y0)));
+            }
         }
+    };
+
+    // All points lie between the two (unclamped) endpoints
+    auto &screen = get_current_screen();
+    switch (clip_test(min(x0, x1), min(y0, y1), max(x0, x1), max(y0, y1), color_bits))
+    {
+    case clip_state::hidden:
+        break;
+    case clip_state::visible: {
+        uint8_t color = (color_bits >> 16) & 0xf;
+        draw([&](int16_t px, int16_t py) { screen.set(px, py, color); });
+        break;
+    }
+    case clip_state::partial:
+        draw([&](int16_t px, int16_t py) { set_pixel(screen, px, py, color_bits); });
+        break;
     }
 }
 
@@ -1126,6 +1369,8 @@ void vm::api_tline(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
     int16_t map_size_y = get_map_size_y(map_size_x);
 
     u4mat2<128, 128>& gfx = m_ram.get_gfx();
+    auto &screen = get_current_screen();
+    gfx_cache *cache = get_gfx_cache();
     for (;;)
     {
         // Find sprite in map memory
@@ -1137,12 +1382,13 @@ void vm::api_tline(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
         // If found, draw pixel
         if ((sprite || ds.misc_features.sprite_zero) && (!layer || (bits & layer)))
         {
-            int col = gfx.get(sprite % 16 * 8 + (int(mx << 3) & 0x7),
-                              sprite / 16 * 8 + (int(my << 3) & 0x7));
+            int col = cache ? cache->sprite(gfx, sprite)[(int(my << 3) & 0x7) * 128 + (int(mx << 3) & 0x7)]
+                            : gfx.get(sprite % 16 * 8 + (int(mx << 3) & 0x7),
+                                      sprite / 16 * 8 + (int(my << 3) & 0x7));
             if ((ds.draw_palette[col] & 0xf0) == 0)
             {
                 uint32_t color_bits = (ds.draw_palette[col] & 0xf) << 16;
-                set_pixel(x, y, color_bits);
+                set_pixel(screen, x, y, color_bits);
             }
         }
 
@@ -1215,6 +1461,10 @@ void vm::api_map(int16_t cel_x, int16_t cel_y, int16_t sx, int16_t sy,
     int16_t max_map_y = map_size_y * 8;
 
     u4mat2<128, 128>& gfx = m_ram.get_gfx();
+    auto &screen = get_current_screen();
+    gfx_cache *cache = get_gfx_cache();
+    uint16_t visible_colors = ~get_palt_mask();
+
     for (int16_t dy = 0; dy < src_h; ++dy)
     for (int16_t dx = 0; dx < src_w; ++dx)
     {
@@ -1232,12 +1482,21 @@ void vm::api_map(int16_t cel_x, int16_t cel_y, int16_t sx, int16_t sy,
 
         if (sprite || ds.misc_features.sprite_zero)
         {
-            int col = gfx.get(sprite % 16 * 8 + (src_x + dx) % 8,
-                                    sprite / 16 * 8 + (src_y + dy) % 8);
+            int col;
+            if (cache)
+            {
+                // Skip fully transparent sprites
+                if (!(cache->colors(gfx, sprite) & visible_colors))
+                    continue;
+                col = cache->sprite(gfx, sprite)[(src_y + dy) % 8 * 128 + (src_x + dx) % 8];
+            }
+            else
+                col = gfx.get(sprite % 16 * 8 + (src_x + dx) % 8,
+                              sprite / 16 * 8 + (src_y + dy) % 8);
             if ((ds.draw_palette[col] & 0xf0) == 0)
             {
                 uint32_t color_bits = (ds.draw_palette[col] & 0xf) << 16;
-                set_pixel(sx + dx, sy + dy, color_bits);
+                set_pixel(screen, sx + dx, sy + dy, color_bits);
             }
         }
     }
@@ -1262,7 +1521,11 @@ void vm::api_mset(int16_t x, int16_t y, uint8_t n)
     if (x < 0 || x >= map_size_x || y < 0 || y >= map_size_y)
         return;
 
-    m_ram.map[map_size_x * y + x] = n;
+    uint8_t &cell = m_ram.map[map_size_x * y + x];
+    cell = n;
+
+    // The map may share memory with the lower half of the sprite sheet
+    m_gfx_cache.invalidate(int(&cell - &m_ram[0]), 1);
 }
 
 void vm::api_oval(int16_t x0, int16_t y0, int16_t x1, int16_t y1, opt<fix32> c)
@@ -1290,31 +1553,52 @@ void vm::api_oval(int16_t x0, int16_t y0, int16_t x1, int16_t y1, opt<fix32> c)
     float xc = float(x0 + x1) / 2;
     float yc = float(y0 + y1) / 2;
 
-    auto plot = [&](int16_t x, int16_t y)
+    // Emit the 4 symmetric quadrant points for each step
+    auto draw = [&](auto plot4)
     {
-        set_pixel(x, y, color_bits);
-        set_pixel(int16_t(2 * xc) - x, y, color_bits);
-        set_pixel(x, int16_t(2 * yc) - y, color_bits);
-        set_pixel(int16_t(2 * xc) - x, int16_t(2 * yc) - y, color_bits);
+        auto plot = [&](int16_t x, int16_t y)
+        {
+            plot4(x, y);
+            plot4(int16_t(2 * xc) - x, y);
+            plot4(x, int16_t(2 * yc) - y);
+            plot4(int16_t(2 * xc) - x, int16_t(2 * yc) - y);
+        };
+
+        // Cutoff for slope = 0.5 happens at x = a²/sqrt(a²+b²)
+        float a = max(1.0f, float(x1 - x0) / 2);
+        float b = max(1.0f, float(y1 - y0) / 2);
+        float cutoff = a / sqrt(1 + b * b / (a * a));
+
+        for (float dx = 0; dx <= cutoff; ++dx)
+        {
+            int16_t x = int16_t(ceil(xc + dx));
+            int16_t y = int16_t(round(yc - b / a * sqrt(a * a - dx * dx)));
+            plot(x, y);
+        }
+        cutoff = b / sqrt(1 + a * a / (b * b));
+        for (float dy = 0; dy < cutoff; ++dy)
+        {
+            int16_t y = int16_t(ceil(yc + dy));
+            int16_t x = int16_t(round(xc - a / b * sqrt(b * b - dy * dy)));
+            plot(x, y);
+        }
     };
 
-    // Cutoff for slope = 0.5 happens at x = a²/sqrt(a²+b²)
-    float a = max(1.0f, float(x1 - x0) / 2);
-    float b = max(1.0f, float(y1 - y0) / 2);
-    float cutoff = a / sqrt(1 + b * b / (a * a));
-
-    for (float dx = 0; dx <= cutoff; ++dx)
+    // Because a and b are at least 1, degenerate ovals may overflow
+    // their box by one pixel
+    auto &screen = get_current_screen();
+    switch (clip_test(x0 - 1, y0 - 1, x1 + 1, y1 + 1, color_bits))
     {
-        int16_t x = int16_t(ceil(xc + dx));
-        int16_t y = int16_t(round(yc - b / a * sqrt(a * a - dx * dx)));
-        plot(x, y);
+    case clip_state::hidden:
+        break;
+    case clip_state::visible: {
+        uint8_t color = (color_bits >> 16) & 0xf;
+        draw([&](int16_t px, int16_t py) { screen.set(px, py, color); });
+        break;
     }
-    cutoff = b / sqrt(1 + a * a / (b * b));
-    for (float dy = 0; dy < cutoff; ++dy)
-    {
-        int16_t y = int16_t(ceil(yc + dy));
-        int16_t x = int16_t(round(xc - a / b * sqrt(b * b - dy * dy)));
-        plot(x, y);
+    case clip_state::partial:
+        draw([&](int16_t px, int16_t py) { set_pixel(screen, px, py, color_bits); });
+        break;
     }
 }
 
@@ -1339,6 +1623,10 @@ void vm::api_ovalfill(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
     if (x1 < 0 || x0 >= 128 || y1 < 0 || y0 >= 128) return;
 
     uint32_t color_bits = to_color_bits(c);
+    if (clip_test(x0 - 1, y0 - 1, x1 + 1, y1 + 1, color_bits) == clip_state::hidden)
+        return;
+
+    auto &screen = get_current_screen();
 
     // FIXME: not elegant at all
     float xc = float(x0 + x1) / 2;
@@ -1353,16 +1641,16 @@ void vm::api_ovalfill(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
     {
         int16_t x = int16_t(ceil(xc + dx));
         int16_t y = int16_t(round(yc - b / a * sqrt(a * a - dx * dx)));
-        vline(x, int16_t(2 * yc) - y, y, color_bits);
-        vline(int16_t(2 * xc) - x, int16_t(2 * yc) - y, y, color_bits);
+        vline(screen, x, int16_t(2 * yc) - y, y, color_bits);
+        vline(screen, int16_t(2 * xc) - x, int16_t(2 * yc) - y, y, color_bits);
     }
     cutoff = b / sqrt(1 + a * a / (b * b));
     for (float dy = 0; dy <= cutoff; ++dy)
     {
         int16_t x = int16_t(round(xc - a / b * sqrt(b * b - dy * dy)));
         int16_t y = int16_t(ceil(yc + dy));
-        hline(int16_t(2 * xc) - x, x, y, color_bits);
-        hline(int16_t(2 * xc) - x, x, int16_t(2 * yc) - y, color_bits);
+        hline(screen, int16_t(2 * xc) - x, x, y, color_bits);
+        hline(screen, int16_t(2 * xc) - x, x, int16_t(2 * yc) - y, color_bits);
     }
 }
 
@@ -1439,7 +1727,7 @@ fix32 vm::api_pget(int16_t x, int16_t y)
     // FIXME: "and by clip()"? wut?
     x -= ds.camera.x;
     y -= ds.camera.y;
-    return get_pixel(x, y);
+    return get_pixel(get_current_screen(), x, y);
 }
 
 void vm::api_pset(int16_t x, int16_t y, opt<fix32> c)
@@ -1449,7 +1737,7 @@ void vm::api_pset(int16_t x, int16_t y, opt<fix32> c)
     x -= ds.camera.x;
     y -= ds.camera.y;
     uint32_t color_bits = to_color_bits(c);
-    set_pixel(x, y, color_bits);
+    set_pixel(get_current_screen(), x, y, color_bits);
 }
 
 void vm::api_rect(int16_t x0, int16_t y0, int16_t x1, int16_t y1, opt<fix32> c)
@@ -1470,14 +1758,15 @@ void vm::api_rect(int16_t x0, int16_t y0, int16_t x1, int16_t y1, opt<fix32> c)
     if (x1 < 0 || x0 >= 128 || y1 < 0 || y0 >= 128) return;
 
     uint32_t color_bits = to_color_bits(c);
+    auto &screen = get_current_screen();
 
-    hline(x0, x1, y0, color_bits);
-    hline(x0, x1, y1, color_bits);
+    hline(screen, x0, x1, y0, color_bits);
+    hline(screen, x0, x1, y1, color_bits);
 
     if (y0 + 1 < y1)
     {
-        vline(x0, y0 + 1, y1 - 1, color_bits);
-        vline(x1, y0 + 1, y1 - 1, color_bits);
+        vline(screen, x0, y0 + 1, y1 - 1, color_bits);
+        vline(screen, x1, y0 + 1, y1 - 1, color_bits);
     }
 }
 
@@ -1509,13 +1798,15 @@ void vm::api_rectfill(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
     if (y1 > 128) y1 = 128;
 
     uint32_t color_bits = to_color_bits(c);
+    auto &screen = get_current_screen();
 
     for (int16_t y = y0; y <= y1; ++y)
-        hline(x0, x1, y, color_bits);
+        hline(screen, x0, x1, y, color_bits);
 }
 
 int16_t vm::api_sget(int16_t x, int16_t y)
 {
+    // A single pixel is cheaper to read from the sheet than to decode
     return m_ram.get_gfx().safe_get(x, y);
 }
 
@@ -1525,6 +1816,31 @@ void vm::api_sset(int16_t x, int16_t y, opt<int16_t> c)
 
     uint8_t col = c ? (uint8_t)*c : ds.pen;
     m_ram.get_gfx().safe_set(x, y, ds.draw_palette[col & 0xf]);
+    if (x >= 0 && y >= 0 && x < 128 && y < 128)
+        m_gfx_cache.invalidate(y * 64 + x / 2, 1);
+}
+
+// Colours made transparent by palt(), as a bitmask
+uint16_t vm::get_palt_mask() const
+{
+    auto &ds = m_ram.draw_state;
+
+    uint16_t ret = 0;
+    for (int c = 0; c < 16; ++c)
+        if (ds.draw_palette[c] & 0xf0)
+            ret |= 1 << c;
+    return ret;
+}
+
+// Whether the draw palette maps every colour in the bitmask to itself
+bool vm::is_identity_palette(uint16_t colors) const
+{
+    auto &ds = m_ram.draw_state;
+
+    for (int c = 0; c < 16; ++c)
+        if (((colors >> c) & 1) && (ds.draw_palette[c] & 0xf) != c)
+            return false;
+    return true;
 }
 
 void vm::api_spr(int16_t n, int16_t x, int16_t y, opt<fix32> w,
@@ -1541,6 +1857,50 @@ void vm::api_spr(int16_t n, int16_t x, int16_t y, opt<fix32> w,
     if (x + w8 <= 0 || x >= 128 || y + h8 <= 0 || y >= 128) return;
 
     u4mat2<128, 128>& gfx = m_ram.get_gfx();
+    auto &screen = get_current_screen();
+
+    if (gfx_cache *cache = get_gfx_cache())
+    {
+        int src_x = n % 16 * 8, src_y = n / 16 * 8;
+        uint16_t used = cache->prepare(gfx, src_x, src_y, src_x + w8 - 1, src_y + h8 - 1);
+        uint16_t transparent = get_palt_mask();
+
+        // Skip fully transparent sprites; fully opaque ones need no test
+        if ((used & ~transparent) == 0)
+            return;
+        bool opaque = (used & transparent) == 0;
+        bool visible = clip_test(x, y, x + w8 - 1, y + h8 - 1, 0) == clip_state::visible;
+
+        // Opaque, unclipped sprites with an identity palette are plain
+        // copies of the sheet rows
+        if (opaque && visible && !flip_x && is_identity_palette(used)
+             && src_x >= 0 && src_y >= 0 && src_x + w8 <= 128 && src_y + h8 <= 128)
+        {
+            for (int16_t j = 0; j < h8; ++j)
+                copy_row(screen.data[y + j], x, gfx.data[src_y + (flip_y ? h8 - 1 - j : j)], src_x, w8);
+            return;
+        }
+
+        auto draw = [&](auto plot)
+        {
+            for (int16_t j = 0; j < h8; ++j)
+                for (int16_t i = 0; i < w8; ++i)
+                {
+                    int16_t di = flip_x ? w8 - 1 - i : i;
+                    int16_t dj = flip_y ? h8 - 1 - j : j;
+                    uint8_t col = cache->safe_get(src_x + di, src_y + dj);
+                    if (opaque || !((transparent >> col) & 1))
+                        plot(x + i, y + j, ds.draw_palette[col] & 0xf);
+                }
+        };
+
+        if (visible)
+            draw([&](int16_t px, int16_t py, uint8_t c) { screen.set(px, py, c); });
+        else
+            draw([&](int16_t px, int16_t py, uint8_t c) { set_pixel(screen, px, py, c << 16); });
+        return;
+    }
+
     for (int16_t j = 0; j < h8; ++j)
         for (int16_t i = 0; i < w8; ++i)
         {
@@ -1550,7 +1910,7 @@ void vm::api_spr(int16_t n, int16_t x, int16_t y, opt<fix32> w,
             if ((ds.draw_palette[col] & 0xf0) == 0)
             {
                 uint32_t color_bits = (ds.draw_palette[col] & 0xf) << 16;
-                set_pixel(x + i, y + j, color_bits);
+                set_pixel(screen, x + i, y + j, color_bits);
             }
         }
 }
@@ -1575,6 +1935,57 @@ void vm::api_sspr(int16_t sx, int16_t sy, int16_t sw, int16_t sh,
     // Iterate over destination pixels
     // FIXME: maybe clamp if target area is too big?
     u4mat2<128, 128>& gfx = m_ram.get_gfx();
+    auto &screen = get_current_screen();
+
+    if (gfx_cache *cache = get_gfx_cache())
+    {
+        using std::min, std::max;
+
+        uint16_t used = cache->prepare(gfx, min(sx, int16_t(sx + sw)), min(sy, int16_t(sy + sh)),
+                                       max(sx, int16_t(sx + sw)), max(sy, int16_t(sy + sh)));
+        uint16_t transparent = get_palt_mask();
+
+        // Skip fully transparent areas; fully opaque ones need no test
+        if ((used & ~transparent) == 0)
+            return;
+        bool opaque = (used & transparent) == 0;
+        bool visible = clip_test(dx, dy, dx + dw - 1, dy + dh - 1, 0) == clip_state::visible;
+
+        // Same plain copy as spr() for unscaled blits
+        if (opaque && visible && !flip_x && is_identity_palette(used) && dw == sw && dh == sh
+             && sx >= 0 && sy >= 0 && sx + sw <= 128 && sy + sh <= 128)
+        {
+            for (int16_t j = 0; j < dh; ++j)
+                copy_row(screen.data[dy + j], dx, gfx.data[sy + (flip_y ? dh - 1 - j : j)], sx, dw);
+            return;
+        }
+
+        auto draw = [&](auto plot)
+        {
+            for (int16_t j = 0; j < dh; ++j)
+            {
+                int16_t dj = flip_y ? dh - 1 - j : j;
+                int16_t y = sy + sh * dj / dh;
+
+                for (int16_t i = 0; i < dw; ++i)
+                {
+                    int16_t di = flip_x ? dw - 1 - i : i;
+                    int16_t x = sx + sw * di / dw;
+
+                    uint8_t col = cache->safe_get(x, y);
+                    if (opaque || !((transparent >> col) & 1))
+                        plot(dx + i, dy + j, ds.draw_palette[col] & 0xf);
+                }
+            }
+        };
+
+        if (visible)
+            draw([&](int16_t px, int16_t py, uint8_t c) { screen.set(px, py, c); });
+        else
+            draw([&](int16_t px, int16_t py, uint8_t c) { set_pixel(screen, px, py, c << 16); });
+        return;
+    }
+
     for (int16_t j = 0; j < dh; ++j)
     for (int16_t i = 0; i < dw; ++i)
     {
@@ -1589,7 +2000,7 @@ void vm::api_sspr(int16_t sx, int16_t sy, int16_t sw, int16_t sh,
         if ((ds.draw_palette[col] & 0xf0) == 0)
         {
             uint32_t color_bits = (ds.draw_palette[col] & 0xf) << 16;
-            set_pixel(dx + i, dy + j, color_bits);
+            set_pixel(screen, dx + i, dy + j, color_bits);
         }
     }
 }
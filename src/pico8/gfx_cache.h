@@ -0,0 +1,122 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <algorithm> // std::min, std::max
+#include <bitset>    // std::bitset
+#include <cstdint>   // uint8_t, uint16_t
+
+#include "zepto8.h"
+
+// The gfx_cache class
+// ———————————————————
+// A decoded copy of the sprite sheet with one byte per pixel, rebuilt
+// lazily one 8×8 sprite at a time. For each sprite it also records the
+// set of colours it uses, so that blitters can tell whether a sprite is
+// fully transparent, fully opaque or mixed for a given palt() state.
+// Every write to the gfx area must call invalidate().
+
+namespace z8::pico8
+{
+
+class gfx_cache
+{
+public:
+    // Mark every sprite as stale
+    void invalidate()
+    {
+        m_valid.reset();
+    }
+
+    // Mark the sprites covering bytes [addr, addr + size) of the gfx
+    // area as stale; addresses outside 0x0000–0x1fff are ignored.
+    void invalidate(int addr, int size)
+    {
+        int end = std::min(addr + size, 0x2000);
+        for (addr = std::max(addr, 0); addr < end; )
+        {
+            // One row of one sprite covers 4 bytes
+            m_valid.reset(addr / 512 * 16 + addr % 64 / 4);
+            addr = (addr | 3) + 1;
+        }
+    }
+
+    // Return the decoded pixels of sprite n, as a pointer to its top-left
+    // pixel in a 128-pixel wide buffer. Decode it first if necessary.
+    uint8_t const *sprite(u4mat2<128, 128> const &gfx, int n)
+    {
+        if (!m_valid[n])
+            decode(gfx, n);
+        return &m_pixels[n / 16 * 8][n % 16 * 8];
+    }
+
+    // Bitmask of the colours used by sprite n (bit c is set if colour c
+    // appears at least once)
+    uint16_t colors(u4mat2<128, 128> const &gfx, int n)
+    {
+        if (!m_valid[n])
+            decode(gfx, n);
+        return m_colors[n];
+    }
+
+    // Make sure all sprites overlapping a pixel rectangle are decoded, and
+    // return the union of their colour masks. Pixels outside the sheet
+    // read as colour 0, like u4mat2::safe_get().
+    uint16_t prepare(u4mat2<128, 128> const &gfx, int x0, int y0, int x1, int y1)
+    {
+        uint16_t ret = 0;
+        if (x0 < 0 || y0 < 0 || x1 > 127 || y1 > 127)
+            ret |= 1;
+        x0 = std::max(x0, 0); y0 = std::max(y0, 0);
+        x1 = std::min(x1, 127); y1 = std::min(y1, 127);
+        for (int y = y0 / 8; y <= y1 / 8; ++y)
+            for (int x = x0 / 8; x <= x1 / 8; ++x)
+                ret |= colors(gfx, y * 16 + x);
+        return ret;
+    }
+
+    // Decoded pixel access; the sprite must have been prepared
+    uint8_t get(int x, int y) const
+    {
+        return m_pixels[y][x];
+    }
+
+    uint8_t safe_get(int x, int y) const
+    {
+        return (x >= 0 && y >= 0 && x < 128 && y < 128) ? m_pixels[y][x] : 0;
+    }
+
+private:
+    void decode(u4mat2<128, 128> const &gfx, int n)
+    {
+        int x0 = n % 16 * 8, y0 = n / 16 * 8;
+        uint16_t colors = 0;
+        for (int y = y0; y < y0 + 8; ++y)
+            for (int x = x0; x < x0 + 8; x += 2)
+            {
+                uint8_t p = gfx.data[y][x / 2];
+                m_pixels[y][x] = p & 0xf;
+                m_pixels[y][x + 1] = p >> 4;
+                colors |= (1 << (p & 0xf)) | (1 << (p >> 4));
+            }
+        m_colors[n] = colors;
+        m_valid.set(n);
+    }
+
+    uint8_t m_pixels[128][128];
+    uint16_t m_colors[256];
+    std::bitset<256> m_valid;
+};
+
+} // namespace z8::pico8
+
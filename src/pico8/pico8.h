@@ -51,14 +51,15 @@ struct charset
     static std::string pico8_to_utf8(std::string const &str);
 
     // Map 8-bit PICO-8 characters to UTF-32 codepoints
-    static std::u32string_view to_utf32[256];
+    static std::u32string_view to_utf32(uint8_t ch);
 
     // Map 8-bit PICO-8 characters to UTF-8 string views
-    static std::string_view to_utf8[256];
+    static std::string_view to_utf8(uint8_t ch);
 
 private:
-    static std::regex static_init();
-    static std::regex utf8_regex;
+    // Lookup tables, built on first use and never modified afterwards
+    struct tables;
+    static tables const &get_tables();
 };
 
 struct code
@@ -32,14 +32,19 @@
 namespace z8::pico8
 {
 
-std::string_view charset::to_utf8[256];
-std::u32string_view charset::to_utf32[256];
+struct charset::tables
+{
+    tables();
 
-static uint8_t multibyte_start[256];
-static std::map<std::string, uint8_t> to_pico8;
-std::regex charset::utf8_regex = charset::static_init();
+    std::u32string utf32_chars;
+    std::string_view to_utf8[256];
+    std::u32string_view to_utf32[256];
+    uint8_t multibyte_start[256] = {};
+    std::map<std::string, uint8_t> to_pico8;
+    std::regex utf8_regex;
+};
 
-std::regex charset::static_init()
+charset::tables::tables()
 {
     std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> cvt;
 
@@ -55,7 +60,7 @@ std::regex charset::static_init()
         "きくけこさしすせそたちつてとなにぬねのはひふへほまみむめもやゆよ"
         "らりるれろわをんっゃゅょアイウエオカキクケコサシスセソタチツテト"
         "ナニヌネノハヒフヘホマミムメモヤユヨラリルレロワヲンッャュョ◜◝";
-    static auto utf32_chars = cvt.from_bytes(utf8_chars, &utf8_chars[sizeof(utf8_chars)]);
+    utf32_chars = cvt.from_bytes(utf8_chars, &utf8_chars[sizeof(utf8_chars)]);
 
     // Create all sorts of lookup tables for PICO-8 character conversions
     char const *p8 = utf8_chars;
@@ -81,22 +86,40 @@ std::regex charset::static_init()
     }
     regex += ')'; // Fall back to an empty match on purpose
 
-    return std::regex(regex);
+    utf8_regex = std::regex(regex);
+}
+
+charset::tables const &charset::get_tables()
+{
+    static tables const t;
+    return t;
+}
+
+std::u32string_view charset::to_utf32(uint8_t ch)
+{
+    return get_tables().to_utf32[ch];
+}
+
+std::string_view charset::to_utf8(uint8_t ch)
+{
+    return get_tables().to_utf8[ch];
 }
 
 std::string charset::utf8_to_pico8(std::string const &str)
 {
+    auto const &t = get_tables();
     std::string ret;
     std::smatch sm;
 
     for (auto p = str.begin(); p != str.end(); )
     {
         // Only pass known start characters through the expensive regex
-        if (multibyte_start[(uint8_t)*p]
-             && std::regex_search(p, str.end(), sm, utf8_regex)
+        if (t.multibyte_start[(uint8_t)*p]
+             && std::regex_search(p, str.end(), sm, t.utf8_regex)
              && sm.length() > 1)
         {
-            ret += to_pico8[sm.str()];
+            // The regex only matches keys of the map
+            ret += char(t.to_pico8.find(sm.str())->second);
             p += sm.length();
         }
         else
@@ -110,9 +133,10 @@ std::string charset::utf8_to_pico8(std::string const &str)
 
 std::string charset::pico8_to_utf8(std::string const &str)
 {
+    auto const &t = get_tables();
     std::string ret;
     for (uint8_t ch : str)
-        ret += std::string(to_utf8[ch]);
+        ret += std::string(t.to_utf8[ch]);
     return ret;
 }
 
@@ -16,62 +16,394 @@
 
 #include "pico8/vm.h"
 #include "pico8/pico8.h"
+#include "hash.h"
 
 #include <lol/vector> // lol::u8vec4
+#include <algorithm>  // std::min, std::clamp
+#include <array>      // std::array
+#include <chrono>     // std::chrono
+#include <memory>     // std::make_unique
+#include <thread>     // std::thread::hardware_concurrency
+#if defined __x86_64__ || defined __i386__ || defined _M_X64 || defined _M_IX86
+#   define HAVE_X86_SIMD 1
+#   include <tmmintrin.h> // _mm_shuffle_epi8
+#   if _MSC_VER
+#       include <intrin.h> // __cpuid
+#   endif
+#endif
+
+// Functions using SSSE3 are compiled for it even when the rest of the
+// file targets baseline x86-64, and only called if the CPU supports it
+#if HAVE_X86_SIMD && (defined __GNUC__ || defined __clang__)
+#   define TARGET_SSSE3 __attribute__((target("ssse3")))
+#else
+#   define TARGET_SSSE3
+#endif
 
 namespace z8::pico8
 {
 
+// Hash everything that affects the displayed frame. Each step is a
+// bijection of the current hash, so a change in a single word always
+// changes the result.
+static uint64_t frame_hash(u4mat2<128, 128> const &screen, draw_state_t const &draw_state,
+                           hw_state_t const &hw_state, int tiles_x, int tiles_y,
+                           u4mat2<128, 128> const *extra_screens)
+{
+    hasher h;
+    h.add(&screen, sizeof(screen));
+    h.add(draw_state.screen_mode);
+    h.add(draw_state.screen_palette);
+    h.add(hw_state.raster);
+    h.add(tiles_x);
+    h.add(tiles_y);
+    h.add(extra_screens, sizeof(*extra_screens) * (tiles_x * tiles_y - 1));
+    return h.get();
+}
+
 void vm::private_end_render()
 {
-    if (m_in_pause) return;
+    // While paused, the menu is drawn directly on top of the last frame
+    if (!m_in_pause)
+    {
+        memcpy(&m_front_buffer, &get_current_screen(), sizeof(m_front_buffer));
+        m_front_draw_state = m_ram.draw_state;
+        m_front_hw_state = m_ram.hw_state;
+    }
+
+    // Do not publish a frame that would display exactly like the previous
+    // one, so that the rendering side can skip conversion and upload
+    int const tiles = m_multiscreens_x * m_multiscreens_y;
+    uint64_t hash = frame_hash(m_front_buffer, m_front_draw_state, m_front_hw_state,
+                               m_multiscreens_x, m_multiscreens_y, m_multiscreens.data());
+    if (hash == m_frame_hash)
+        return;
+    m_frame_hash = hash;
 
-    memcpy(&m_front_buffer, &get_current_screen(), sizeof(m_front_buffer));
-    m_front_draw_state = m_ram.draw_state;
-    m_front_hw_state = m_ram.hw_state;
+    // Hand the frame over to the rendering thread
+    auto &f = m_frames.back();
+    memcpy(&f.screen, &m_front_buffer, sizeof(f.screen));
+    f.draw_state = m_front_draw_state;
+    f.hw_state = m_front_hw_state;
+    f.multiscreens_x = m_multiscreens_x;
+    f.multiscreens_y = m_multiscreens_y;
+    f.multiscreens.assign(m_multiscreens.begin(), m_multiscreens.begin() + (tiles - 1));
+    f.published = std::chrono::steady_clock::now();
+    f.input_time = m_input_time;
+    m_frames.publish();
+    frame_completed();
 }
 
-void vm::render(lol::u8vec4 *screen) const
+//
+// Output pixel formats. Each format provides a conversion from the
+// 8-bit RGBA value of a hardware colour.
+//
+
+template<typename T> struct pixel_format;
+
+template<> struct pixel_format<lol::u8vec4>
 {
-    // Cannot use a 256-value LUT because data access will be
-    // very random due to rotation, flip, stretch etc.
-    lol::u8vec4 lut[128 + 16];
-    for (int c = 0; c < 16; ++c)
+    static lol::u8vec4 convert(lol::u8vec4 c) { return c; }
+};
+
+template<> struct pixel_format<uint32_t> // XRGB8888
+{
+    static uint32_t convert(lol::u8vec4 c)
+    {
+        return 0xff000000u | uint32_t(c.r) << 16 | uint32_t(c.g) << 8 | c.b;
+    }
+};
+
+template<> struct pixel_format<uint16_t> // RGB565
+{
+    static uint16_t convert(lol::u8vec4 c)
     {
-        lut[c] = palette::get8(c);
-        lut[128 + c] = palette::get8(16 + c);
+        return uint16_t((c.r >> 3) << 11 | (c.g >> 2) << 5 | c.b >> 3);
     }
+};
 
+// Convert a hardware colour (0–15 for the standard colours, 128–143
+// for the secret colours) to the target format, using a 32-entry table.
+template<typename T>
+static T to_pixel(uint8_t c)
+{
+    static auto const lut = []()
+    {
+        std::array<T, 32> ret;
+        for (int n = 0; n < 32; ++n)
+            ret[n] = pixel_format<T>::convert(palette::get8(n));
+        return ret;
+    }();
+
+    return lut[c & 0x80 ? 16 + (c & 0xf) : c & 0xf];
+}
+
+//
+// Frame conversion tables, built once per call to render() from the
+// front draw state and hardware state. They give the same results as
+// calling pixel() on every pixel, but without decoding the screen mode
+// and raster mode 16384 times per screen.
+//
+
+template<typename T>
+struct render_tables
+{
+    // Source coordinates for each output row and column. When swap_xy
+    // is set (rotation modes) the roles of x and y are exchanged.
+    uint8_t map_x[128], map_y[128];
+    bool swap_xy;
+    // True when map_x is the identity: rows can be expanded directly
+    // from the packed 4-bit screen data.
+    bool linear_x;
+
+    // One 16-colour lookup table per source row, with raster mode
+    // and screen palette already applied
+    alignas(16) T lut[128][16];
+};
+
+template<typename T>
+static void build_render_tables(render_tables<T> &t, draw_state_t const &draw_state,
+                                hw_state_t const &hw_state)
+{
+    uint8_t const mode = draw_state.screen_mode;
+
+    // Same logic as in pixel(), but computed once for each coordinate
+    t.swap_xy = (mode & 0xbd) == 0x85;
+    for (int i = 0; i < 128; ++i)
+    {
+        if ((mode & 0xbc) == 0x84)
+        {
+            t.map_x[i] = mode & 2 ? 127 - i : i;
+            t.map_y[i] = ((mode + 1) & 2) ? 127 - i : i;
+        }
+        else
+        {
+            t.map_x[i] = (mode & 0xbd) == 0x05 ? std::min(i, 127 - i) // mirror
+                       : (mode & 0xbd) == 0x01 ? i / 2                // stretch
+                       : (mode & 0xbd) == 0x81 ? 127 - i : i;         // flip
+            t.map_y[i] = (mode & 0xbe) == 0x06 ? std::min(i, 127 - i) // mirror
+                       : (mode & 0xbe) == 0x02 ? i / 2                // stretch
+                       : (mode & 0xbe) == 0x82 ? 127 - i : i;         // flip
+        }
+    }
+
+    t.linear_x = !t.swap_xy;
+    for (int i = 0; i < 128 && t.linear_x; ++i)
+        t.linear_x = t.map_x[i] == i;
+
+    T base[16];
+    for (int c = 0; c < 16; ++c)
+        base[c] = to_pixel<T>(draw_state.screen_palette[c]);
+
+    auto const &raster = hw_state.raster;
     for (int y = 0; y < 128; ++y)
     {
+        T *lut = t.lut[y];
+        for (int c = 0; c < 16; ++c)
+            lut[c] = base[c];
+
+        if (raster.mode == 0x10)
+        {
+            // Raster mode: alternate palette
+            if (raster.bits[y])
+                for (int c = 0; c < 16; ++c)
+                    lut[c] = to_pixel<T>(raster.palette[c]);
+        }
+        else if ((raster.mode & 0x30) == 0x30)
+        {
+            // Raster mode: gradient
+            int c2 = (y / 8 + (raster.bits[y] ? 1 : 0)) % 16;
+            lut[raster.mode & 0x0f] = to_pixel<T>(raster.palette[c2]);
+        }
+    }
+}
+
+#if HAVE_X86_SIMD
+static bool has_ssse3()
+{
+#if defined __SSSE3__
+    return true;
+#elif _MSC_VER
+    static bool const ret = []()
+    {
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 9)) != 0;
+    }();
+    return ret;
+#else
+    static bool const ret = __builtin_cpu_supports("ssse3");
+    return ret;
+#endif
+}
+
+// SSSE3 version of expand_row(), with one pshufb per byte of T
+template<typename T>
+TARGET_SSSE3 static void expand_row_ssse3(T *dst, uint8_t const *src, T const *lut)
+{
+    // Split the LUT into 16-byte planes (one per byte of T) so that each
+    // plane can be indexed with a single pshufb.
+    __m128i const mask = _mm_set1_epi8(0x0f);
+    __m128i const *in = (__m128i const *)lut;
+
+    if constexpr (sizeof(T) == 4)
+    {
+        __m128i const deinterleave = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13,
+                                                   2, 6, 10, 14, 3, 7, 11, 15);
+        __m128i l0 = _mm_shuffle_epi8(_mm_load_si128(in + 0), deinterleave);
+        __m128i l1 = _mm_shuffle_epi8(_mm_load_si128(in + 1), deinterleave);
+        __m128i l2 = _mm_shuffle_epi8(_mm_load_si128(in + 2), deinterleave);
+        __m128i l3 = _mm_shuffle_epi8(_mm_load_si128(in + 3), deinterleave);
+        __m128i p01 = _mm_unpacklo_epi32(l0, l1), q01 = _mm_unpackhi_epi32(l0, l1);
+        __m128i p23 = _mm_unpacklo_epi32(l2, l3), q23 = _mm_unpackhi_epi32(l2, l3);
+        __m128i const plane0 = _mm_unpacklo_epi64(p01, p23);
+        __m128i const plane1 = _mm_unpackhi_epi64(p01, p23);
+        __m128i const plane2 = _mm_unpacklo_epi64(q01, q23);
+        __m128i const plane3 = _mm_unpackhi_epi64(q01, q23);
+
+        for (int i = 0; i < 64; i += 8)
+        {
+            // Low nibble is the left pixel, high nibble is the right pixel
+            __m128i p = _mm_loadl_epi64((__m128i const *)(src + i));
+            __m128i idx = _mm_unpacklo_epi8(_mm_and_si128(p, mask),
+                                            _mm_and_si128(_mm_srli_epi16(p, 4), mask));
+            __m128i b0 = _mm_shuffle_epi8(plane0, idx);
+            __m128i b1 = _mm_shuffle_epi8(plane1, idx);
+            __m128i b2 = _mm_shuffle_epi8(plane2, idx);
+            __m128i b3 = _mm_shuffle_epi8(plane3, idx);
+            __m128i lo01 = _mm_unpacklo_epi8(b0, b1), hi01 = _mm_unpackhi_epi8(b0, b1);
+            __m128i lo23 = _mm_unpacklo_epi8(b2, b3), hi23 = _mm_unpackhi_epi8(b2, b3);
+            __m128i *out = (__m128i *)(dst + 2 * i);
+            _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(lo01, lo23));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo01, lo23));
+            _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi01, hi23));
+            _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi01, hi23));
+        }
+    }
+    else
+    {
+        __m128i const deinterleave = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+                                                   1, 3, 5, 7, 9, 11, 13, 15);
+        __m128i l0 = _mm_shuffle_epi8(_mm_load_si128(in + 0), deinterleave);
+        __m128i l1 = _mm_shuffle_epi8(_mm_load_si128(in + 1), deinterleave);
+        __m128i const plane0 = _mm_unpacklo_epi64(l0, l1);
+        __m128i const plane1 = _mm_unpackhi_epi64(l0, l1);
+
+        for (int i = 0; i < 64; i += 8)
+        {
+            __m128i p = _mm_loadl_epi64((__m128i const *)(src + i));
+            __m128i idx = _mm_unpacklo_epi8(_mm_and_si128(p, mask),
+                                            _mm_and_si128(_mm_srli_epi16(p, 4), mask));
+            __m128i b0 = _mm_shuffle_epi8(plane0, idx);
+            __m128i b1 = _mm_shuffle_epi8(plane1, idx);
+            __m128i *out = (__m128i *)(dst + 2 * i);
+            _mm_storeu_si128(out + 0, _mm_unpacklo_epi8(b0, b1));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi8(b0, b1));
+        }
+    }
+}
+#endif
+
+// Expand one row of 128 packed 4-bit pixels using a 16-entry LUT
+template<typename T>
+static void expand_row(T *dst, uint8_t const *src, T const *lut)
+{
+    static_assert(sizeof(T) == 2 || sizeof(T) == 4);
+
+#if HAVE_X86_SIMD
+    if (has_ssse3())
+        return expand_row_ssse3(dst, src, lut);
+#endif
+
+    for (int i = 0; i < 64; ++i)
+    {
+        dst[2 * i] = lut[src[i] & 0xf];
+        dst[2 * i + 1] = lut[src[i] >> 4];
+    }
+}
+
+template<typename T>
+static void render_row(T *dst, u4mat2<128, 128> const &screen,
+                       int y, render_tables<T> const &t)
+{
+    if (t.linear_x)
+    {
+        int sy = t.map_y[y];
+        expand_row(dst, screen.data[sy], t.lut[sy]);
+    }
+    else if (t.swap_xy)
+    {
+        // Rotation: the output row is a source column
+        int sx = t.map_x[y];
         for (int x = 0; x < 128; ++x)
-            *screen++ = lut[pixel(x, y, get_front_screen())];
-        if (m_multiscreens_x > 1)
         {
-            for (int sx = 1; sx < m_multiscreens_x; ++sx)
-                for (int x = 0; x < 128; ++x)
-                    *screen++ = lut[pixel(x, y, *m_multiscreens[sx - 1])];
+            int sy = t.map_y[x];
+            *dst++ = t.lut[sy][screen.get(sx, sy)];
         }
     }
-    if (m_multiscreens_y > 1)
+    else
     {
-        for (int sy = 1; sy < m_multiscreens_y; ++sy)
-            for (int y = 0; y < 128; ++y)
-            {
-                for (int sx = 0; sx < m_multiscreens_x; ++sx)
-                    for (int x = 0; x < 128; ++x)
-                        *screen++ = lut[pixel(x, y, *m_multiscreens[sx + sy * m_multiscreens_x - 1])];
-            }
+        int sy = t.map_y[y];
+        T const *lut = t.lut[sy];
+        for (int x = 0; x < 128; ++x)
+            *dst++ = lut[screen.get(t.map_x[x], sy)];
     }
 }
 
+template<typename T>
+void vm::render_frame(T *screen, int pitch) const
+{
+    render_tables<T> t;
+    auto const &f = m_frames.front();
+    build_render_tables(t, f.draw_state, f.hw_state);
+
+    // Tiles are independent 128×128 screens, each with its own part of
+    // the output
+    auto render_tile = [&](int n)
+    {
+        auto const &src = n ? f.multiscreens[n - 1] : f.screen;
+        T *dst = screen + n / f.multiscreens_x * 128 * pitch + n % f.multiscreens_x * 128;
+        for (int y = 0; y < 128; ++y, dst += pitch)
+            render_row(dst, src, y, t);
+    };
+
+    // Video walls have up to 8 tiles; convert them in parallel, since
+    // waking the workers costs more than converting one or two tiles
+    int const tiles = f.multiscreens_x * f.multiscreens_y;
+    if (tiles <= 2)
+    {
+        for (int n = 0; n < tiles; ++n)
+            render_tile(n);
+        return;
+    }
+
+    if (!m_render_pool)
+        m_render_pool = std::make_unique<worker_pool>(std::clamp(int(std::thread::hardware_concurrency()) - 1, 0, 7));
+    m_render_pool->run(tiles, render_tile);
+}
+
+void vm::render(lol::u8vec4 *screen) const
+{
+    render_frame(screen, 128 * m_frames.front().multiscreens_x);
+}
+
+void vm::render_rgb565(uint16_t *screen, int pitch) const
+{
+    render_frame(screen, pitch);
+}
+
+void vm::render_xrgb8888(uint32_t *screen, int pitch) const
+{
+    render_frame(screen, pitch);
+}
 
 // Hardware pixel accessor
 uint8_t vm::pixel(int x, int y, u4mat2<128, 128> const& screen) const
 {
-    // TODO: cache all state
-    auto &draw_state = m_front_draw_state;
-    auto &hw_state = m_front_hw_state;
+    // This is the reference implementation; render() uses precomputed
+    // tables instead and must give the exact same results.
+    auto &draw_state = m_frames.front().draw_state;
+    auto &hw_state = m_frames.front().hw_state;
 
     // Get screen mode
     uint8_t const& mode = draw_state.screen_mode;
@@ -142,7 +474,13 @@ int vm::get_ansi_color(uint8_t c) const
     };
 
     // FIXME: support the extended palette!
-    return ansi_palette[m_front_draw_state.screen_palette[c & 0xf] & 0xf];
+    return ansi_palette[m_frames.front().draw_state.screen_palette[c & 0xf] & 0xf];
+}
+
+lol::u8vec3 vm::get_rgb(uint8_t c) const
+{
+    uint8_t const c2 = m_frames.front().draw_state.screen_palette[c & 0xf];
+    return palette::get8(c2 & 0x80 ? 16 + (c2 & 0xf) : c2 & 0xf).rgb;
 }
 
 } // namespace z8::pico8
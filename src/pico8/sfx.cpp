@@ -16,18 +16,21 @@
 
 #include <format>    // std::format
 #include <lol/math>  // lol::clamp, lol::mix
-#include <algorithm> // std::max
+#include <algorithm> // std::max, std::min
+#include <chrono>    // std::chrono
 #include <cmath>     // std::fabs, std::fmod, std::floor
+#include <cstddef>   // offsetof
+#include <cstring>   // ::memcpy, ::memcmp
+#include <iterator>  // std::size
 #include <cassert>   // assert
 
 #include "pico8/vm.h"
 #include "synth.h"
+#include "hash.h"
 
 namespace z8::pico8
 {
 
-#define DEBUG_EXPORT_WAV 0
-
 enum
 {
     FX_NO_EFFECT = 0,
@@ -40,12 +43,6 @@ enum
     FX_ARP_SLOW =  7,
 };
 
-static float key_to_freq(float key)
-{
-    using std::exp2;
-    return 440.f * exp2((key - 33.f) / 12.f);
-}
-
 #if DEBUG_STUFF
 static std::string key_to_name(float key)
 {
@@ -63,75 +60,86 @@ uint8_t song_t::sfx(int n) const
     return data[n] & 0x7f;
 }
 
-#if DEBUG_EXPORT_WAV
-std::map<int, FILE *> exports;
-#endif
-
-void vm::update_sfx_state(state::sfx_state& cur_sfx, state::synth_param &new_synth, float freq_factor, float length, bool is_music, bool can_loop, bool half_rate, double inv_frames_per_second)
+void vm::prepare_sfx_state(state::sfx_state const& cur_sfx, sfx_invariants &inv, float length, bool is_music, bool can_loop, double inv_frames_per_second)
 {
-    using std::fabs, std::fmod, std::floor, std::max;
+    using std::max;
 
-    if (cur_sfx.sfx == -1) return;
+    if (cur_sfx.sfx == -1)
+        return;
 
     int const index = cur_sfx.sfx;
     assert(index >= 0 && index < 64);
-    sfx_t const& sfx = m_ram.sfx[index];
+    uint32_t const generation = m_sfx_cache.generation(index);
 
-    // Speed must be 1—255 otherwise the SFX is invalid
-    int const speed = max(1, (int)sfx.speed);
+    // Nothing to do if the channel is still playing the same thing and
+    // the SFX was not modified
+    if (index == inv.sfx && generation == inv.generation && length == inv.length
+         && is_music == inv.is_music && can_loop == inv.can_loop)
+        return;
 
-    double const offset = cur_sfx.offset;
-    double const time = cur_sfx.time;
+    sfx_t const& sfx = m_audio_data.sfx[index];
+
+    inv.sfx = cur_sfx.sfx;
+    inv.generation = generation;
+    inv.meta = &m_sfx_cache.get(sfx, index);
+    inv.length = length;
+    inv.is_music = is_music;
+    inv.can_loop = can_loop;
+
+    // Speed must be 1—255 otherwise the SFX is invalid
+    inv.speed = max(1, (int)sfx.speed);
 
     // PICO-8 exports instruments as 22050 Hz WAV files with 183 samples
     // per speed unit per note, so this is how much we should advance
-    double const offset_per_second = 22050.0 / (183.0 * speed);
-    double const offset_per_frame = offset_per_second * inv_frames_per_second;
-    double next_offset = offset + offset_per_frame;
-    double next_time = time + offset_per_frame;
+    inv.offset_per_second = 22050.0 / (183.0 * inv.speed);
+    inv.offset_per_frame = inv.offset_per_second * inv_frames_per_second;
 
-    // Handle SFX loops. From the documentation: “Looping is turned
-    // off when the start index >= end index”.
-    float const loop_range = float(sfx.loop_end - sfx.loop_start);
-    if (loop_range > 0.f && next_offset >= sfx.loop_end
-        && can_loop)
-    {
-        next_offset = fmod(next_offset - sfx.loop_start, loop_range)
-            + sfx.loop_start;
-    }
+    inv.loop_range = inv.meta->has_loop ? float(sfx.loop_end - sfx.loop_start) : 0.f;
 
-    bool has_end = false;
-    float end_time = 32.f;
+    inv.has_end = false;
+    inv.end_time = 32.f;
     if (length > 0.0f)
     {
-        has_end = true;
-        end_time = length;
+        inv.has_end = true;
+        inv.end_time = length;
     }
     // in pico 8, strangely, len is not applyed to musical sfx except for pattern len calculation
     // it's probably a bug
     if (!is_music && sfx.loop_end == 0 && sfx.loop_start > 0)
     {
-        has_end = true;
-        end_time = std::min<float>(end_time, sfx.loop_start);
+        inv.has_end = true;
+        inv.end_time = std::min<float>(inv.end_time, sfx.loop_start);
     }
     // if there is no loop, we end after the length
-    if (loop_range <= 0.f)
+    if (inv.loop_range <= 0.f)
     {
-        has_end = true;
+        inv.has_end = true;
         // if not a music sfx, check where is the last note to early stop
         if (!is_music)
-        {
-            int last_note = 0;
-            // todo: maybe cache this info so we don't need to compute it for each sample (but sfx could change from frame to frame so we don't know when to recompute it)
-            for (int n = 0; n < 32; ++n)
-            {
-                if (sfx.notes[n].volume > 0)
-                {
-                    last_note = std::min(32, n + 1);
-                }
-            }
-            end_time = std::min(end_time, float(last_note));
-        }
+            inv.end_time = std::min(inv.end_time, float(inv.meta->last_note));
+    }
+}
+
+void vm::update_sfx_state(state::sfx_state& cur_sfx, sfx_invariants const& inv, state::synth_param &new_synth, float freq_factor, bool half_rate, double inv_frames_per_second)
+{
+    using std::fabs, std::fmod, std::floor;
+
+    if (cur_sfx.sfx == -1) return;
+
+    sfx_t const& sfx = m_audio_data.sfx[cur_sfx.sfx];
+
+    double const offset = cur_sfx.offset;
+    double const time = cur_sfx.time;
+
+    double next_offset = offset + inv.offset_per_frame;
+    double next_time = time + inv.offset_per_frame;
+
+    // Handle SFX loops
+    if (inv.loop_range > 0.f && next_offset >= sfx.loop_end
+        && inv.can_loop)
+    {
+        next_offset = fmod(next_offset - sfx.loop_start, inv.loop_range)
+            + sfx.loop_start;
     }
 
     if (offset < 32)
@@ -141,7 +149,7 @@ void vm::update_sfx_state(state::sfx_state& cur_sfx, state::synth_param &new_syn
 
         uint8_t key = sfx.notes[note_id].key;
         float volume = sfx.notes[note_id].volume / 7.f;
-        float freq = key_to_freq(key) * freq_factor;
+        float freq = inv.meta->freq[note_id] * freq_factor;
 
         if (volume > 0.f)
         {
@@ -166,7 +174,7 @@ void vm::update_sfx_state(state::sfx_state& cur_sfx, state::synth_param &new_syn
             {
                 // 7.5f and 0.25f were found empirically by matching
                 // frequency graphs of PICO-8 instruments.
-                float t = fabs(fmod(7.5f * offset / offset_per_second, 1.0f) - 0.5f) - 0.25f;
+                float t = fabs(fmod(7.5f * offset / inv.offset_per_second, 1.0f) - 0.5f) - 0.25f;
                 // Vibrato half a semi-tone, so multiply by pow(2,1/12)
                 freq = lol::mix(freq, freq * 1.059463094359f, t);
                 break;
@@ -187,10 +195,10 @@ void vm::update_sfx_state(state::sfx_state& cur_sfx, state::synth_param &new_syn
                 // “6 arpeggio fast  //  Iterate over groups of 4 notes at speed of 4
                 //  7 arpeggio slow  //  Iterate over groups of 4 notes at speed of 8”
                 // “If the SFX speed is <= 8, arpeggio speeds are halved to 2, 4”
-                int const m = (speed <= 8 ? 32 : 16) / (fx == FX_ARP_FAST ? 4 : 8);
-                int const n = (int)(m * 7.5f * offset / offset_per_second);
+                int const m = (inv.speed <= 8 ? 32 : 16) / (fx == FX_ARP_FAST ? 4 : 8);
+                int const n = (int)(m * 7.5f * offset / inv.offset_per_second);
                 int const arp_note = (note_id & ~3) | (n & 3);
-                freq = key_to_freq(sfx.notes[arp_note].key);
+                freq = inv.meta->freq[arp_note];
                 break;
             }
             }
@@ -203,7 +211,7 @@ void vm::update_sfx_state(state::sfx_state& cur_sfx, state::synth_param &new_syn
             new_synth.custom = sfx.notes[note_id].custom;
             new_synth.filters = sfx.filters;
             new_synth.volume = volume;
-            new_synth.is_music = is_music;
+            new_synth.is_music = inv.is_music;
 
             new_synth.phi = new_synth.phi + freq * inv_frames_per_second;
         }
@@ -218,78 +226,173 @@ void vm::update_sfx_state(state::sfx_state& cur_sfx, state::synth_param &new_syn
     cur_sfx.offset = next_offset;
     cur_sfx.time = next_time;
 
-    if (has_end && next_time >= end_time)
+    if (inv.has_end && next_time >= inv.end_time)
     {
         cur_sfx.sfx = -1;
     }
 }
 
-void vm::get_audio(void *inbuffer, size_t in_bytes)
+// Advance the music by one sample. Return true if the music must then move
+// to another pattern (or stop), in which case the caller is responsible for
+// calling set_music_pattern() with the new values.
+bool vm::step_music(bool is_pause, int16_t &next_pattern, int16_t &next_count)
 {
-    int16_t* buffer = (int16_t*)inbuffer;
-    int const in_frames = in_bytes / 2;
+    // Music is timed using the first channel
+    if (m_state.music.pattern == -1 || is_pause)
+        return false;
+
+    double inv_frames_per_second = ((m_audio_hw.half_rate & 1) ? 0.5 : 1.0) / 22050.0;
+    double const offset_per_second = 22050.0 / 183.0;
+    double const offset_per_frame = offset_per_second * inv_frames_per_second;
+    m_state.music.offset += offset_per_frame;
+    m_state.music.fade_volume += m_state.music.fade_volume_step * inv_frames_per_second;
+    m_state.music.fade_volume = lol::clamp(m_state.music.fade_volume, 0.f, 1.f);
+
+    if (m_state.music.fade_volume_step < 0 && m_state.music.fade_volume <= 0)
+    {
+        next_pattern = -1;
+        next_count = -1;
+        return true;
+    }
+
+    if (m_state.music.offset >= m_state.music.length)
+    {
+        next_pattern = m_state.music.pattern + 1;
+        next_count = m_state.music.count + 1;
+        if (m_audio_data.song[m_state.music.pattern].stop)
+        {
+            next_pattern = -1;
+            next_count = -1;
+        }
+        else if (m_audio_data.song[m_state.music.pattern].loop)
+            while (--next_pattern > 0 && !m_audio_data.song[next_pattern].start)
+                ;
+        return true;
+    }
+
+    return false;
+}
 
+// Render count samples of one channel, up to and including reverb, into
+// out. The amount of each dampening filter to apply is stored in damp1
+// and damp2. The music state for each sample was computed beforehand and
+// is passed in music_fade and music_offset.
+template<bool steady_path>
+void vm::render_channel(int chan, size_t count, float const *music_fade, double const *music_offset, bool is_pause, float *out, float *damp1, float *damp2)
+{
     using std::fabs, std::fmod, std::floor, std::max;
 
-    bool is_pause = m_ram.draw_state.pause_music==1 || (m_in_pause && m_ram.draw_state.pause_music != 2);
+    state::channel &channel_state = m_state.channels[chan];
+
+    // Hardware registers only change between blocks
+    double const inv_frames_per_second = ((m_audio_hw.half_rate & (1 << chan)) ? 0.5 : 1.0) / 22050.0;
+    bool const half_rate = m_audio_hw.half_rate & (1 << (chan + 4));
+    bool const hw_reverb1 = m_audio_hw.reverb & (1 << (chan + 4));
+    bool const hw_reverb2 = m_audio_hw.reverb & (1 << chan);
+    bool const hw_damp1 = m_audio_hw.lowpass & (1 << (chan + 4));
+    bool const hw_damp2 = m_audio_hw.lowpass & (1 << chan);
+
+    sfx_invariants main_inv, custom_inv;
 
-    for (size_t i = 0; i < in_frames; ++i)
+    // Reverb, dampening and output of one sample
+    auto emit = [&](size_t i, float value, float reverb1, float reverb2, float d1, float d2)
     {
-    float channel_mix = 0.0;
-    for (int chan = 0; chan < 4; ++chan)
+        // hw can force fx passes
+        if (hw_reverb1) reverb1 = 1.0f;
+        if (hw_reverb2) reverb2 = 1.0f;
+        if (hw_damp1) d1 = 1.0f;
+        if (hw_damp2) d2 = 1.0f;
+
+        // Reverb: echo of the signal 366 and 732 samples ago
+        uint32_t const idx = channel_state.reverb_index++;
+        float &reverb_2 = channel_state.reverb_2[idx & 511];
+        float &reverb_4 = channel_state.reverb_4[idx & 1023];
+        if (reverb1 > 0.0f) value += reverb1 * channel_state.reverb_2[(idx - 366) & 511] * 0.5f;
+        if (reverb2 > 0.0f) value += reverb1 * channel_state.reverb_4[(idx - 732) & 1023] * 0.5f;
+        reverb_2 = value;
+        reverb_4 = value;
+
+        out[i] = value;
+        damp1[i] = d1;
+        damp2[i] = d2;
+    };
+
+    // Whether the main SFX is in the middle of a plain note (no effect, no
+    // custom instrument) that already started on a previous sample, with
+    // no fade running. Such a note only advances its phase until the next
+    // note boundary, loop point or end of the SFX, so the per-sample
+    // update can be skipped.
+    auto is_steady = [&]()
     {
-        double inv_frames_per_second = ((m_ram.hw_state.half_rate & (1 << chan)) ? 0.5 : 1.0) / 22050.0;
+        auto const &cur_sfx = channel_state.main_sfx;
+        auto const &last_synth = channel_state.last_synth;
+
+        if (is_pause || channel_state.fade > 0.0f
+             || cur_sfx.sfx == -1 || cur_sfx.offset >= 32 || last_synth.volume <= 0.0f)
+            return false;
+
+        prepare_sfx_state(cur_sfx, main_inv, channel_state.length, channel_state.is_music, channel_state.can_loop, inv_frames_per_second);
 
-        // Advance music using the first channel
-        //
-        // FIXME: not actually great, as channels after 0 will directly jump to next pattern
-        // instead of having half of the previous one
-        // also fading will not work correctly for channel > 0
-        // maybe we should only update current channel's sfx
-        // also doing this on a separate thread from rendering means lua can sometimes show sfx = -1 for a frame
-        if (chan == 0 && m_state.music.pattern != -1 && !is_pause)
+        sfx_t const &sfx = m_audio_data.sfx[cur_sfx.sfx];
+        int const note_id = (int)floor(cur_sfx.offset);
+        auto const &note = sfx.notes[note_id];
+        float const freq = main_inv.meta->freq[note_id] * (half_rate ? 0.5f : 1.0f);
+
+        return note.effect == FX_NO_EFFECT && !note.custom
+            && last_synth.instrument == note.instrument && last_synth.key == note.key
+            && !last_synth.custom && !last_synth.in_custom && last_synth.filters == sfx.filters
+            && last_synth.freq == freq && last_synth.volume == note.volume / 7.f
+            && last_synth.is_music == main_inv.is_music;
+    };
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (steady_path && is_steady())
         {
-            double const offset_per_second = 22050.0 / 183.0;
-            double const offset_per_frame = offset_per_second * inv_frames_per_second;
-            m_state.music.offset += offset_per_frame;
-            m_state.music.fade_volume += m_state.music.fade_volume_step * inv_frames_per_second;
-            m_state.music.fade_volume = lol::clamp(m_state.music.fade_volume, 0.f, 1.f);
+            auto &cur_sfx = channel_state.main_sfx;
+            auto &last_synth = channel_state.last_synth;
+            sfx_t const &sfx = m_audio_data.sfx[cur_sfx.sfx];
 
-            if (m_state.music.fade_volume_step < 0 && m_state.music.fade_volume <= 0)
+            double const note_end = floor(cur_sfx.offset) + 1.0;
+            double const loop_end = main_inv.loop_range > 0.f && main_inv.can_loop ? sfx.loop_end : 32.0;
+            double const end_time = main_inv.has_end ? main_inv.end_time : 1e300;
+
+            uint8_t const reverb = (last_synth.filters / 24) % 3;
+            uint8_t const dampen = (last_synth.filters / 72) % 3;
+
+            // Stop right before the sample that reaches the next note, so
+            // that the generic code below handles the transition
+            for (; i < count; ++i)
             {
-                set_music_pattern(-1);
+                double const next_offset = cur_sfx.offset + main_inv.offset_per_frame;
+                double const next_time = cur_sfx.time + main_inv.offset_per_frame;
+                if (next_offset >= note_end || next_offset >= loop_end || next_time >= end_time)
+                    break;
+
+                cur_sfx.offset = next_offset;
+                cur_sfx.time = next_time;
+                last_synth.phi = last_synth.phi + last_synth.freq * inv_frames_per_second;
+
+                emit(i, get_synth_sample(last_synth, music_fade[i]),
+                     reverb == 1 ? 1.0f : 0.0f, reverb == 2 ? 1.0f : 0.0f,
+                     dampen == 1 ? 1.0f : 0.0f, dampen == 2 ? 1.0f : 0.0f);
             }
-            else if (m_state.music.offset >= m_state.music.length)
-            {
-                int16_t next_pattern = m_state.music.pattern + 1;
-                int16_t next_count = m_state.music.count + 1;
-                if (m_ram.song[m_state.music.pattern].stop)
-                {
-                    next_pattern = -1;
-                    next_count = -1;
-                }
-                else if (m_ram.song[m_state.music.pattern].loop)
-                    while (--next_pattern > 0 && !m_ram.song[next_pattern].start)
-                        ;
 
-                m_state.music.count = next_count;
-                set_music_pattern(next_pattern);
-            }
+            if (i == count)
+                break;
         }
 
-        state::channel &channel_state = m_state.channels[chan];
-
         // a no sfx is playing and there is a music sfx stored
         if (channel_state.main_sfx.sfx == -1 && channel_state.sfx_music != -1 && !is_pause)
         {
             int const index = channel_state.sfx_music;
             assert(index >= 0 && index < 64);
-            sfx_t const& sfx = m_ram.sfx[index];
+            sfx_t const& sfx = m_audio_data.sfx[index];
 
             // compute offset to start the sfx to
             bool want_play = true;
             int const speed = max(1, (int)sfx.speed);
-            double new_offset = m_state.music.offset / speed;
+            double new_offset = music_offset[i] / speed;
 
             float const loop_range = float(sfx.loop_end - sfx.loop_start);
             if (loop_range > 0.f && channel_state.can_loop)
@@ -315,14 +418,15 @@ void vm::get_audio(void *inbuffer, size_t in_bytes)
         new_synth.phi = last_synth.phi;
         new_synth.last_advance = last_synth.last_advance;
         new_synth.last_sample = last_synth.last_sample;
+        new_synth.noise_state = last_synth.noise_state;
         float value = 0.0f;
 
         if (!is_pause)
         {
             double main_sfx_base_offset = channel_state.main_sfx.offset;
-            bool half_rate = m_ram.hw_state.half_rate & (1 << (chan + 4));
             // update main sfx
-            update_sfx_state(channel_state.main_sfx, new_synth, 1.0f, channel_state.length, channel_state.is_music, channel_state.can_loop, half_rate, inv_frames_per_second);
+            prepare_sfx_state(channel_state.main_sfx, main_inv, channel_state.length, channel_state.is_music, channel_state.can_loop, inv_frames_per_second);
+            update_sfx_state(channel_state.main_sfx, main_inv, new_synth, 1.0f, half_rate, inv_frames_per_second);
 
             bool restart_custom = new_synth.instrument != channel_state.last_main_instrument || new_synth.key != channel_state.last_main_key;
             channel_state.last_main_instrument = new_synth.instrument;
@@ -347,10 +451,12 @@ void vm::get_audio(void *inbuffer, size_t in_bytes)
                     float const freq_base = key_to_freq(24); // C2
                     float freq_factor = new_synth.freq / freq_base;
                     float main_sfx_volume = new_synth.volume;
-                    update_sfx_state(channel_state.custom_sfx, new_synth, freq_factor, 0.0f, false, true, half_rate, inv_frames_per_second);
+                    prepare_sfx_state(channel_state.custom_sfx, custom_inv, 0.0f, false, true, inv_frames_per_second);
+                    update_sfx_state(channel_state.custom_sfx, custom_inv, new_synth, freq_factor, half_rate, inv_frames_per_second);
                     new_synth.volume *= main_sfx_volume;
+                    new_synth.in_custom = true;
                 }
-                value = get_synth_sample(new_synth);
+                value = get_synth_sample(new_synth, music_fade[i]);
             }
         }
 
@@ -381,8 +487,8 @@ void vm::get_audio(void *inbuffer, size_t in_bytes)
         if (channel_state.fade > 0.0f)
         {
             channel_state.fade_synth.phi = channel_state.fade_synth.phi + channel_state.fade_synth.freq * inv_frames_per_second;
-            float value_fade = get_synth_sample(channel_state.fade_synth);
-            
+            float value_fade = get_synth_sample(channel_state.fade_synth, music_fade[i]);
+
             value = lol::mix(value, value_fade, channel_state.fade);
 
             // TODO: factoryze this
@@ -396,64 +502,203 @@ void vm::get_audio(void *inbuffer, size_t in_bytes)
             channel_state.fade -= 130.0f * inv_frames_per_second;
         }
 
-        // hw can force fx passes
-        if (m_ram.hw_state.reverb & (1 << (chan + 4))) chan_reverb1_value = 1.0f;
-        if (m_ram.hw_state.reverb & (1 << chan)) chan_reverb2_value = 1.0f;
-        if (m_ram.hw_state.lowpass & (1 << (chan + 4))) chan_damp1_value = 1.0f;
-        if (m_ram.hw_state.lowpass & (1 << chan)) chan_damp2_value = 1.0f;
-        
-        if (chan_reverb1_value > 0.0f) value += chan_reverb1_value * channel_state.reverb_2[channel_state.reverb_index % 366] * 0.5f;
-        if (chan_reverb2_value > 0.0f) value += chan_reverb1_value * channel_state.reverb_4[channel_state.reverb_index % 732] * 0.5f;
+        emit(i, value, chan_reverb1_value, chan_reverb2_value, chan_damp1_value, chan_damp2_value);
+    }
+}
+
+void vm::get_audio(void *inbuffer, size_t in_bytes)
+{
+    size_t const in_frames = in_bytes / 2;
+
+    if (in_frames == 0)
+        return;
+
+    auto const callback_start = std::chrono::steady_clock::now();
+    uint64_t channel_ns[4] = {};
 
-        channel_state.reverb_2[channel_state.reverb_index % 366] = value;
-        channel_state.reverb_4[channel_state.reverb_index % 732] = value;
-        ++channel_state.reverb_index;
+    render_audio((int16_t *)inbuffer, in_frames, channel_ns);
 
-        float value_damp1 = channel_state.damp1.run(value);
-        if (chan_damp1_value > 0.0f) value = lol::mix(value, value_damp1, chan_damp1_value);
+    publish_audio_stats(callback_start, in_frames, channel_ns);
+}
+
+// Without an audio consumer, render the audio up to the current VM time
+// and discard it, so that commands are applied and the status and the
+// PCM channel advance as if it were played
+void vm::render_audio_headless()
+{
+    uint64_t const target = uint64_t(m_time * 22050.0);
+
+    // Start again after a reset, and never catch up more than a second
+    if (target < m_audio_rendered)
+        m_audio_rendered = target;
+    m_audio_rendered = std::max(m_audio_rendered, target - std::min<uint64_t>(target, 22050));
+
+    int16_t buffer[512];
+    uint64_t channel_ns[4] = {};
+    while (m_audio_rendered < target)
+    {
+        size_t const count = size_t(std::min<uint64_t>(target - m_audio_rendered, std::size(buffer)));
+        render_audio(buffer, count, channel_ns);
+        m_audio_rendered += count;
+    }
+}
 
-        float value_damp2 = channel_state.damp2.run(value);
-        if (chan_damp2_value > 0.0f) value = lol::mix(value, value_damp2, chan_damp2_value);
+// Render in_frames samples of audio, applying the pending commands from
+// the VM thread, and accumulate the time spent in each channel. Without
+// steady_path, every sample goes through the full SFX update; only the
+// benchmark uses that, as a reference for the fast path.
+template<bool steady_path>
+void vm::render_audio(int16_t *buffer, size_t in_frames, uint64_t channel_ns[4])
+{
+    bool const is_pause = m_audio_paused.load(std::memory_order_relaxed);
+
+    // Forget the PCM samples of a previous run
+    m_pcm_queue.discard_until(m_pcm_flush.load(std::memory_order_acquire));
+
+    // Fetch commands from the VM thread and choose the sample at which
+    // each of them is applied. They keep their relative timing as long
+    // as they fit in this buffer; anything older than the buffer start
+    // is applied immediately, and m_audio_sync is pulled forward rather
+    // than delaying commands past the end of the buffer.
+    audio_command commands[256];
+    size_t positions[256];
+    size_t command_count = 0;
+    while (command_count < std::size(commands) && m_audio_queue.pop(commands[command_count]))
+        ++command_count;
+
+    if (command_count > 0)
+    {
+        m_audio_sync = std::min(m_audio_sync, commands[0].time);
+        if (commands[command_count - 1].time >= m_audio_sync + in_frames)
+            m_audio_sync = commands[command_count - 1].time - (in_frames - 1);
+        for (size_t n = 0; n < command_count; ++n)
+            positions[n] = commands[n].time > m_audio_sync ? size_t(commands[n].time - m_audio_sync) : 0;
+    }
+    m_audio_sync += in_frames;
+
+    // Audio is rendered in blocks, one channel at a time. The music is
+    // advanced first for the whole block; since switching to another
+    // pattern affects every channel, a block always ends right before
+    // the sample where that happens, and the next one starts with it.
+    // Blocks also end where a command must be applied.
+    size_t const block_size = 256;
+    float music_fade[block_size];
+    double music_offset[block_size];
+    float value[4][block_size], damp1[4][block_size], damp2[4][block_size];
+
+    size_t next_command = 0;
+    for (size_t start = 0; start < in_frames; )
+    {
+        while (next_command < command_count && positions[next_command] <= start)
+            apply_audio_command(commands[next_command++]);
+
+        size_t max_count = std::min(in_frames - start, block_size);
+        if (next_command < command_count)
+            max_count = std::min(max_count, positions[next_command] - start);
+        size_t count = 0;
 
-        int16_t sample = (int16_t)(32767.99f * std::clamp(value,-0.99f,0.99f));
+        for (; count < max_count; ++count)
+        {
+            auto const saved_music = m_state.music;
+            int16_t next_pattern, next_count;
+            if (step_music(is_pause, next_pattern, next_count))
+            {
+                if (count > 0)
+                {
+                    m_state.music = saved_music;
+                    break;
+                }
+                m_state.music.count = next_count;
+                set_music_pattern(next_pattern);
+            }
+            music_fade[count] = m_state.music.fade_volume;
+            music_offset[count] = m_state.music.offset;
+        }
 
-        // Apply hardware distort
-        if (m_ram.hw_state.distort & (1 << chan))
+        for (int chan = 0; chan < 4; ++chan)
         {
-            sample = sample / 0x1000 * 0x1249;
+            auto const t0 = std::chrono::steady_clock::now();
+            render_channel<steady_path>(chan, count, music_fade, music_offset, is_pause,
+                                        value[chan], damp1[chan], damp2[chan]);
+            channel_ns[chan] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    std::chrono::steady_clock::now() - t0).count();
         }
-        else if (m_ram.hw_state.distort & (1 << (chan + 4)))
+
+        bool distort1[4], distort2[4];
+        for (int chan = 0; chan < 4; ++chan)
         {
-            sample = (sample - (sample < 0 ? 0x1000: 0)) / 0x1000 * 0x1249;
+            distort1[chan] = m_audio_hw.distort & (1 << chan);
+            distort2[chan] = m_audio_hw.distort & (1 << (chan + 4));
         }
-        channel_mix += sample;
-    }
-        
-        buffer[i] = (int16_t)(std::clamp(channel_mix, -32767.9f, 32767.9f));
-    }
 
-#if DEBUG_EXPORT_WAV
-    if (!exports[chan])
-    {
-        static char const *header =
-            "RIFF" "\xe4\xc1\x08\0" /* chunk size */ "WAVEfmt "
-            "\x10\0\0\0" /* subchunk size */ "\x01\0" /* format (PCM) */
-            "\x01\0" /* channels (1) */ "\x22\x56\0\0" /* sample rate (22050) */
-            "\x22\x56\0\0" /* byte rate */ "\x02\0" /* block align (2) */
-            "\x10\0" /* bits per sample (16) */ "data"
-            "\xc0\xc1\x08\00" /* bytes in data */;
-        exports[chan] = fopen(std::format("/tmp/zepto8_{}.wav", chan).c_str(), "w+");
-        fwrite(header, 44, 1, exports[chan]);
+        // Dampening filters run on all four channels at once. They run
+        // even where a channel does not use them, so that their state is
+        // up to date when a fade or a new note enables them.
+        for (size_t i = 0; i < count; ++i)
+        {
+            float in[4], out[4];
+            for (int chan = 0; chan < 4; ++chan)
+                in[chan] = value[chan][i];
+
+            m_state.damp1.run(in, out);
+            for (int chan = 0; chan < 4; ++chan)
+                if (damp1[chan][i] > 0.0f)
+                    in[chan] = lol::mix(in[chan], out[chan], damp1[chan][i]);
+
+            m_state.damp2.run(in, out);
+            for (int chan = 0; chan < 4; ++chan)
+                if (damp2[chan][i] > 0.0f)
+                    in[chan] = lol::mix(in[chan], out[chan], damp2[chan][i]);
+
+            // The PCM channel plays like an SFX channel: it pauses with
+            // the synth, follows the SFX volume and is scaled and clamped
+            // the same way, but has no filters or distortion
+            float pcm = 0.0f;
+            if (!is_pause)
+            {
+                if (m_pcm_phase == 0)
+                {
+                    uint8_t byte;
+                    m_pcm_sample = m_pcm_queue.pop(byte) ? (int(byte) - 128) / 128.f : 0.f;
+                }
+                m_pcm_phase = (m_pcm_phase + 1) & 3;
+                pcm = m_pcm_sample * m_state.music.volume_sfx;
+            }
+
+            float channel_mix = (int16_t)(32767.99f * std::clamp(pcm, -0.99f, 0.99f));
+            for (int chan = 0; chan < 4; ++chan)
+            {
+                int16_t sample = (int16_t)(32767.99f * std::clamp(in[chan], -0.99f, 0.99f));
+
+                // Apply hardware distort
+                if (distort1[chan])
+                {
+                    sample = sample / 0x1000 * 0x1249;
+                }
+                else if (distort2[chan])
+                {
+                    sample = (sample - (sample < 0 ? 0x1000: 0)) / 0x1000 * 0x1249;
+                }
+                channel_mix += sample;
+            }
+
+            buffer[start + i] = (int16_t)(std::clamp(channel_mix, -32767.9f, 32767.9f));
+        }
+
+        start += count;
+        publish_audio_status();
     }
-    // FIXME: this is no longer correct because the 4 tracks are interleaved
-    fwrite(buffer, in_samples, 1, exports[chan]);
-#endif
 }
 
-float vm::get_synth_sample(state::synth_param &params)
+template void vm::render_audio<false>(int16_t *buffer, size_t in_frames, uint64_t channel_ns[4]);
+
+float vm::get_synth_sample(state::synth_param &params, float music_fade)
 {
-    // Play note
-    float waveform = synth::waveform(params);
+    // Play note; the tables only model the built-in waveforms played
+    // directly, not the notes of custom instruments
+    bool const use_tables = m_wavetable_synth && !params.in_custom;
+    auto const *generator = use_tables ? &synth::fast_waveform : &synth::waveform;
+    float waveform = generator(params);
 
     uint8_t detune = (params.filters / 8) % 3;
     if (detune != 0 && params.instrument != synth::INST_NOISE)
@@ -468,7 +713,7 @@ float vm::get_synth_sample(state::synth_param &params)
         state::synth_param second_wave = params;
         second_wave.phi *= factor;
         if (detune == 2 && params.instrument == synth::INST_ORGAN) second_wave.instrument = synth::INST_TRIANGLE; // organ second wave seems to be simpler
-        waveform += synth::waveform(second_wave) * 0.5f;
+        waveform += generator(second_wave) * 0.5f;
     }
 
     float volume = params.volume;
@@ -477,7 +722,7 @@ float vm::get_synth_sample(state::synth_param &params)
     // FIXME: check whether this should be done after distortion
     if (params.is_music)
     {
-        volume *= m_state.music.fade_volume * m_state.music.volume_music;
+        volume *= music_fade * m_state.music.volume_music;
     }
     else
     {
@@ -492,6 +737,11 @@ float vm::get_synth_sample(state::synth_param &params)
 //
 
 void vm::api_music(int16_t pattern, int16_t fade_len, int16_t mask)
+{
+    push_audio_command(audio_command::type::music, pattern, fade_len, mask);
+}
+
+void vm::apply_music(int16_t pattern, int16_t fade_len, int16_t mask)
 {
     // pattern: 0..63, -1 to stop music.
     // fade_len: fade length in milliseconds (default 0)
@@ -555,11 +805,11 @@ void vm::set_music_pattern(int pattern)
     int16_t duration_no_loop = -1;
     for (int i = 0; i < 4; ++i)
     {
-        int n = m_ram.song[pattern].sfx(i);
+        int n = m_audio_data.song[pattern].sfx(i);
         if (n & 0x40)
             continue;
 
-        auto &sfx = m_ram.sfx[n & 0x3f];
+        auto &sfx = m_audio_data.sfx[n & 0x3f];
         bool has_loop = sfx.loop_end > 0 && sfx.loop_end > sfx.loop_start;
         if (has_loop)
         {
@@ -600,7 +850,7 @@ void vm::set_music_pattern(int pattern)
     // Play music sfx on active channels
     for (int i = 0; i < 4; ++i)
     {
-        int n = m_ram.song[pattern].sfx(i);
+        int n = m_audio_data.song[pattern].sfx(i);
         if (n & 0x40)
             continue;
 
@@ -617,6 +867,11 @@ void vm::set_music_pattern(int pattern)
 }
 
 void vm::api_sfx(int16_t sfx, opt<int16_t> in_chan, int16_t offset, int16_t length)
+{
+    push_audio_command(audio_command::type::sfx, sfx, in_chan ? *in_chan : -1, offset, length);
+}
+
+void vm::apply_sfx(int16_t sfx, int16_t chan, int16_t offset, int16_t length)
 {
     // SFX index: valid values are 0..63 for actual samples,
     // -1 to stop sound on a channel, -2 to stop looping on a channel
@@ -624,8 +879,6 @@ void vm::api_sfx(int16_t sfx, opt<int16_t> in_chan, int16_t offset, int16_t leng
     // Sound offset: valid values are 0..31, negative values act as 0,
     // and fractional values are ignored
 
-    int chan = in_chan ? *in_chan : -1;
-
     if (sfx < -2 || sfx > 63 || chan < -1 || chan > 4 || offset > 31)
         return;
 
@@ -721,7 +974,7 @@ void vm::api_sfx(int16_t sfx, opt<int16_t> in_chan, int16_t offset, int16_t leng
             if (index < 0 || index >= 64)
                 continue;
                 
-            sfx_t const& sfx = m_ram.sfx[index];
+            sfx_t const& sfx = m_audio_data.sfx[index];
             if (sfx.speed <= fastest_speed)
             {
                 chan = i;
@@ -767,5 +1020,285 @@ void vm::launch_sfx(int16_t sfx, int16_t chan, float offset, float length, bool
     m_state.channels[chan].main_sfx.prev_vol = 0.f;
 }
 
+//
+// Communication between the VM thread and the audio thread
+//
+
+void vm::push_audio_command(audio_command::type cmd, int16_t a0, int16_t a1, int16_t a2, int16_t a3)
+{
+    // The audio thread must see the data the VM wrote before this command
+    if (cmd != audio_command::type::data)
+        flush_audio_data();
+
+    audio_command command { cmd, uint64_t(m_time * 22050.0), { a0, a1, a2, a3 } };
+
+    // Hash the command even if the ring is full, since whether it fits
+    // depends on the timing of the audio thread
+    hasher h;
+    h.add(m_audio_command_hash);
+    h.add(command.cmd);
+    h.add(command.time);
+    h.add(command.args);
+    m_audio_command_hash = h.get();
+
+    // Without an audio consumer, step() drains the ring every frame. If a
+    // consumer stalls, the ring eventually fills up and the command is
+    // dropped, since it could not be heard anyway.
+    if (m_audio_queue.push(command))
+        predict_audio_status(command);
+}
+
+// Update the published audio status with the expected effect of a new
+// command, so that stat() reflects it before the audio thread applies
+// it. This mirrors the channel selection of apply_sfx() using only the
+// published state; the audio thread corrects it when it catches up.
+void vm::predict_audio_status(audio_command const &command)
+{
+    auto &status = m_audio_status;
+    auto const &args = command.args;
+
+    if (command.cmd == audio_command::type::music)
+    {
+        int16_t const pattern = args[0], fade_len = args[1];
+        if (pattern >= 0 && pattern <= 63)
+        {
+            status.pattern.store(pattern, std::memory_order_relaxed);
+            status.count.store(0, std::memory_order_relaxed);
+            status.ticks.store(0, std::memory_order_relaxed);
+            status.music_mask.store(uint8_t(args[2] & 0xf), std::memory_order_relaxed);
+        }
+        else if (pattern == -1 && fade_len <= 0)
+        {
+            status.pattern.store(-1, std::memory_order_relaxed);
+            status.count.store(-1, std::memory_order_relaxed);
+            status.ticks.store(-1, std::memory_order_relaxed);
+        }
+        return;
+    }
+
+    if (command.cmd != audio_command::type::sfx)
+        return;
+
+    int16_t const sfx = args[0], offset = args[2];
+    int chan = args[1];
+    if (sfx < -1 || sfx > 63 || chan < -1 || chan > 3 || offset > 31)
+        return;
+
+    uint8_t const music_channels = status.music_channels.load(std::memory_order_relaxed);
+    uint8_t const music_mask = status.music_mask.load(std::memory_order_relaxed);
+
+    auto stop = [&](int i)
+    {
+        status.sfx[i].store(-1, std::memory_order_relaxed);
+        status.note[i].store(-1, std::memory_order_relaxed);
+    };
+
+    if (sfx == -1)
+    {
+        for (int i = 0; i < 4; ++i)
+            if ((chan == -1 || chan == i) && !((music_channels >> i) & 1))
+                stop(i);
+        return;
+    }
+
+    // Same order as apply_sfx(): a free channel or one playing this SFX,
+    // then a music channel; give up on the rarer speed-based choice.
+    for (int i = 0; i < 4 && chan == -1; ++i)
+    {
+        int16_t const current = status.sfx[i].load(std::memory_order_relaxed);
+        if (!((music_mask >> i) & 1) && (current == -1 || current == sfx))
+            chan = i;
+    }
+    for (int i = 0; i < 4 && chan == -1; ++i)
+        if (!((music_mask >> i) & 1) && ((music_channels >> i) & 1))
+            chan = i;
+    if (chan == -1)
+        return;
+
+    for (int i = 0; i < 4; ++i)
+        if (status.sfx[i].load(std::memory_order_relaxed) == sfx)
+            stop(i);
+    status.sfx[chan].store(sfx, std::memory_order_relaxed);
+    status.note[chan].store(std::max<int16_t>(0, offset), std::memory_order_relaxed);
+}
+
+void vm::apply_audio_command(audio_command const &command)
+{
+    auto const &args = command.args;
+
+    switch (command.cmd)
+    {
+    case audio_command::type::sfx:
+        apply_sfx(args[0], args[1], args[2], args[3]);
+        break;
+    case audio_command::type::music:
+        apply_music(args[0], args[1], args[2]);
+        break;
+    case audio_command::type::registers:
+        m_audio_hw.half_rate = uint8_t(args[0]);
+        m_audio_hw.reverb = uint8_t(args[1]);
+        m_audio_hw.distort = uint8_t(args[2]);
+        m_audio_hw.lowpass = uint8_t(args[3]);
+        break;
+    case audio_command::type::data:
+        // Commands may be applied later than the snapshot they announce
+        // was published, so this picks up the latest one, if any
+        if (m_audio_data_exchange.update())
+            apply_audio_data(m_audio_data_exchange.front());
+        break;
+    case audio_command::type::seed:
+        apply_audio_seed(uint32_t(uint16_t(args[0])) | uint32_t(uint16_t(args[1])) << 16);
+        break;
+    }
+}
+
+// Send the current values of the audio registers 0x5f40..0x5f43 to the
+// audio thread; must be called after any write to them
+void vm::sync_audio_registers()
+{
+    auto const &hw = m_ram.hw_state;
+    push_audio_command(audio_command::type::registers,
+                       hw.half_rate, hw.reverb, hw.distort, hw.lowpass);
+}
+
+// Seed the noise generators of the four channels
+void vm::seed_audio(uint32_t seed)
+{
+    push_audio_command(audio_command::type::seed, int16_t(seed), int16_t(seed >> 16));
+}
+
+// Send a snapshot of the music and SFX data to the audio thread, if the
+// VM wrote to that area since the last one
+void vm::flush_audio_data()
+{
+    if (!m_audio_data_dirty)
+        return;
+    m_audio_data_dirty = false;
+
+    auto &data = m_audio_data_exchange.back();
+    ::memcpy(data.song, m_ram.song, sizeof(data.song));
+    ::memcpy(data.sfx, m_ram.sfx, sizeof(data.sfx));
+    m_audio_data_exchange.publish();
+    push_audio_command(audio_command::type::data);
+}
+
+// Audio thread side of flush_audio_data(): only the SFX that changed
+// lose their cached metadata
+void vm::apply_audio_data(audio_data const &data)
+{
+    for (int n = 0; n < 0x40; ++n)
+        if (::memcmp(&data.sfx[n], &m_audio_data.sfx[n], sizeof(sfx_t)) != 0)
+            m_sfx_cache.invalidate(int(offsetof(memory, sfx) + n * sizeof(sfx_t)), int(sizeof(sfx_t)));
+    m_audio_data = data;
+}
+
+// Audio thread side of seed_audio()
+void vm::apply_audio_seed(uint32_t seed)
+{
+    for (int chan = 0; chan < 4; ++chan)
+    {
+        uint32_t x = seed ^ (0x9e3779b9u * (chan + 1));
+        m_state.channels[chan].last_synth.noise_state = x ? x : 0x2545f491;
+    }
+}
+
+// For offline rendering with no audio thread: drop the pending commands
+// and play the music and SFX data currently in RAM
+void vm::reset_audio(uint32_t seed)
+{
+    for (audio_command command; m_audio_queue.pop(command); )
+        ;
+    ::memcpy(m_audio_data.song, m_ram.song, sizeof(m_audio_data.song));
+    ::memcpy(m_audio_data.sfx, m_ram.sfx, sizeof(m_audio_data.sfx));
+    m_audio_data_dirty = false;
+    m_sfx_cache.invalidate();
+    apply_audio_seed(seed);
+}
+
+void vm::publish_audio_status()
+{
+    for (int chan = 0; chan < 4; ++chan)
+    {
+        auto const &main_sfx = m_state.channels[chan].main_sfx;
+        m_audio_status.sfx[chan].store(main_sfx.sfx, std::memory_order_relaxed);
+        m_audio_status.note[chan].store(main_sfx.sfx == -1 ? -1 : int16_t(main_sfx.offset),
+                                        std::memory_order_relaxed);
+    }
+    uint8_t music_channels = 0;
+    for (int chan = 0; chan < 4; ++chan)
+        if (m_state.channels[chan].is_music)
+            music_channels |= 1 << chan;
+    m_audio_status.music_channels.store(music_channels, std::memory_order_relaxed);
+    m_audio_status.music_mask.store(uint8_t(m_state.music.mask), std::memory_order_relaxed);
+    m_audio_status.pattern.store(m_state.music.pattern, std::memory_order_relaxed);
+    m_audio_status.count.store(m_state.music.count, std::memory_order_relaxed);
+    m_audio_status.ticks.store(int16_t(m_state.music.offset), std::memory_order_relaxed);
+}
+
+void vm::publish_audio_stats(std::chrono::steady_clock::time_point start,
+                             size_t frames, uint64_t const channel_ns[4])
+{
+    using namespace std::chrono;
+    auto &stats = m_audio_stats;
+    auto const elapsed = uint64_t(duration_cast<nanoseconds>(steady_clock::now() - start).count());
+    auto const duration = uint64_t(frames * 1'000'000'000 / 22050);
+
+    // Allow for some jitter in the callback period before reporting an
+    // underrun; backends usually keep at least one more buffer queued.
+    if (stats.callbacks.load(std::memory_order_relaxed) > 0)
+    {
+        auto const period = uint64_t(duration_cast<nanoseconds>(start - m_audio_last_callback).count());
+        auto const last_duration = uint64_t(stats.last_frames.load(std::memory_order_relaxed))
+                                       * 1'000'000'000 / 22050;
+        if (period > last_duration * 3 / 2)
+            stats.underruns.fetch_add(1, std::memory_order_relaxed);
+        stats.period_ns.store(uint32_t(std::min(period, uint64_t(UINT32_MAX))), std::memory_order_relaxed);
+    }
+    m_audio_last_callback = start;
+
+    if (elapsed > duration)
+        stats.overruns.fetch_add(1, std::memory_order_relaxed);
+
+    // Keep the peak as a ratio of render time over buffer duration
+    if (elapsed * stats.peak_frames.load(std::memory_order_relaxed)
+         > stats.peak_ns.load(std::memory_order_relaxed) * frames)
+    {
+        stats.peak_ns.store(uint32_t(std::min(elapsed, uint64_t(UINT32_MAX))), std::memory_order_relaxed);
+        stats.peak_frames.store(uint32_t(frames), std::memory_order_relaxed);
+    }
+
+    stats.last_ns.store(uint32_t(std::min(elapsed, uint64_t(UINT32_MAX))), std::memory_order_relaxed);
+    stats.last_frames.store(uint32_t(frames), std::memory_order_relaxed);
+    stats.total_ns.fetch_add(elapsed, std::memory_order_relaxed);
+    stats.total_frames.fetch_add(frames, std::memory_order_relaxed);
+    for (int chan = 0; chan < 4; ++chan)
+        stats.channel_ns[chan].fetch_add(channel_ns[chan], std::memory_order_relaxed);
+    stats.callbacks.fetch_add(1, std::memory_order_release);
+}
+
+// Return a one-line summary of the audio statistics, with loads given as
+// a percentage of real time
+std::string vm::audio_stats_summary() const
+{
+    auto const &stats = m_audio_stats;
+    auto load = [](uint64_t ns, uint64_t frames)
+    {
+        return frames ? 100.0 * ns * 22050 / (frames * 1e9) : 0.0;
+    };
+
+    uint64_t const total_frames = stats.total_frames.load(std::memory_order_relaxed);
+    std::string ret = std::format("{} callbacks, load {:.1f}% (last {:.1f}%, peak {:.1f}%), "
+                                  "period {:.1f} ms, {} underruns, {} overruns, channels",
+        stats.callbacks.load(std::memory_order_relaxed),
+        load(stats.total_ns.load(std::memory_order_relaxed), total_frames),
+        load(stats.last_ns.load(std::memory_order_relaxed), stats.last_frames.load(std::memory_order_relaxed)),
+        load(stats.peak_ns.load(std::memory_order_relaxed), stats.peak_frames.load(std::memory_order_relaxed)),
+        stats.period_ns.load(std::memory_order_relaxed) * 1e-6,
+        stats.underruns.load(std::memory_order_relaxed),
+        stats.overruns.load(std::memory_order_relaxed));
+    for (int chan = 0; chan < 4; ++chan)
+        ret += std::format(" {:.2f}%", load(stats.channel_ns[chan].load(std::memory_order_relaxed), total_frames));
+    return ret;
+}
 
 } // namespace z8::pico8
\ No newline at end of file
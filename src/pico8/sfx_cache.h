@@ -0,0 +1,109 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <algorithm> // std::min, std::max
+#include <atomic>    // std::atomic
+#include <cmath>     // std::exp2
+#include <cstddef>   // offsetof
+#include <cstdint>   // uint8_t, uint32_t
+
+#include "pico8/memory.h"
+
+// The sfx_cache class
+// ———————————————————
+// Values derived from each SFX that the audio code would otherwise
+// recompute for every sample: the last audible note, whether the loop
+// is valid, and the frequency of every note. Each SFX has a generation
+// counter that is bumped whenever it changes, and entries are rebuilt
+// lazily when their generation is out of date. The cache describes the
+// audio thread's copy of the SFX data, so vm::apply_audio_data() calls
+// invalidate() for each SFX that differs in a new snapshot.
+
+namespace z8::pico8
+{
+
+static inline float key_to_freq(float key)
+{
+    using std::exp2;
+    return 440.f * exp2((key - 33.f) / 12.f);
+}
+
+class sfx_cache
+{
+public:
+    struct info
+    {
+        uint32_t generation = ~uint32_t(0);
+
+        // One past the index of the last note with a non-zero volume
+        int last_note = 0;
+
+        // From the documentation: “Looping is turned off when the start
+        // index >= end index”.
+        bool has_loop = false;
+
+        float freq[32];
+    };
+
+    // Mark every SFX as modified
+    void invalidate()
+    {
+        for (auto &generation : m_generation)
+            generation.fetch_add(1, std::memory_order_release);
+    }
+
+    // Mark the SFX covering bytes [addr, addr + size) of PICO-8 memory as
+    // modified; addresses outside the sfx area are ignored.
+    void invalidate(int addr, int size)
+    {
+        int const base = int(offsetof(memory, sfx));
+        int const first = std::max(addr, base) - base;
+        int const end = std::min(addr + size, base + int(sizeof(sfx_t)) * 64) - base;
+        for (int n = first / int(sizeof(sfx_t)); n * int(sizeof(sfx_t)) < end; ++n)
+            m_generation[n].fetch_add(1, std::memory_order_release);
+    }
+
+    // The current generation of SFX n
+    uint32_t generation(int n) const
+    {
+        return m_generation[n].load(std::memory_order_acquire);
+    }
+
+    // Return the metadata for SFX n, rebuilding it if necessary
+    info const &get(sfx_t const &sfx, int n)
+    {
+        info &entry = m_info[n];
+        uint32_t const current = generation(n);
+        if (entry.generation != current)
+        {
+            entry.generation = current;
+            entry.last_note = 0;
+            for (int i = 0; i < 32; ++i)
+            {
+                if (sfx.notes[i].volume > 0)
+                    entry.last_note = i + 1;
+                entry.freq[i] = key_to_freq(sfx.notes[i].key);
+            }
+            entry.has_loop = sfx.loop_end > sfx.loop_start;
+        }
+        return entry;
+    }
+
+private:
+    info m_info[64];
+    std::atomic<uint32_t> m_generation[64] = {};
+};
+
+} // namespace z8::pico8
+
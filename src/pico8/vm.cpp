@@ -19,7 +19,7 @@
 #include <lol/file>     // lol::file
 #include <lol/utils> // lol::split
 
-#include <algorithm>  // std::min
+#include <algorithm>  // std::min, std::any_of
 #include <filesystem>
 #include <format>     // std::format
 #include <chrono>
@@ -31,6 +31,7 @@
 #include "pico8/vm.h"
 #include "bindings/lua.h"
 #include "bios.h"
+#include "hash.h"
 
 // FIXME: activate this one day, when we use Lua 5.3 maybe?
 #define HAVE_LUA_GETEXTRASPACE 0
@@ -121,7 +122,7 @@ std::string const &vm::get_code() const
 
 u4mat2<128, 128> const &vm::get_front_screen() const
 {
-    return m_front_buffer;
+    return m_frames.front().screen;
 }
 
 u4mat2<128, 128> const& vm::get_current_screen() const
@@ -129,9 +130,9 @@ u4mat2<128, 128> const& vm::get_current_screen() const
     if (m_in_pause) return m_front_buffer;
     if (m_ram.draw_state.misc_features.multi_screen)
     {
-        if (m_multiscreen_current > 0 && m_multiscreen_current <= m_multiscreens.size())
+        if (m_multiscreen_current > 0 && m_multiscreen_current <= int(m_multiscreens.size()))
         {
-            return *m_multiscreens[m_multiscreen_current - 1];
+            return m_multiscreens[m_multiscreen_current - 1];
         }
     }
     return m_ram.hw_state.mapping_screen == 0 ? m_ram.gfx : m_ram.screen;
@@ -139,12 +140,48 @@ u4mat2<128, 128> const& vm::get_current_screen() const
 
 u4mat2<128, 128>& vm::get_current_screen()
 {
-    return const_cast<u4mat2<128, 128> &>(std::as_const(*this).get_current_screen());
+    auto &screen = const_cast<u4mat2<128, 128> &>(std::as_const(*this).get_current_screen());
+
+    // Drawing into the sprite sheet bypasses raw_poke(), so the decoded
+    // sprites can no longer be trusted
+    if (&screen == &m_ram.gfx)
+        m_gfx_cache.invalidate();
+    return screen;
+}
+
+gfx_cache *vm::get_gfx_cache()
+{
+    auto &hw = m_ram.hw_state;
+
+    // The cache is not used when the sprite sheet is mapped to the screen,
+    // or when the screen is mapped to the sprite sheet.
+    if (hw.mapping_spritesheet == 0x60 || hw.mapping_screen == 0)
+        return nullptr;
+
+    return &m_gfx_cache;
 }
 
 lol::ivec2 vm::get_screen_resolution() const
 {
-    return lol::ivec2(128 * m_multiscreens_x, 128 * m_multiscreens_y);
+    // The layout of the frame that render() converts, which may lag
+    // behind the one the cart is currently drawing
+    auto const &f = m_frames.front();
+    return lol::ivec2(128 * f.multiscreens_x, 128 * f.multiscreens_y);
+}
+
+bool vm::acquire_frame()
+{
+    if (!m_frames.update())
+        return false;
+
+    auto latency = std::chrono::steady_clock::now() - m_frames.front().published;
+    m_frame_latency_ns = uint32_t(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+    return true;
+}
+
+std::chrono::steady_clock::time_point vm::frame_input_time() const
+{
+    return m_frames.front().input_time;
 }
 
 std::tuple<uint8_t *, size_t> vm::ram()
@@ -158,6 +195,32 @@ std::tuple<uint8_t *, size_t> vm::rom()
     return std::make_tuple(&rom[0], sizeof(rom));
 }
 
+std::tuple<uint8_t *, size_t> vm::save_ram()
+{
+    return std::make_tuple(m_ram.persistent, sizeof(m_ram.persistent));
+}
+
+void vm::set_deterministic(bool enabled, uint32_t seed)
+{
+    // Takes effect on the next reset
+    m_deterministic = enabled;
+    m_seed = seed;
+}
+
+uint64_t vm::checksum() const
+{
+    hasher h;
+    h.add(&m_ram, sizeof(m_ram));
+    h.add(m_time);
+    h.add(m_state.buttons);
+
+    // Only state owned by the VM thread: audio is covered by the commands
+    // sent to the audio thread, which determine what it plays
+    h.add(m_audio_command_hash);
+
+    return h.get();
+}
+
 void vm::runtime_error(std::string str)
 {
     // This function never returns
@@ -174,13 +237,7 @@ int vm::panic_hook(lua_State* l)
 
 void vm::instruction_hook(lua_State *l, lua_Debug *)
 {
-#if HAVE_LUA_GETEXTRASPACE
-    vm *that = *static_cast<vm**>(lua_getextraspace(l));
-#else
-    lua_getglobal(l, "\x01");
-    vm *that = (vm *)lua_touserdata(l, -1);
-    lua_remove(l, -1);
-#endif
+    vm *that = bindings::lua::get_this<vm>(l);
 
     // FIXME: we should verify if we are in a coroutine or not before yielding
     // if cart is slow to render, this function can sometimes be triggered from bios
@@ -311,20 +368,47 @@ void handle_exit_request()
 
 void vm::private_init_ram()
 {
+    // External save data belongs to the frontend, which may write it
+    // back at any time, so it must survive a reset
+    uint8_t persistent[sizeof(m_ram.persistent)];
+    if (m_external_save)
+        ::memcpy(persistent, m_ram.persistent, sizeof(persistent));
     ::memset(&m_ram, 0, sizeof(m_ram));
+    if (m_external_save)
+        ::memcpy(m_ram.persistent, persistent, sizeof(persistent));
+    m_gfx_cache.invalidate();
+    m_audio_data_dirty = true;
 
     // init mapping default values:
     m_ram.hw_state.mapping_screen = 0x60;
     m_ram.hw_state.mapping_map = 0x20;
     m_ram.hw_state.mapping_map_width = 0x80;
 
-    // Initialise the PRNG with the current time
-    auto now = std::chrono::high_resolution_clock::now();
-    api_srand(fix32::frombits((int32_t)now.time_since_epoch().count()));
+    // Initialise the PRNG with the current time, or with the seed given
+    // by the frontend in deterministic mode
+    if (m_deterministic)
+        api_srand(fix32::frombits(int32_t(m_seed)));
+    else
+    {
+        auto now = std::chrono::high_resolution_clock::now();
+        api_srand(fix32::frombits((int32_t)now.time_since_epoch().count()));
+    }
+
+    // Derive the audio noise generators from the same seed, without
+    // consuming PRNG values
+    seed_audio(m_ram.hw_state.prng.b);
 
     // also reset timer, maybe should be done in a separate function?
     m_time = 0;
+    m_ticks = 0;
+    m_audio_command_hash = 0;
     m_timer_last = std::chrono::steady_clock::now();
+    m_audio_log_next = 0.0;
+
+    // Always publish the first frame of a new cart
+    m_frame_hash.reset();
+
+    sync_audio_registers();
 }
 
 bool vm::private_load(std::string name, opt<std::string> breadcrumb, opt<std::string> params)
@@ -412,12 +496,37 @@ void vm::run()
 
 bool vm::step(float /* seconds */)
 {
-    auto time_now = std::chrono::steady_clock::now();
-    if (!m_in_pause)
+    if (m_deterministic)
     {
-        m_time += std::chrono::duration_cast<std::chrono::duration<double>>(time_now - m_timer_last).count();
+        // One step is always 1/60 s, whatever the host is doing
+        if (!m_in_pause)
+            m_time = double(++m_ticks) / 60.0;
+    }
+    else
+    {
+        auto time_now = std::chrono::steady_clock::now();
+        if (!m_in_pause)
+        {
+            m_time += std::chrono::duration_cast<std::chrono::duration<double>>(time_now - m_timer_last).count();
+        }
+        m_timer_last = time_now;
+    }
+
+    // Memory was written behind our back
+    if (m_ram_changed.exchange(false))
+    {
+        m_gfx_cache.invalidate();
+        m_audio_data_dirty = true;
+        sync_audio_registers();
+    }
+
+    // Optionally log the audio statistics every m_audio_log seconds
+    if (m_audio_log > 0 && m_time >= m_audio_log_next)
+    {
+        if (m_audio_log_next > 0.0)
+            lol::msg::info("audio: %s\n", audio_stats_summary().c_str());
+        m_audio_log_next = m_time + m_audio_log;
     }
-    m_timer_last = time_now;
 
     if (m_exit_requested)
     {
@@ -443,6 +552,15 @@ bool vm::step(float /* seconds */)
 
     m_instructions = 0;
 
+    // Hand this frame's music and SFX edits and pause state to the synth
+    flush_audio_data();
+    m_audio_paused.store(m_ram.draw_state.pause_music == 1
+                          || (m_in_pause && m_ram.draw_state.pause_music != 2),
+                         std::memory_order_relaxed);
+
+    if (!m_audio_consumer)
+        render_audio_headless();
+
     save(false);
 
     if (m_watch_file_change && m_cart.has_file_changed())
@@ -518,6 +636,9 @@ void vm::api_run()
     ::memset(m_state.buttons, 0, sizeof(m_state.buttons));
     ::memset(&m_state.mouse, 0, sizeof(m_state.mouse));
 
+    // Drop the PCM samples queued by the previous run
+    m_pcm_flush.store(m_pcm_queue.mark(), std::memory_order_release);
+
     // reset multiscreen
     m_ram.draw_state.misc_features.multi_screen = false;
     m_multiscreens_x = 1;
@@ -555,6 +676,11 @@ void vm::api_reload(int16_t in_dst, int16_t in_src, opt<int16_t> in_size, opt<st
         return;
     }
 
+    m_gfx_cache.invalidate(dst, size);
+    if (dst < 0x4300 && dst + size > 0x3100)
+        m_audio_data_dirty = true;
+    bool const audio_registers = dst < 0x5f44 && dst + size > 0x5f40;
+
     // If reading from after the cart, fill that part with zeroes
     if (src > (int)offsetof(memory, code))
     {
@@ -592,6 +718,9 @@ void vm::api_reload(int16_t in_dst, int16_t in_src, opt<int16_t> in_size, opt<st
     // If there is anything left to copy, it’s zeroes again
     ::memset(&m_ram[dst], 0, size);
 
+    if (audio_registers)
+        sync_audio_registers();
+
     update_registers();
 }
 
@@ -715,6 +844,12 @@ void vm::raw_poke(int16_t addr, uint8_t val)
     if (addr >= 0x5e00 && addr < 0x5f00) m_savefile.set_dirty();
     addr = address_translate(addr);
     m_ram[addr] = (uint8_t)val;
+    if (addr >= 0 && addr < 0x2000)
+        m_gfx_cache.invalidate(addr, 1);
+    else if (addr >= 0x3100 && addr < 0x4300)
+        m_audio_data_dirty = true;
+    else if (addr >= 0x5f40 && addr < 0x5f44)
+        sync_audio_registers();
 }
 
 void vm::api_poke(int16_t addr, std::vector<int16_t> args)
@@ -827,13 +962,19 @@ bool vm::save(bool force)
 bool vm::load_cartdata()
 {
     if (m_cartdata.size() == 0) return false;
-    
+
+    // The frontend already put the data in memory; report whether any
+    if (m_external_save)
+        return std::any_of(std::begin(m_ram.persistent), std::end(m_ram.persistent),
+                           [](uint8_t x) { return x != 0; });
+
     return m_savefile.read_save(get_path_save(m_cartdata), m_ram.persistent);
 }
 
 bool vm::save_cartdata(bool force)
 {
     if (m_cartdata.size() == 0) return false;
+    if (m_external_save) return true;
 
     if (!m_savefile.tick(force)) return true;
     bool saved = m_savefile.write_save(get_path_save(m_cartdata), m_ram.persistent);
@@ -883,6 +1024,7 @@ bool vm::load_config()
         config_parse_256(line, "music_volume", m_state.music.volume_music);
         config_parse_int(line, "filter_index", m_filter_index);
         config_parse_int(line, "fullscreen_method", m_fullscreen);
+        config_parse_int(line, "audio_log", m_audio_log);
         config_parse_int(line, "save_slot", m_save_slot);
     }
 
@@ -891,6 +1033,8 @@ bool vm::load_config()
 
 bool vm::save_config(bool force)
 {
+    // The frontend also owns the settings when it owns the save data
+    if (m_external_save) return true;
     if (!m_configfile.tick(force)) return true;
 
     std::string content;
@@ -899,6 +1043,7 @@ bool vm::save_config(bool force)
     content += config_make_256("music_volume", m_state.music.volume_music);
     content += config_make_int("filter_index", m_filter_index);
     content += config_make_int("fullscreen_method", m_fullscreen);
+    content += config_make_int("audio_log", m_audio_log);
     content += config_make_int("save_slot", m_save_slot);
 
     if (!lol::file::write(get_path_config(), content))
@@ -1004,6 +1149,12 @@ var<bool, int16_t, fix32, std::string, std::nullptr_t> vm::api_stat(int16_t id)
     
     //  150..153 Gamepads axes values
     //  160..169 Physical sensors - gyro, magneto,etc.
+    //  170      ZEPTO Audio load of the last callback (1.0 == real time)
+    //  171      ZEPTO Audio peak load
+    //  172      ZEPTO Audio callback period in ms
+    //  173      ZEPTO Audio underruns
+    //  174      ZEPTO Audio overruns
+    //  175..178 ZEPTO Audio average load of channels 0..3
 
     //  200..250 ZEPTO UI texts
 
@@ -1061,24 +1212,24 @@ var<bool, int16_t, fix32, std::string, std::nullptr_t> vm::api_stat(int16_t id)
     if ((id >= 16 && id <= 26) || (id >= 46 && id <= 56))
     {
         int16_t audio_id = (id <= 26) ? id : id - 30;
-        if (audio_id >= 16 && audio_id <= 19) 
-            return m_state.channels[audio_id & 3].main_sfx.sfx;
+        // Read the status published by the audio thread
+        if (audio_id >= 16 && audio_id <= 19)
+            return int16_t(m_audio_status.sfx[audio_id & 3]);
 
         if (audio_id >= 20 && audio_id <= 23)
-            return m_state.channels[audio_id & 3].main_sfx.sfx == -1 ? fix32(-1)
-            : fix32((int)m_state.channels[audio_id & 3].main_sfx.offset);
+            return fix32(int(m_audio_status.note[audio_id & 3].load()));
 
         if (audio_id == 24)
-            return int16_t(m_state.music.pattern);
+            return int16_t(m_audio_status.pattern);
 
         if (audio_id == 25)
-            return int16_t(m_state.music.count);
+            return int16_t(m_audio_status.count);
 
         if (audio_id == 26)
-            return int16_t(m_state.music.offset);
+            return int16_t(m_audio_status.ticks);
     }
     if (id == 57)
-        return m_state.music.pattern != -1;
+        return m_audio_status.pattern != -1;
 
     if (id == 29)
     {
@@ -1128,9 +1279,11 @@ var<bool, int16_t, fix32, std::string, std::nullptr_t> vm::api_stat(int16_t id)
 
     if ((id >= 80 && id <= 85) || (id >= 90 && id <= 95))
     {
-        time_t t;
-        time(&t);
-        auto const *tm = (id <= 85 ? std::gmtime : std::localtime)(&t);
+        // In deterministic mode, the clock is stuck at the epoch in UTC
+        time_t t = 0;
+        if (!m_deterministic)
+            time(&t);
+        auto const *tm = (id <= 85 || m_deterministic ? std::gmtime : std::localtime)(&t);
         switch (id % 10)
         {
             case 0: return int16_t(tm->tm_year + 1900);
@@ -1163,6 +1316,17 @@ var<bool, int16_t, fix32, std::string, std::nullptr_t> vm::api_stat(int16_t id)
     if (id == 101)
         return nullptr;
 
+    // PCM channel: queued samples, and the level carts should keep the
+    // queue at to avoid underruns
+    if (id == 108)
+    {
+        // Samples flushed by run() no longer count, even before the audio
+        // thread discards them
+        size_t const queued = m_pcm_queue.mark() - m_pcm_flush.load(std::memory_order_relaxed);
+        return int16_t(std::min(m_pcm_queue.size(), queued));
+    }
+    if (id == 109) return int16_t(pcm_target);
+
     if (id == 120) return false; // TODO: implement serial
     if (id == 121) return false; // TODO: implement serial
     if (id == 120) return false; // TODO: implement serial
@@ -1193,6 +1357,36 @@ var<bool, int16_t, fix32, std::string, std::nullptr_t> vm::api_stat(int16_t id)
         }
     }
 
+    // Host timing stats differ between runs
+    if (id >= 170 && id <= 179 && m_deterministic)
+        return fix32(0);
+
+    if (id >= 170 && id <= 178)
+    {
+        auto const &stats = m_audio_stats;
+        auto load = [](uint64_t ns, uint64_t frames)
+        {
+            return fix32(frames ? float(double(ns) * 22050 / (double(frames) * 1e9)) : 0.f);
+        };
+        auto count = [](uint32_t n) { return int16_t(std::min(n, uint32_t(0x7fff))); };
+
+        switch (id)
+        {
+        case 170: return load(stats.last_ns.load(), stats.last_frames.load());
+        case 171: return load(stats.peak_ns.load(), stats.peak_frames.load());
+        case 172: return fix32(stats.period_ns.load() * 1e-6f);
+        case 173: return count(stats.underruns.load());
+        case 174: return count(stats.overruns.load());
+        default: return load(stats.channel_ns[id - 175].load(), stats.total_frames.load());
+        }
+    }
+
+    if (id == 179)
+    {
+        // Frame publication latency, in milliseconds
+        return fix32(m_frame_latency_ns.load() * 1e-6f);
+    }
+
     if (id >= 200 && id < 200 + m_ui_texts.size())
     {
         return m_ui_texts[id - 200];
@@ -1210,7 +1404,7 @@ void vm::api_printh(rich_string str, opt<std::string> filename, opt<bool> overwr
 {
     std::string decoded;
     for (uint8_t ch : str)
-        decoded += charset::to_utf8[ch];
+        decoded += charset::to_utf8(ch);
 
     // TODO: if filename is "@clip" the message should replaces the contents of the system clipboard instead of writing to a file
     if (filename.has_value())
@@ -1249,6 +1443,7 @@ void vm::fill_metadata(cart &metadata_cart)
                 col |= (label[y * LABEL_WIDTH + x + 1] & 0x1f) << 4;
                 m_ram[(x/2) + y*64] = col;
             }
+        m_gfx_cache.invalidate();
     }
 }
 
@@ -1433,11 +1628,10 @@ void vm::api_map_display(int16_t id)
         {
             m_multiscreens_x = std::max(m_multiscreens_x, 4);
         }
-        int target_screen = m_multiscreen_current - 1;
-        while (target_screen >= m_multiscreens.size())
-        {
-            m_multiscreens.push_back(std::make_shared< u4mat2<128, 128> >());
-        }
+        // One extra screen per tile, so that render() never runs out
+        int const extra = std::max(m_multiscreen_current, m_multiscreens_x * m_multiscreens_y - 1);
+        if (int(m_multiscreens.size()) < extra)
+            m_multiscreens.resize(extra);
     }
 }
 
@@ -1534,6 +1728,15 @@ var<bool, int16_t> vm::api_btnp(opt<int16_t> n, int16_t p)
 
 void vm::api_serial(int16_t chan, int16_t address, int16_t len)
 {
+    if (chan == 0x808)
+    {
+        // Queue PCM samples; anything that does not fit is dropped
+        for (int i = 0; i < len; ++i)
+            if (!m_pcm_queue.push(m_ram[uint16_t(address + i)]))
+                break;
+        return;
+    }
+
     private_stub(std::format("serial(0x{:4x}, 0x{:4x}, 0x{:4x})", chan, address, len));
 }
 
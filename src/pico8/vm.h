@@ -16,6 +16,8 @@
 
 #include <optional>
 #include <variant>
+#include <atomic> // std::atomic
+#include <chrono> // std::chrono
 #include <functional> // std::function
 #include <unordered_map> // std::unordered_map
 
@@ -23,11 +25,16 @@
 #include "bios.h"
 #include "pico8/cart.h"
 #include "pico8/memory.h"
+#include "pico8/gfx_cache.h"
+#include "pico8/sfx_cache.h"
 #include "3rdparty/z8lua/lua.h"
 #include "filter.h"
+#include "ring.h"
+#include "triple_buffer.h"
+#include "worker_pool.h"
 #include "textfile.h"
 
-namespace z8 { class player; }
+namespace z8 { class player; class benchmark; class audio_export; }
 
 namespace z8::pico8
 {
@@ -75,7 +82,10 @@ struct state
         float phi = 0;
         float last_advance = 0;
         float last_sample = 0;
+        uint32_t noise_state = 0x2545f491;
         bool is_music = false;
+        // Playing one of the notes of a custom SFX instrument
+        bool in_custom = false;
     };
 
     struct sfx_state
@@ -103,14 +113,97 @@ struct state
         uint8_t last_main_instrument = 0;
         uint8_t last_main_key = 0;
 
-        int reverb_index = 0;
-        float reverb_2[366] = {};
-        float reverb_4[732] = {};
-
-        filter damp1 = filter(filter::type::highshelf, 2400.0f, 1.0f, -6.0f);
-        filter damp2 = filter(filter::type::highshelf, 1000.0f, 1.0f, -12.0f);
+        // Reverb delay lines of 366 and 732 samples, stored in
+        // power-of-two rings so that indexing is a mask
+        uint32_t reverb_index = 0;
+        float reverb_2[512] = {};
+        float reverb_4[1024] = {};
     }
     channels[4];
+
+    // Dampening filters, one lane per channel
+    filter4 damp1 = filter4(filter::type::highshelf, 2400.0f, 1.0f, -6.0f);
+    filter4 damp2 = filter4(filter::type::highshelf, 1000.0f, 1.0f, -12.0f);
+};
+
+// A request from the VM thread to the audio thread. Commands are applied
+// in order, at the sample matching their timestamp when possible.
+struct audio_command
+{
+    enum class type : uint8_t
+    {
+        sfx,       // args: sfx, channel, offset, length
+        music,     // args: pattern, fade length, mask
+        registers, // args: 0x5f40..0x5f43
+        data,      // no args: the music and SFX data changed
+        seed,      // args: noise seed, low and high 16 bits
+    };
+
+    type cmd;
+    uint64_t time; // in samples of VM time
+    int16_t args[4];
+};
+
+// The music and SFX data that the audio thread plays from. It keeps its
+// own copy, since the VM thread may write to memory at any time.
+struct audio_data
+{
+    song_t song[0x40];
+    sfx_t sfx[0x40];
+};
+
+// Audio state published by the audio thread so that the VM thread can
+// read it without touching the channels
+struct audio_status
+{
+    std::atomic<int16_t> sfx[4] = { -1, -1, -1, -1 };
+    std::atomic<int16_t> note[4] = { -1, -1, -1, -1 };
+    std::atomic<int16_t> pattern = -1;
+    std::atomic<int16_t> count = -1;
+    std::atomic<int16_t> ticks = -1;
+    // Channels playing music, and channels reserved by music()
+    std::atomic<uint8_t> music_channels = 0;
+    std::atomic<uint8_t> music_mask = 0;
+};
+
+// Timing statistics published by the audio thread. An overrun is a
+// callback that took longer to render than its buffer lasts; an underrun
+// is a callback that came so late that the previous buffer must have
+// run out.
+struct audio_stats
+{
+    std::atomic<uint32_t> callbacks = 0;
+    std::atomic<uint32_t> underruns = 0;
+    std::atomic<uint32_t> overruns = 0;
+
+    // Last callback: render time, time since the previous callback, and
+    // number of samples rendered
+    std::atomic<uint32_t> last_ns = 0;
+    std::atomic<uint32_t> period_ns = 0;
+    std::atomic<uint32_t> last_frames = 0;
+    std::atomic<uint32_t> peak_ns = 0;
+    std::atomic<uint32_t> peak_frames = 1;
+
+    // Totals since startup
+    std::atomic<uint64_t> total_ns = 0;
+    std::atomic<uint64_t> total_frames = 0;
+    std::atomic<uint64_t> channel_ns[4] = {};
+};
+
+// A completed frame, as published by the VM thread: the screen and the
+// state that pixel() needs to display it, plus the publication time
+struct frame
+{
+    u4mat2<128, 128> screen;
+    draw_state_t draw_state;
+    hw_state_t hw_state;
+    std::chrono::steady_clock::time_point published;
+    // When the input of the step that drew this frame was sampled
+    std::chrono::steady_clock::time_point input_time;
+
+    // Extra screens in multiscreen mode, after the main one in row order
+    int multiscreens_x = 1, multiscreens_y = 1;
+    std::vector<u4mat2<128, 128>> multiscreens;
 };
 
 struct breadcrumb_path
@@ -123,6 +216,8 @@ struct breadcrumb_path
 class vm : public z8::vm_base
 {
     friend class z8::player;
+    friend class z8::benchmark;
+    friend class z8::audio_export;
 
 public:
     vm();
@@ -140,11 +235,17 @@ public:
     virtual u4mat2<128, 128> const &get_front_screen() const override;
     u4mat2<128, 128> const& get_current_screen() const;
     u4mat2<128, 128>& get_current_screen();
+    gfx_cache *get_gfx_cache();
     virtual lol::ivec2 get_screen_resolution() const override;
+    virtual bool acquire_frame() override;
+    virtual std::chrono::steady_clock::time_point frame_input_time() const override;
 
     virtual int get_ansi_color(uint8_t c) const override;
+    virtual lol::u8vec3 get_rgb(uint8_t c) const override;
 
     virtual void render(lol::u8vec4 *screen) const override;
+    virtual void render_rgb565(uint16_t *screen, int pitch) const override;
+    virtual void render_xrgb8888(uint32_t *screen, int pitch) const override;
 
     virtual void get_audio(void* inbuffer, size_t in_bytes) override;
 
@@ -156,6 +257,12 @@ public:
 
     virtual std::tuple<uint8_t *, size_t> ram() override;
     virtual std::tuple<uint8_t *, size_t> rom() override;
+    virtual void ram_changed() override { m_ram_changed = true; }
+    virtual std::tuple<uint8_t *, size_t> save_ram() override;
+    virtual void set_external_save(bool enabled) override { m_external_save = enabled; }
+    virtual void set_audio_consumer(bool enabled) override { m_audio_consumer = enabled; }
+    virtual void set_deterministic(bool enabled, uint32_t seed = 0) override;
+    virtual uint64_t checksum() const override;
 
     virtual void request_exit() override { m_exit_requested = true; };
     virtual bool is_running() override { return m_is_running; };
@@ -367,31 +474,98 @@ public:
     };
 
 private:
-    uint8_t get_pixel(int16_t x, int16_t y) const;
+    uint8_t get_pixel(u4mat2<128, 128> const &screen, int16_t x, int16_t y) const;
     uint8_t pixel(int x, int y, u4mat2<128, 128> const& screen) const;
+    template<typename T> void render_frame(T *screen, int pitch) const;
     void private_set_pause(bool pause);
     void private_end_render();
 
+    uint16_t get_palt_mask() const;
+    bool is_identity_palette(uint16_t colors) const;
     uint32_t to_color_bits(opt<fix32> c);
     uint32_t raw_to_bits(uint8_t c) const;
 
     void scrool_screen(int16_t scroll_amount);
 
-    void set_pixel(int16_t x, int16_t y, uint32_t color_bits);
+    // Drawing primitives take the draw target from get_current_screen(),
+    // which API functions resolve once instead of for every pixel
+    void set_pixel(u4mat2<128, 128> &screen, int16_t x, int16_t y, uint32_t color_bits);
+
+    enum class clip_state { hidden, partial, visible };
+    clip_state clip_test(int x0, int y0, int x1, int y1, uint32_t color_bits) const;
 
-    void hline(int16_t x1, int16_t x2, int16_t y, uint32_t color_bits);
-    void vline(int16_t x, int16_t y1, int16_t y2, uint32_t color_bits);
+    void hline(u4mat2<128, 128> &screen, int16_t x1, int16_t x2, int16_t y, uint32_t color_bits);
+    void vline(u4mat2<128, 128> &screen, int16_t x, int16_t y1, int16_t y2, uint32_t color_bits);
+    void hspan(u4mat2<128, 128> &screen, int16_t x, int16_t y, uint64_t mask, uint32_t color_bits);
+
+    // One character of print(), with its rows as bitmasks where bit n is
+    // column n, the size of its bitmap and cell, and its screen position
+    struct glyph_draw
+    {
+        uint8_t rows[8];
+        int16_t w, h, width, height;
+        int16_t x, y;
+    };
+    void draw_glyph_spans(u4mat2<128, 128> &screen, glyph_draw const &glyph, print_state_t const &ps,
+                          uint32_t color_bits, uint32_t background_bits);
+    void draw_glyph_pixels(u4mat2<128, 128> &screen, glyph_draw const &glyph, print_state_t const &ps,
+                           uint32_t color_bits, uint32_t background_bits);
 
     int16_t get_map_size_x();
     int16_t get_map_size_y(int16_t map_size_x);
 
-    float get_synth_sample(state::synth_param &params);
-    void update_sfx_state(state::sfx_state& cur_sfx, state::synth_param& new_synth, float freq_factor, float length, bool is_music, bool can_loop, bool half_rate, double inv_frames_per_second);
+    // Values derived from an SFX and its playback parameters that stay
+    // the same for every sample, so that they are only computed when a
+    // channel starts playing something else.
+    struct sfx_invariants
+    {
+        int16_t sfx = -1;
+        uint32_t generation = 0;
+        float length = 0.f;
+        bool is_music = false;
+        bool can_loop = false;
+
+        sfx_cache::info const *meta = nullptr;
+        int speed = 1;
+        double offset_per_second = 0.0;
+        double offset_per_frame = 0.0;
+        float loop_range = 0.f;
+        bool has_end = false;
+        float end_time = 32.f;
+    };
+
+    float get_synth_sample(state::synth_param &params, float music_fade);
+    void prepare_sfx_state(state::sfx_state const& cur_sfx, sfx_invariants &inv, float length, bool is_music, bool can_loop, double inv_frames_per_second);
+    void update_sfx_state(state::sfx_state& cur_sfx, sfx_invariants const& inv, state::synth_param& new_synth, float freq_factor, bool half_rate, double inv_frames_per_second);
+    bool step_music(bool is_pause, int16_t &next_pattern, int16_t &next_count);
+    template<bool steady_path = true>
+    void render_channel(int chan, size_t count, float const *music_fade, double const *music_offset, bool is_pause, float *out, float *damp1, float *damp2);
     void update_registers();
     void update_prng();
     void set_music_pattern(int pattern);
     void launch_sfx(int16_t sfx, int16_t chan, float offset, float length, bool is_music);
 
+    // Audio thread side of sfx() and music()
+    void apply_sfx(int16_t sfx, int16_t chan, int16_t offset, int16_t length);
+    void apply_music(int16_t pattern, int16_t fade_len, int16_t mask);
+
+    void push_audio_command(audio_command::type cmd, int16_t a0, int16_t a1 = 0, int16_t a2 = 0, int16_t a3 = 0);
+    void apply_audio_command(audio_command const &command);
+    void predict_audio_status(audio_command const &command);
+    template<bool steady_path = true>
+    void render_audio(int16_t *buffer, size_t in_frames, uint64_t channel_ns[4]);
+    void render_audio_headless();
+    void sync_audio_registers();
+    void publish_audio_status();
+    void publish_audio_stats(std::chrono::steady_clock::time_point start,
+                             size_t frames, uint64_t const channel_ns[4]);
+    std::string audio_stats_summary() const;
+    void seed_audio(uint32_t seed);
+    void flush_audio_data();
+    void apply_audio_data(audio_data const &data);
+    void apply_audio_seed(uint32_t seed);
+    void reset_audio(uint32_t seed);
+
     bool save(bool force);
 
     bool load_cartdata();
@@ -421,26 +595,95 @@ private:
     cart m_cart;
     memory m_ram;
     state m_state;
+
+    // The last completed frame on the VM side (the pause menu draws on
+    // top of it), and the frames on their way to the rendering thread
     u4mat2<128, 128> m_front_buffer;
     draw_state_t m_front_draw_state;
     hw_state_t m_front_hw_state;
+    triple_buffer<frame> m_frames;
+    std::optional<uint64_t> m_frame_hash;
+
+    // Time between the publication of the current front frame and its
+    // acquisition by the rendering thread
+    std::atomic<uint32_t> m_frame_latency_ns = 0;
+
+    // Decoded sprite sheet, and the memory mapping it was built for
+    gfx_cache m_gfx_cache;
+
+    // Per-SFX note metadata used by the audio thread
+    sfx_cache m_sfx_cache;
+
+    // Communication with the audio thread: commands from the VM, and the
+    // published audio status. The audio thread uses its own copy of the
+    // audio hardware registers, and maps VM time to its own position
+    // using m_audio_sync.
+    spsc_ring<audio_command, 256> m_audio_queue;
+    audio_status m_audio_status;
+    audio_stats m_audio_stats;
+    std::chrono::steady_clock::time_point m_audio_last_callback;
+    struct { uint8_t half_rate, reverb, distort, lowpass; } m_audio_hw = {};
+    uint64_t m_audio_sync = 0;
+
+    // The audio thread's copy of the music and SFX data. The VM thread
+    // marks its memory dirty when it writes to that area, and publishes
+    // a snapshot before the next command or at the end of the step; the
+    // audio thread picks it up when it applies the matching data command.
+    audio_data m_audio_data = {};
+    triple_buffer<audio_data> m_audio_data_exchange;
+    bool m_audio_data_dirty = true;
+
+    // Whether the synth is paused, as of the end of the latest step
+    std::atomic<bool> m_audio_paused = false;
+
+    // Running hash of every command issued since the last reset. The
+    // channel state belongs to the audio thread, so checksum() uses this
+    // instead to cover audio.
+    uint64_t m_audio_command_hash = 0;
+
+    // Without a frontend calling get_audio(), step() renders the audio
+    // itself; m_audio_rendered counts the samples it rendered so far
+    bool m_audio_consumer = false;
+    uint64_t m_audio_rendered = 0;
+
+    // PCM channel: 8-bit unsigned samples at 5512.5 Hz, written by
+    // serial(0x808) and mixed by the audio thread like an SFX channel.
+    // Each sample lasts four output samples. run() discards pending
+    // samples by setting m_pcm_flush to the producer mark. The target level
+    // of about 90 ms covers a few frames plus one audio buffer.
+    static int const pcm_target = 512;
+    spsc_ring<uint8_t, 16384> m_pcm_queue;
+    std::atomic<size_t> m_pcm_flush = 0;
+    float m_pcm_sample = 0.f;
+    int m_pcm_phase = 0;
 
     int m_filter_index = 0;
     int m_fullscreen = 1;
+    // Read the built-in waveforms from tables; a session setting that is
+    // never saved to the config file, because it changes the output
+    bool m_wavetable_synth = false;
+    int m_audio_log = 0;
+    double m_audio_log_next = 0.0;
     bool m_pointer_locked = false;
 
     bool m_quit_confirmation = false;
 
-    // multiscreen
+    // multiscreen: screen 0 is the regular screen, and the others are
+    // stored contiguously, one per extra tile of the layout
     int m_multiscreen_current = 0;
     int m_multiscreens_x = 1;
     int m_multiscreens_y = 1;
-    std::vector<std::shared_ptr<u4mat2<128, 128>>> m_multiscreens;
+    std::vector<u4mat2<128, 128>> m_multiscreens;
+
+    // Threads converting multiscreen tiles, created on first use by the
+    // rendering thread
+    mutable std::unique_ptr<worker_pool> m_render_pool;
 
     bool m_in_pause = false;
 
     // Files
     int m_save_slot = 0;
+    bool m_external_save = false;
     std::string m_cartdata;
     textfile m_savefile;
     textfile m_configfile;
@@ -454,6 +697,12 @@ private:
 
     double m_time;
     std::chrono::steady_clock::time_point m_timer_last;
+
+    // In deterministic mode, time only advances with VM steps, the PRNG
+    // seed comes from the frontend, and host clocks are never read
+    bool m_deterministic = false;
+    uint32_t m_seed = 0;
+    uint64_t m_ticks = 0;
     int m_instructions = 0;
     const int m_default_max_instructions = 300000;
     int m_max_instructions = m_default_max_instructions;
@@ -484,6 +733,7 @@ private:
     bool m_watch_file_change = false;
 #endif
     bool m_exit_requested = false;
+    std::atomic<bool> m_ram_changed = false;
     bool m_is_running = true;
 };
 
@@ -19,6 +19,9 @@
 #include <lol/vector>    // lol::vec2
 #include <lol/transform> // lol::mat4
 #include <lol/color>     // lol::color
+#include <any>           // std::any
+#include <chrono>        // std::chrono
+#include <cstdio>        // std::snprintf
 
 #include "player.h"
 
@@ -80,6 +83,12 @@ player::player(bool is_embedded, bool is_raccoon)
     else
         m_vm.reset((z8::vm_base *)new pico8::vm());
 
+    // Pacing statistics, in milliseconds
+    m_vm->add_stat(180, [this]() { return std::any(fix32(m_pacer.jitter_ms())); });
+    m_vm->add_stat(181, [this]() { return std::any(fix32(m_pacer.step_ms())); });
+    m_vm->add_stat(182, [this]() { return std::any(fix32(m_pacer.delay_ms())); });
+    m_vm->add_stat(183, [this]() { return std::any(fix32(m_pacer.latency_ms())); });
+
     // Allow text input
     lol::input::keyboard()->capture_text(true);
 
@@ -93,6 +102,7 @@ player::player(bool is_embedded, bool is_raccoon)
     // Register audio callbacks
     {
         using namespace std::placeholders;
+        m_vm->set_audio_consumer(true);
         std::function<void(void*, int)> f = std::bind(&vm_base::get_audio, m_vm, _1, _2);
         m_stream = lol::audio::start_streaming(f, lol::audio::format::sint16le, 22050, 1);
     }
@@ -109,12 +119,17 @@ player::player(bool is_embedded, bool is_raccoon)
     m_font_tile = lol::TileSet::create("font", new lol::old_image(*img), lol::ivec2(128, 32), lol::ivec2(1, 1));
 #endif
 
-    /* Allocate memory */
-    m_screen.resize(128 * 128);
+    // The IDE renders embedded players itself
+    if (!m_embedded)
+        m_converter = std::thread(&player::convert_frames, this);
 }
 
 player::~player()
 {
+    m_quit = true;
+    if (m_converter.joinable())
+        m_converter.join();
+
     lol::TileSet::destroy(m_tile);
 #if 0
     lol::TileSet::destroy(m_font_tile);
@@ -132,6 +147,13 @@ void player::load(std::string const &name)
     m_vm->load(name);
 }
 
+void player::set_wavetable_synth(bool enabled)
+{
+    // Only the PICO-8 synth has wavetables
+    if (auto vm = std::dynamic_pointer_cast<pico8::vm>(m_vm))
+        vm->m_wavetable_synth = enabled;
+}
+
 void player::run()
 {
     m_vm->run();
@@ -141,8 +163,15 @@ void player::tick_game(float seconds)
 {
     lol::WorldEntity::tick_game(seconds);
 
-    // Aspect ratio
-    lol::ivec2 screen_size = m_vm->get_screen_resolution();
+    // Possibly wait for the best moment to sample input and step the VM
+    m_pacer.tick();
+    m_pacer.begin_step();
+    m_vm->set_input_time(m_pacer.input_time());
+
+    // Aspect ratio, from the latest converted frame; the IDE renders
+    // embedded players on this thread
+    lol::ivec2 screen_size = m_embedded ? m_vm->get_screen_resolution()
+                                        : lol::ivec2(m_screen_width, m_screen_height);
     m_win_size = lol::video::size();
     m_scale = (float)std::min(m_win_size.x / screen_size.x, m_win_size.y / screen_size.y);
     m_screen_pos = lol::ivec2((lol::vec2(m_win_size) - lol::vec2(screen_size.x * m_scale, screen_size.y * m_scale)) / 2.f);
@@ -192,6 +221,9 @@ void player::tick_game(float seconds)
 
         for (auto ch : keyboard->text())
             m_vm->text(ch);
+
+        if (keyboard->key_pressed(lol::input::key::SC_F3))
+            m_overlay = !m_overlay;
     }
 
     // Drag-and-drop events
@@ -200,6 +232,7 @@ void player::tick_game(float seconds)
 
     // Step the VM
     m_vm->step(seconds);
+    m_pacer.end_step();
 }
 
 void player::tick_draw(float seconds, lol::Scene &scene)
@@ -224,33 +257,100 @@ void player::tick_draw(float seconds, lol::Scene &scene)
 
     if (!m_embedded)
     {
-        lol::ivec2 screen_size = m_vm->get_screen_resolution();
+        // Upload the latest converted frame, if there is a new one
+        if (m_images.update())
+        {
+            auto const &screen = m_images.front();
+
+            lol::ivec2 tile_size = m_tile->GetImageSize();
+            if (tile_size.x != screen.size.x || tile_size.y != screen.size.y)
+            {
+                lol::TileSet::destroy(m_tile);
+
+                auto img = new lol::old_image(screen.size);
+                img->unlock(img->lock<lol::PixelFormat::RGBA_8>()); // ensure RGBA_8 is present
+
+                m_tile = lol::TileSet::create("tile", new lol::old_image(*img), screen.size, lol::ivec2(1, 1));
+            }
+
+            if (m_tile->GetTexture())
+            {
+                // Blit buffer to the texture
+                // FIXME: move this to some kind of memory viewer class?
+                m_tile->GetTexture()->Bind();
+                m_tile->GetTexture()->SetData(screen.pixels.data());
+                m_pacer.presented(screen.input_time);
+            }
+        }
 
-        lol::ivec2 tile_size = m_tile->GetImageSize();
-        if (tile_size.x != screen_size.x || tile_size.y != screen_size.y)
+        if (m_tile->GetTexture())
         {
-            lol::TileSet::destroy(m_tile);
+            scene.get_renderer()->clear_color(lol::color::black);
+            scene.AddTile(m_tile, 0, lol::vec3((float)m_screen_pos.x, (float)m_screen_pos.y, 10.f), lol::vec2(m_scale), 0.f);
+        }
+    }
+}
 
-            auto img = new lol::old_image(screen_size);
-            img->unlock(img->lock<lol::PixelFormat::RGBA_8>()); // ensure RGBA_8 is present
+void player::convert_frames()
+{
+    while (!m_quit)
+    {
+        // Sleep until the VM completes a frame; the timeout only bounds
+        // how long the destructor waits for this thread
+        if (!m_vm->wait_frame(std::chrono::milliseconds(50)) || !m_vm->acquire_frame())
+            continue;
+
+        // The VM stamped the frame with the input of the step that drew
+        // it, which may be older than the latest one
+        auto &screen = m_images.back();
+        screen.input_time = m_vm->frame_input_time();
+        screen.size = m_vm->get_screen_resolution();
+        m_screen_width = screen.size.x;
+        m_screen_height = screen.size.y;
+        screen.pixels.resize(size_t(screen.size.x * screen.size.y));
+        m_vm->render(screen.pixels.data());
+        if (m_overlay)
+            draw_overlay(screen);
+        m_images.publish();
+    }
+}
 
-            m_tile = lol::TileSet::create("tile", new lol::old_image(*img), screen_size, lol::ivec2(1, 1));
+// Draw the pacing statistics in the top left corner of the screen,
+// using a tiny 3×5 font that only has the characters we need
+void player::draw_overlay(image &screen) const
+{
+    static std::map<char, uint16_t> const font
+    {
+        { '0', 0x7b6f }, { '1', 0x2c97 }, { '2', 0x73e7 }, { '3', 0x73cf },
+        { '4', 0x5bc9 }, { '5', 0x79cf }, { '6', 0x79ef }, { '7', 0x7249 },
+        { '8', 0x7bef }, { '9', 0x7bcf }, { '.', 0x0002 }, { 'D', 0x6b6e },
+        { 'J', 0x126f }, { 'L', 0x4927 }, { 'S', 0x388e }, { ' ', 0x0000 },
+    };
 
-            m_screen.resize(screen_size.x * screen_size.y);
-        }
+    float const values[] = { m_pacer.step_ms(), m_pacer.jitter_ms(),
+                             m_pacer.delay_ms(), m_pacer.latency_ms() };
+    char const labels[] = { 'S', 'J', 'D', 'L' };
 
-        // Render the VM screen to our buffer
-        m_vm->render(m_screen.data());
+    for (int line = 0; line < 4; ++line)
+    {
+        char text[16];
+        std::snprintf(text, sizeof(text), "%c%5.1f", labels[line], values[line]);
 
-        if (m_tile->GetTexture())
+        // Black background, white text
+        int const x0 = 0, y0 = line * 6;
+        for (int n = 0; text[n]; ++n)
         {
-            // Blit buffer to the texture
-            // FIXME: move this to some kind of memory viewer class?
-            m_tile->GetTexture()->Bind();
-            m_tile->GetTexture()->SetData(m_screen.data());
-
-            scene.get_renderer()->clear_color(lol::color::black);
-            scene.AddTile(m_tile, 0, lol::vec3((float)m_screen_pos.x, (float)m_screen_pos.y, 10.f), lol::vec2(m_scale), 0.f);
+            auto glyph = font.find(text[n]);
+            uint16_t bits = glyph != font.end() ? glyph->second : 0;
+            for (int dy = 0; dy < 6; ++dy)
+            for (int dx = 0; dx < 4; ++dx)
+            {
+                int x = x0 + n * 4 + dx, y = y0 + dy;
+                if (x >= screen.size.x || y >= screen.size.y)
+                    continue;
+                bool on = dx < 3 && dy < 5 && (bits >> (14 - dy * 3 - dx) & 1);
+                screen.pixels[y * screen.size.x + x] = on ? lol::u8vec4(255) : lol::u8vec4(0, 0, 0, 255);
+            }
         }
     }
 }
@@ -16,13 +16,25 @@
 #include <map>    // std::map
 #include <vector> // std::vector
 #include <memory> // std::shared_ptr
+#include <atomic> // std::atomic
+#include <thread> // std::thread
 
 #include "zepto8.h"
+#include "triple_buffer.h"
+#include "pacer.h"
 #include "pico8/cart.h"
 
 // The player class
 // ————————————————
 // This is a high-level Lol Engine entity that runs the ZEPTO-8 VM.
+// The VM is stepped in tick_game(); a converter thread picks up each
+// frame it completes and converts it to RGBA, and tick_draw() only
+// uploads the latest converted image, if any, to the texture.
+//
+// The game loop timing is measured by a pacer, which can also delay each
+// step so that input is sampled as late as possible. Its statistics are
+// available through stat(180) to stat(183), and F3 toggles an overlay
+// that shows them.
 
 namespace z8
 {
@@ -39,6 +51,12 @@ public:
     void load(std::string const &name);
     void run();
 
+    // Schedule VM steps as late as possible before the next tick
+    void set_jit_pacing(bool enabled) { m_pacer.set_jit(enabled); }
+
+    // Use the wavetable oscillators for this session only
+    void set_wavetable_synth(bool enabled);
+
     std::shared_ptr<vm_base> get_vm() { return m_vm; }
 
     // HACK: if get_texture() is called, rendering is disabled (this
@@ -47,13 +65,33 @@ public:
     lol::Texture *get_font_texture();
 
 private:
+    struct image
+    {
+        lol::ivec2 size;
+        std::vector<lol::u8vec4> pixels;
+        // When the input that led to this frame was sampled
+        pacer::clock::time_point input_time;
+    };
+
+    void convert_frames();
+    void draw_overlay(image &screen) const;
+
     std::shared_ptr<vm_base> m_vm;
 
     std::map<lol::input::key, int> m_input_map;
-    std::vector<lol::u8vec4> m_screen;
+
+    // Converted frames, from the converter thread to the draw thread
+    triple_buffer<image> m_images;
+    std::thread m_converter;
+    std::atomic<bool> m_quit = false;
+
+    // Pacing and latency measurement
+    pacer m_pacer;
+    std::atomic<bool> m_overlay = false;
 
     // Video
     bool m_embedded = false;
+    std::atomic<int> m_screen_width = 128, m_screen_height = 128;
     lol::ivec2 m_win_size;
     lol::ivec2 m_screen_pos;
     float m_scale;
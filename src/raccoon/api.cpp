@@ -14,9 +14,10 @@
 #   include "config.h"
 #endif
 
-#include <lol/math>   // lol::rand
 #include <lol/vector> // lol::u8vec3
 #include <lol/msg>    // lol::msg
+#include <cmath>      // std::floor
+#include <random>     // std::generate_canonical
 
 #include "zepto8.h"
 #include "raccoon/vm.h"
@@ -261,8 +262,8 @@ void vm::api_print(int x, int y, std::string str, int c)
 
 double vm::api_rnd(std::optional<double> x)
 {
-    return x.has_value() ? std::floor(lol::rand(x.value()))
-                         : lol::rand(1.0);
+    double r = std::generate_canonical<double, 53>(m_rng);
+    return x.has_value() ? std::floor(r * x.value()) : r;
 }
 
 double vm::api_mid(double x, double y, double z)
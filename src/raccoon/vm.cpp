@@ -27,6 +27,7 @@ extern "C" {
 #include "raccoon/vm.h"
 #include "bios.h" // TODO: remove references to PICO-8 stuff
 #include "bindings/js.h"
+#include "hash.h"
 
 namespace z8::raccoon
 {
@@ -146,6 +147,9 @@ void vm::run()
     memset(&m_ram, 0, sizeof(m_ram));
     memcpy(&m_ram, &m_rom, offsetof(decltype(m_ram), end_of_rom));
 
+    if (m_seed)
+        m_rng.seed(*m_seed);
+
     // Initialise gamepad state
     m_ram.gamepad.layouts[0] = 0;
     m_ram.gamepad.layouts[1] = 1;
@@ -181,6 +185,15 @@ bool vm::step(float /* seconds */)
         "if (typeof draw != 'undefined') draw();\n";
     eval_buf(m_ctx, code, "<step_code>", JS_EVAL_TYPE_GLOBAL);
 
+    // Hand the frame over to the rendering thread
+    auto &f = m_frames.back();
+    memcpy(&f.screen, &m_ram.screen, sizeof(f.screen));
+    for (int n = 0; n < 16; ++n)
+        f.palette[n] = m_ram.palette[n].color;
+    f.input_time = m_input_time;
+    m_frames.publish();
+    frame_completed();
+
     m_ram.gamepad.prev_buttons = m_ram.gamepad.buttons;
     m_ram.gamepad.buttons.fill(0);
 
@@ -201,25 +214,66 @@ void vm::text(char ch)
 {
 }
 
-void vm::render(lol::u8vec4 *screen) const
+template<typename T, typename F>
+static void render_screen(T *screen, int pitch, u4mat2<128, 128> const &data,
+                          lol::u8vec3 const *palette, F convert)
 {
     /* Precompute the current palette for pairs of pixels */
-    struct { lol::u8vec4 a, b; } lut[256];
+    struct { T a, b; } lut[256];
     for (int n = 0; n < 256; ++n)
     {
-        lut[n].a = lol::u8vec4(m_ram.palette[n % 16].color, 0xff);
-        lut[n].b = lol::u8vec4(m_ram.palette[n / 16].color, 0xff);
+        lut[n].a = convert(palette[n % 16]);
+        lut[n].b = convert(palette[n / 16]);
     }
 
     /* Render actual screen */
-    for (auto &line : m_ram.screen.data)
-    for (uint8_t p : line)
+    for (auto &line : data.data)
     {
-        *screen++ = lut[p].a;
-        *screen++ = lut[p].b;
+        T *dst = screen;
+        for (uint8_t p : line)
+        {
+            *dst++ = lut[p].a;
+            *dst++ = lut[p].b;
+        }
+        screen += pitch;
     }
 }
 
+bool vm::acquire_frame()
+{
+    return m_frames.update();
+}
+
+std::chrono::steady_clock::time_point vm::frame_input_time() const
+{
+    return m_frames.front().input_time;
+}
+
+void vm::render(lol::u8vec4 *screen) const
+{
+    auto const &f = m_frames.front();
+    render_screen(screen, 128, f.screen, f.palette,
+                  [](lol::u8vec3 c) { return lol::u8vec4(c, 0xff); });
+}
+
+void vm::render_rgb565(uint16_t *screen, int pitch) const
+{
+    auto const &f = m_frames.front();
+    render_screen(screen, pitch, f.screen, f.palette, [](lol::u8vec3 c)
+    {
+        return uint16_t((c.r >> 3) << 11 | (c.g >> 2) << 5 | c.b >> 3);
+    });
+}
+
+void vm::render_xrgb8888(uint32_t *screen, int pitch) const
+{
+    auto const &f = m_frames.front();
+    render_screen(screen, pitch, f.screen, f.palette, [](lol::u8vec3 c)
+    {
+        return 0xff000000u | uint32_t(c.r) << 16 | uint32_t(c.g) << 8 | c.b;
+    });
+}
+
 int vm::get_ansi_color(uint8_t c) const
 {
     // FIXME: this is the PICO-8 palette for now
@@ -246,6 +300,11 @@ int vm::get_ansi_color(uint8_t c) const
     return ansi_palette[c & 15];
 }
 
+lol::u8vec3 vm::get_rgb(uint8_t c) const
+{
+    return m_frames.front().palette[c & 15];
+}
+
 std::string const &vm::get_code() const
 {
     return m_code;
@@ -253,7 +312,7 @@ std::string const &vm::get_code() const
 
 u4mat2<128, 128> const &vm::get_front_screen() const
 {
-    return m_ram.screen;
+    return m_frames.front().screen;
 }
 
 lol::ivec2 vm::get_screen_resolution() const
@@ -276,6 +335,20 @@ std::tuple<uint8_t *, size_t> vm::rom()
     return std::make_tuple(&m_rom[0], offsetof(decltype(m_rom), end_of_rom));
 }
 
+void vm::set_deterministic(bool enabled, uint32_t seed)
+{
+    // Raccoon has no clock; only the random generator needs a fixed seed,
+    // applied on the next reset
+    m_seed = enabled ? std::optional<uint32_t>(seed) : std::nullopt;
+}
+
+uint64_t vm::checksum() const
+{
+    hasher h;
+    h.add(&m_ram, sizeof(m_ram));
+    return h.get();
+}
+
 static std::string get_property_str(JSContext *ctx, JSValue obj, char const *name)
 {
     JSValue prop = JS_GetPropertyStr(ctx, obj, name);
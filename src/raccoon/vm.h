@@ -13,11 +13,13 @@
 #pragma once
 
 #include <optional>   // std::optional
+#include <random>     // std::mt19937
 #include <lol/vector> // lol::ivec2
 
 #include "zepto8.h"
 #include "player.h"
 #include "raccoon/memory.h"
+#include "triple_buffer.h"
 
 namespace z8::raccoon
 {
@@ -37,11 +39,16 @@ public:
     virtual float getTime() override { return 1.0f; };
 
     virtual void render(lol::u8vec4 *screen) const override;
+    virtual void render_rgb565(uint16_t *screen, int pitch) const override;
+    virtual void render_xrgb8888(uint32_t *screen, int pitch) const override;
 
     virtual std::string const &get_code() const override;
     virtual u4mat2<128, 128> const &get_front_screen() const override;
     virtual lol::ivec2 get_screen_resolution() const override;
+    virtual bool acquire_frame() override;
+    virtual std::chrono::steady_clock::time_point frame_input_time() const override;
     virtual int get_ansi_color(uint8_t c) const override;
+    virtual lol::u8vec3 get_rgb(uint8_t c) const override;
 
     virtual void get_audio(void* inbuffer, size_t in_bytes) override;
 
@@ -53,6 +60,12 @@ public:
 
     virtual std::tuple<uint8_t *, size_t> ram() override;
     virtual std::tuple<uint8_t *, size_t> rom() override;
+    virtual void ram_changed() override {}
+    virtual std::tuple<uint8_t *, size_t> save_ram() override { return std::make_tuple(nullptr, 0); }
+    virtual void set_external_save(bool enabled) override {}
+    virtual void set_audio_consumer(bool enabled) override {}
+    virtual void set_deterministic(bool enabled, uint32_t seed = 0) override;
+    virtual uint64_t checksum() const override;
 
     virtual bool is_running() override { return true; };
     virtual void request_exit() override {};
@@ -158,6 +171,21 @@ private:
 
     memory m_rom;
     memory m_ram;
+
+    // Completed frames on their way to the rendering thread
+    struct frame
+    {
+        u4mat2<128, 128> screen;
+        lol::u8vec3 palette[16];
+        std::chrono::steady_clock::time_point input_time;
+    };
+    triple_buffer<frame> m_frames;
+
+    // Each VM has its own random generator instead of sharing lol::rand()
+    std::mt19937 m_rng { std::random_device{}() };
+
+    // Fixed seed applied on every reset, in deterministic mode
+    std::optional<uint32_t> m_seed;
 };
 
 } // namespace z8::raccoon
@@ -0,0 +1,117 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/math>  // lol::F_TAU
+#include <algorithm> // std::min, std::max, std::copy
+#include <cmath>     // std::sin, std::cos
+#if defined __SSE__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 1)
+#   include <xmmintrin.h>
+#   define HAVE_UPSAMPLER_SSE 1
+#elif defined __ARM_NEON
+#   include <arm_neon.h>
+#   define HAVE_UPSAMPLER_NEON 1
+#endif
+
+#include "resampler.h"
+
+namespace z8
+{
+
+upsampler::upsampler()
+{
+    // Blackman-windowed sinc, sampled halfway between input samples and
+    // centred between m_history[taps / 2 - 1] and m_history[taps / 2]
+    float sum = 0.f;
+    for (int k = 0; k < taps; ++k)
+    {
+        float const t = float(k) - float(taps / 2) + 0.5f;
+        float const x = (float(k) + 0.5f) / float(taps);
+        float const window = 0.42f - 0.5f * std::cos(lol::F_TAU * x)
+                                   + 0.08f * std::cos(2.f * lol::F_TAU * x);
+        float const pi_t = lol::F_TAU / 2 * t;
+        m_coeff[k] = window * std::sin(pi_t) / pi_t;
+        sum += m_coeff[k];
+    }
+
+    // Normalise for unity gain at DC
+    for (auto &c : m_coeff)
+        c /= sum;
+
+    reset();
+}
+
+void upsampler::reset()
+{
+    m_history.assign(taps - 1, 0.f);
+}
+
+void upsampler::run(int16_t const *in, size_t count, int16_t *out)
+{
+    // Append the new samples to the history, rounding the block up to a
+    // multiple of four so that the SIMD loop never reads out of bounds
+    size_t const padded = (count + 3) & ~size_t(3);
+    m_history.resize(taps - 1 + padded, 0.f);
+    for (size_t i = 0; i < count; ++i)
+        m_history[taps - 1 + i] = in[i] * (1.f / 32768.f);
+
+    auto to_int16 = [](float x) -> int16_t
+    {
+        return int16_t(std::min(std::max(x * 32768.f, -32768.f), 32767.f));
+    };
+
+    float const *src = m_history.data();
+    for (size_t i = 0; i < count; i += 4)
+    {
+        // Compute the odd samples between src[i + k + taps / 2 - 1] and
+        // src[i + k + taps / 2] for k = 0…3
+        alignas(16) float odd[4];
+#if HAVE_UPSAMPLER_SSE
+        __m128 acc = _mm_setzero_ps();
+        for (int k = 0; k < taps; ++k)
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(m_coeff[k]), _mm_loadu_ps(src + i + k)));
+        _mm_store_ps(odd, acc);
+#elif HAVE_UPSAMPLER_NEON
+        float32x4_t acc = vdupq_n_f32(0.f);
+        for (int k = 0; k < taps; ++k)
+            acc = vmlaq_n_f32(acc, vld1q_f32(src + i + k), m_coeff[k]);
+        vst1q_f32(odd, acc);
+#else
+        for (int j = 0; j < 4; ++j)
+        {
+            odd[j] = 0.f;
+            for (int k = 0; k < taps; ++k)
+                odd[j] += m_coeff[k] * src[i + j + k];
+        }
+#endif
+
+        for (size_t j = 0; j < 4 && i + j < count; ++j)
+        {
+            int16_t const even_sample = to_int16(src[i + j + taps / 2 - 1]);
+            int16_t const odd_sample = to_int16(odd[j]);
+            int16_t *dst = out + 4 * (i + j);
+            dst[0] = dst[1] = even_sample;
+            dst[2] = dst[3] = odd_sample;
+        }
+    }
+
+    // Keep the last taps - 1 input samples for the next block
+    std::copy(m_history.begin() + count, m_history.begin() + count + taps - 1,
+              m_history.begin());
+    m_history.resize(taps - 1);
+}
+
+} // namespace z8
+
@@ -0,0 +1,53 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstddef> // size_t
+#include <cstdint> // int16_t
+#include <vector>  // std::vector
+
+// The upsampler class
+// ———————————————————
+// Doubles the sample rate of a mono stream (22050 Hz to 44100 Hz) and
+// duplicates it to interleaved stereo. This is a two-phase polyphase FIR:
+// even output samples are the input samples themselves, and odd output
+// samples are interpolated with a windowed sinc. Four consecutive odd
+// samples are computed at once using SIMD. The output is delayed by
+// taps / 2 input samples.
+
+namespace z8
+{
+
+class upsampler
+{
+public:
+    static int const taps = 32;
+
+    upsampler();
+
+    // Reset the filter history to silence
+    void reset();
+
+    // Consume count mono samples and write 2 * count stereo frames,
+    // i.e. 4 * count values, to out
+    void run(int16_t const *in, size_t count, int16_t *out);
+
+private:
+    alignas(16) float m_coeff[taps];
+
+    // The last taps - 1 input samples, followed by the current block
+    std::vector<float> m_history;
+};
+
+} // namespace z8
+
@@ -0,0 +1,88 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <atomic>  // std::atomic
+#include <cstddef> // size_t, ptrdiff_t
+
+// The spsc_ring class
+// ———————————————————
+// A fixed-size lock-free queue for exactly one producer thread and one
+// consumer thread. Neither side ever blocks: push() fails when the ring
+// is full and pop() fails when it is empty. N must be a power of two.
+
+namespace z8
+{
+
+template<typename T, size_t N>
+class spsc_ring
+{
+    static_assert(N > 0 && (N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+    // Producer side
+    bool push(T const &item)
+    {
+        size_t const head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) == N)
+            return false;
+        m_items[head & (N - 1)] = item;
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer side: position after the last pushed item, for use with
+    // discard_until()
+    size_t mark() const
+    {
+        return m_head.load(std::memory_order_relaxed);
+    }
+
+    // Consumer side
+    bool pop(T &item)
+    {
+        size_t const tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire))
+            return false;
+        item = m_items[tail & (N - 1)];
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side: drop every item pushed before the given mark; lets
+    // the producer empty the ring without touching the consumer index
+    void discard_until(size_t mark)
+    {
+        size_t const tail = m_tail.load(std::memory_order_relaxed);
+        if (ptrdiff_t(mark - tail) > 0)
+            m_tail.store(mark, std::memory_order_release);
+    }
+
+    // Number of queued items; only a snapshot while the other thread is
+    // pushing or popping
+    size_t size() const
+    {
+        return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+    }
+
+private:
+    T m_items[N];
+
+    // Keep the indices on separate cache lines so that the two threads
+    // do not fight over them
+    alignas(64) std::atomic<size_t> m_head = 0;
+    alignas(64) std::atomic<size_t> m_tail = 0;
+};
+
+} // namespace z8
+
@@ -16,8 +16,8 @@
 
 #include "synth.h"
 
-#include <lol/math> // lol::rand
-#include <cmath>     // std::fabs, std::fmod
+#include <cmath>     // std::fabs, std::fmod, std::floor
+#include <cstdint>   // uint32_t
 
 namespace z8
 {
@@ -79,7 +79,7 @@ float synth::waveform(pico8::state::synth_param &params)
             //const float tscale = 22050 / key_to_freq(63);
             const float tscale = 8.858923f;
             float scale = (advance - params.last_advance) * tscale;
-            float new_sample = (params.last_sample + scale * lol::rand(-1.f, 1.f)) / (1.0f + scale);
+            float new_sample = (params.last_sample + scale * noise(params.noise_state)) / (1.0f + scale);
             
             float factor = 1.0f - params.key / 63.0f;
             ret = new_sample * 1.5f * (1.0f + factor * factor);
@@ -116,5 +116,122 @@ float synth::waveform(pico8::state::synth_param &params)
     return 0.0f;
 }
 
+//
+// Wavetables
+//
+
+namespace
+{
+
+// One cycle of every periodic waveform, sampled from the formulas in
+// synth::waveform() at 2048 points, plus a guard sample equal to the
+// first one so that interpolation never needs to wrap. The buzz variant
+// of the saw loops over two periods and gets a two-cycle table; the
+// phaser adds a triangle at 109/110 of the note frequency, which is
+// stored separately.
+struct wavetables
+{
+    static int const bits = 11;
+    static int const size = 1 << bits;
+
+    wavetables()
+    {
+        using std::fabs;
+
+        pico8::state::synth_param params;
+        for (int inst = 0; inst < 8; ++inst)
+            for (int buzz = 0; buzz < 2; ++buzz)
+            {
+                params.instrument = uint8_t(inst);
+                params.filters = buzz ? 0x4 : 0;
+                for (int i = 0; i <= size; ++i)
+                {
+                    float t = float(i % size) / size;
+                    params.phi = t;
+                    if (inst == synth::INST_NOISE)
+                        cycle[inst][buzz][i] = 0.f;
+                    else if (inst == synth::INST_PHASER)
+                    {
+                        // Only the part that depends on the note phase
+                        float ret = 2.f - fabs(8.f * t - 4.f);
+                        if (buzz)
+                        {
+                            ret += 0.25f - fabs(1.f * std::fmod(t * 2.0f + 0.5f, 1.f) - 0.5f);
+                            ret += 0.125f - fabs(0.5f * std::fmod(t * 4.0f, 1.f) - 0.25f);
+                        }
+                        cycle[inst][buzz][i] = ret / 6.f;
+                    }
+                    else
+                        cycle[inst][buzz][i] = synth::waveform(params);
+                }
+            }
+
+        params.instrument = synth::INST_SAW;
+        params.filters = 0x4;
+        for (int i = 0; i <= 2 * size; ++i)
+        {
+            params.phi = float(i % (2 * size)) / size;
+            saw_buzz[i] = synth::waveform(params);
+        }
+
+        for (int i = 0; i <= size; ++i)
+            phaser[i] = (1.f - fabs(4.f * (float(i % size) / size) - 2.f)) / 6.f;
+    }
+
+    float cycle[8][2][size + 1];
+    float saw_buzz[2 * size + 1];
+    float phaser[size + 1];
+};
+
+// Read a table covering 2^BITS samples at position t ∈ [0,1), using a
+// 32-bit fixed point phase: the top BITS bits select the sample and the
+// next 16 bits are the interpolation factor.
+template<int BITS>
+static inline float lookup(float const *table, float t)
+{
+    uint32_t const phase = uint32_t(double(t) * 4294967296.0);
+    uint32_t const index = phase >> (32 - BITS);
+    uint32_t const frac = (phase >> (16 - BITS)) & 0xffff;
+    float const a = table[index], b = table[index + 1];
+    return a + (b - a) * (float(frac) * (1.f / 65536.f));
+}
+
+} // anonymous namespace
+
+float synth::fast_waveform(pico8::state::synth_param &params)
+{
+    static wavetables const wt;
+
+    // The integer part of the phase must be exact for the fractional
+    // part to be correct; fall back to the formulas for huge values.
+    float const advance = params.phi;
+    if (params.instrument >= 8 || params.instrument == INST_NOISE
+         || !(advance >= 0.f && advance < 4194304.f))
+        return waveform(params);
+
+    float const t = advance - std::floor(advance);
+    bool const buzz = params.filters & 0x4;
+
+    switch (params.instrument)
+    {
+        case INST_SAW:
+            if (buzz)
+            {
+                float const t2 = advance * 0.5f - std::floor(advance * 0.5f);
+                return lookup<wavetables::bits + 1>(wt.saw_buzz, t2);
+            }
+            break;
+        case INST_PHASER:
+        {
+            float const advance2 = advance * 109.f / 110.f;
+            float const t2 = advance2 - std::floor(advance2);
+            return lookup<wavetables::bits>(wt.cycle[INST_PHASER][buzz], t)
+                 + lookup<wavetables::bits>(wt.phaser, t2);
+        }
+    }
+
+    return lookup<wavetables::bits>(wt.cycle[params.instrument][buzz], t);
+}
+
 } // namespace z8
 
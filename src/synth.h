@@ -12,6 +12,8 @@
 
 #pragma once
 
+#include <cstdint> // uint32_t, int32_t
+
 #include "pico8/vm.h"
 
 namespace z8
@@ -37,6 +39,21 @@ public:
     };
 
     static float waveform(pico8::state::synth_param &params);
+
+    // A xorshift32 generator returning values in [-1,1); the state must
+    // be non-zero. Branch-free so that it vectorises across channels.
+    static inline float noise(uint32_t &state)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return float(int32_t(state)) * (1.f / 2147483648.f);
+    }
+
+    // Same as waveform(), but reads precomputed single-cycle tables with
+    // linear interpolation instead of evaluating the formulas. The noise
+    // instrument is not periodic and still uses the formulas.
+    static float fast_waveform(pico8::state::synth_param &params);
 };
 
 } // namespace z8
@@ -12,11 +12,12 @@
 
 #pragma once
 
-#include <lol/msg>    // lol::msg
-#include <lol/utils>  // lol::ends_with
-#include <lol/thread> // lol::timer
-#include <lol/vector> // lol::ivec2
-#include <vector>     // std::vector
+#include <lol/msg>     // lol::msg
+#include <lol/utils>   // lol::ends_with
+#include <lol/thread>  // lol::timer
+#include <lol/vector>  // lol::ivec2
+#include <string>      // std::string
+#include <string_view> // std::string_view
 
 #if HAVE_UNISTD_H
 #   include <unistd.h>
@@ -26,20 +27,147 @@
 #endif
 
 #include "zepto8.h"
+#include "ansi.h"
 #include "pico8/vm.h"
 #include "raccoon/vm.h"
 
-// The telnet class
-// ————————————————
-// This is a high-level telnet server that runs a ZEPTO-8 VM.
+// The telnet_input class
+// ——————————————————————
+// Incremental parser for what a telnet client sends: telnet commands,
+// including window size negotiation (NAWS), terminal escape sequences,
+// and plain keys. It is fed one byte at a time.
 
 namespace z8
 {
 
-struct telnet
+struct telnet_input
 {
-    std::vector<uint8_t> m_screen;
+    std::string m_seq;
     lol::ivec2 m_term_size = lol::ivec2(128, 64);
+    bool m_resized = false;
+
+    // The bytes a server sends to a new client
+    static std::string_view negotiation()
+    {
+        static char const message[] =
+        {
+            '\xff', '\xfb', '\x03', // WILL suppress go ahead (no line buffering)
+            '\xff', '\xfe', '\x22', // DONT linemode (no idea what it does)
+            '\xff', '\xfb', '\x01', // WILL echo (actually disables local echo)
+            '\xff', '\xfd', '\x1f', // DO NAWS (window size negociation)
+        };
+        return std::string_view(message, sizeof(message));
+    }
+
+    // Return the PICO-8 button for a key (8 and above are for the second
+    // player), or −1 if the key is not mapped
+    static int button(int key)
+    {
+        switch (key)
+        {
+            case 0x144: return 0; // left
+            case 0x143: return 1; // right
+            case 0x141: return 2; // up
+            case 0x142: return 3; // down
+            case 'z': case 'Z':
+            case 'c': case 'C':
+            case 'n': case 'N': return 4;
+            case 'x': case 'X':
+            case 'v': case 'V':
+            case 'm': case 'M': return 5;
+            case '\r': case '\n': return 6;
+            case 's': case 'S': return 8;
+            case 'f': case 'F': return 9;
+            case 'e': case 'E': return 10;
+            case 'd': case 'D': return 11;
+            case 'a': case 'A': return 12;
+            case '\t':
+            case 'q': case 'Q': return 13;
+            default: return -1;
+        }
+    }
+
+    // Feed one byte; return a key code, or −1 if no key is complete yet.
+    // Sets m_resized when the client reports a new window size.
+    int feed(char ch)
+    {
+        if (ch != '\x1b' && ch != '\xff' && m_seq.length() == 0)
+            return ch;
+
+        m_seq += ch;
+
+        // TELNET commands
+        if (m_seq[0] == '\xff') // telnet commands
+        {
+            if (m_seq.length() < 2)
+                return -1; // wait for more data
+
+            if (m_seq[1] >= '\xfb' && m_seq[1] <= '\xfe')
+            {
+                if (m_seq.length() < 3)
+                    return -1; // wait for more data
+                goto reset;
+            }
+            else if (m_seq[1] == '\xfa') // subnegociation
+            {
+                if (m_seq.length() < 3)
+                    return -1; // wait for more data
+                if (m_seq[2] != '\x1f')
+                    goto reset; // can’t happen
+                if (m_seq.length() < 9)
+                    return -1; // wait for more data
+                m_term_size.x = (uint8_t)m_seq[3] * 256 + (uint8_t)m_seq[4];
+                m_term_size.y = (uint8_t)m_seq[5] * 256 + (uint8_t)m_seq[6];
+                m_resized = true;
+                goto reset;
+            }
+            else if (m_seq.length() >= 3)
+            {
+                goto reset;
+            }
+
+            return -1;
+        }
+
+        // Escape sequences
+        if (m_seq[0] == '\x1b')
+        {
+            if (m_seq.length() < 2)
+                return -1; // wait for more data
+
+            if (m_seq[1] == '\x5b')
+            {
+                if (m_seq.length() < 3)
+                    return -1; // wait for more data
+                int ret = 0x100 + m_seq[2];
+                m_seq = "";
+                return ret;
+            }
+            else if (m_seq[1] == '\x1b')
+            {
+                m_seq = "";
+                return '\x1b';
+            }
+
+            goto reset;
+        }
+
+reset:
+        m_seq = "";
+        return -1;
+    }
+};
+
+// The telnet class
+// ————————————————
+// This is a high-level telnet server that runs a ZEPTO-8 VM for a single
+// client on stdin and stdout (e.g. under socat). See telnet_server for a
+// standalone multi-client server.
+
+struct telnet
+{
+    ansi_encoder m_encoder;
+    telnet_input m_input;
 
     void run(std::string const &cart)
     {
@@ -53,14 +181,12 @@ struct telnet
         vm->load(cart);
         vm->run();
 
-        auto const &ram = vm->ram();
-
         while (true)
         {
             lol::timer t;
 
             for (int i = 0; i < 16; ++i)
-                vm->button(i, 0);
+                vm->button(i / 8, i % 8, 0);
 
             for (;;)
             {
@@ -68,43 +194,21 @@ struct telnet
                 if (key < 0)
                     break;
 
-                switch (key)
-                {
-                    /* For now, Escape quits */
-                    case 0x1b: return;
-
-                    case 0x144: vm->button(0, 1); break; // left
-                    case 0x143: vm->button(1, 1); break; // right
-                    case 0x141: vm->button(2, 1); break; // up
-                    case 0x142: vm->button(3, 1); break; // down
-                    case 'z': case 'Z':
-                    case 'c': case 'C':
-                    case 'n': case 'N': vm->button(4, 1); break;
-                    case 'x': case 'X':
-                    case 'v': case 'V':
-                    case 'm': case 'M': vm->button(5, 1); break;
-                    case '\r': case '\n': vm->button(6, 1); break;
-                    case 's': case 'S': vm->button(8, 1); break;
-                    case 'f': case 'F': vm->button(9, 1); break;
-                    case 'e': case 'E': vm->button(10, 1); break;
-                    case 'd': case 'D': vm->button(11, 1); break;
-                    case 'a': case 'A': vm->button(12, 1); break;
-                    case '\t':
-                    case 'q': case 'Q': vm->button(13, 1); break;
-                    default:
-                        lol::msg::info("Got unknown key %02x\n", key);
-                        break;
-                }
+                /* For now, Escape quits */
+                if (key == 0x1b)
+                    return;
+
+                int button = telnet_input::button(key);
+                if (button >= 0)
+                    vm->button(button / 8, button % 8, 1);
+                else
+                    lol::msg::info("Got unknown key %02x\n", key);
             }
 
             vm->step(1.f / 60.f);
+            vm->acquire_frame();
 
-            vm->print_ansi(m_term_size,
-                           m_screen.empty() ? nullptr : m_screen.data());
-
-            // FIXME: PICO-8 specific
-            m_screen.resize(0x2000);
-            ::memcpy(m_screen.data(), std::get<0>(ram) + 0x6000, 0x2000);
+            vm->print_ansi(m_encoder, m_input.m_term_size);
 
             t.wait(1.f / 60.f);
         }
@@ -113,23 +217,14 @@ struct telnet
     void disable_echo()
     {
 #if HAVE_UNISTD_H
-        uint8_t const message[] =
-        {
-            0xff, 0xfb, 0x03, // WILL suppress go ahead (no line buffering)
-            0xff, 0xfe, 0x22, // DONT linemode (no idea what it does)
-            0xff, 0xfb, 0x01, // WILL echo (actually disables local echo)
-            0xff, 0xfd, 0x1f, // DO NAWS (window size negociation)
-        };
-
-        write(STDOUT_FILENO, message, sizeof(message));
+        auto message = telnet_input::negotiation();
+        write(STDOUT_FILENO, message.data(), message.size());
 #endif
     }
 
     int get_key()
     {
 #if HAVE_UNISTD_H
-        static std::string seq;
-
         fd_set fds;
         FD_ZERO(&fds);
         FD_SET(STDIN_FILENO, &fds);
@@ -146,68 +241,17 @@ struct telnet
         if (read(STDIN_FILENO, &ch, 1) <= 0)
             exit(EXIT_SUCCESS);
 
-        if (ch != '\x1b' && ch != '\xff' && seq.length() == 0)
-            return ch;
-
-        seq += ch;
-
-        // TELNET commands
-        if (seq[0] == '\xff') // telnet commands
-        {
-            if (seq[1] >= '\xfb' && seq[1] <= '\xfe')
-            {
-                if (seq[2] == 0)
-                    return -1; // wait for more data
-                goto reset;
-            }
-            else if (seq[1] == '\xfa') // subnegociation
-            {
-                if (seq[2] == 0)
-                    return -1; // wait for more data
-                if (seq[2] != '\x1f')
-                    goto reset; // can’t happen
-                if (seq.length() < 9)
-                    return -1; // wait for more data
-                m_term_size.x = (uint8_t)seq[3] * 256 + (uint8_t)seq[4];
-                m_term_size.y = (uint8_t)seq[5] * 256 + (uint8_t)seq[6];
-                printf("\x1b[2J"); // clear screen
-                m_screen.clear();
-                goto reset;
-            }
-            else if (seq.length() >= 3)
-            {
-                goto reset;
-            }
-
-            return -1;
-        }
-
-        // Escape sequences
-        if (seq[0] == '\x1b')
+        int key = m_input.feed(ch);
+        if (m_input.m_resized)
         {
-            if (seq[1] == '\x5b')
-            {
-                if (seq[2] == 0)
-                    return -1; // wait for more data
-                int ret = 0x100 + seq[2];
-                seq = "";
-                return ret;
-            }
-            else if (seq[1] == '\x1b')
-            {
-                seq = "";
-                return '\x1b';
-            }
-
-            return -1;
+            m_input.m_resized = false;
+            m_encoder.reset(); // clears the screen on the next frame
         }
-
-reset:
-        seq = "";
-#endif
+        return key;
+#else
         return -1;
+#endif
     }
 };
 
 } // namespace z8
-
@@ -0,0 +1,487 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include "telnet_server.h"
+
+#if HAVE_SYS_EPOLL_H
+
+#include <lol/msg>   // lol::msg
+#include <lol/utils> // lol::ends_with
+#include <algorithm> // std::max
+#include <chrono>    // std::chrono
+#include <cerrno>    // errno
+#include <cstring>   // std::strerror
+#include <deque>     // std::deque
+#include <iterator>  // std::size
+#include <thread>    // std::thread
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "telnet.h"
+
+namespace z8
+{
+
+struct telnet_server::session
+{
+    int fd;
+    // Connection order; the oldest client hosts the broadcast VM
+    uint64_t seq = 0;
+    std::unique_ptr<vm_base> vm;
+    telnet_input input;
+    ansi_encoder encoder;
+
+    // Buttons pressed since the last frame
+    uint16_t buttons = 0;
+
+    // Pending output, possibly shared with other sessions, and how much
+    // of the first buffer was already sent
+    std::deque<buffer> out;
+    size_t out_pos = 0;
+    bool want_write = false;
+    int dropped = 0;
+
+    // Broadcast mode: whether the viewer received a keyframe and can
+    // follow the delta stream
+    bool synced = false;
+};
+
+static std::shared_ptr<std::string const> make_buffer(std::string_view data)
+{
+    return std::make_shared<std::string const>(data);
+}
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+telnet_server::telnet_server(std::string const &cart, bool broadcast, int threads,
+                             ansi_encoder::color_mode colors)
+  : m_cart(cart),
+    m_colors(colors),
+    m_broadcast(broadcast),
+    m_delta_encoder(colors),
+    m_keyframe_encoder(colors)
+{
+    // The broadcast VM is stepped on the main thread
+    if (broadcast)
+    {
+        m_vm = create_vm();
+        return;
+    }
+
+    // The main thread steps sessions too, as part of the pool
+    if (threads <= 0)
+        threads = std::max(1, int(std::thread::hardware_concurrency()));
+    m_pool = std::make_unique<worker_pool>(threads - 1);
+}
+
+telnet_server::~telnet_server()
+{
+    m_pool.reset();
+
+    for (auto &[fd, s] : m_sessions)
+        ::close(fd);
+    if (m_listen_fd >= 0)
+        ::close(m_listen_fd);
+    if (m_epoll_fd >= 0)
+        ::close(m_epoll_fd);
+}
+
+bool telnet_server::listen(std::string const &address)
+{
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos)
+    {
+        lol::msg::error("invalid address %s, expected host:port or :port\n", address.c_str());
+        return false;
+    }
+
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+
+    addrinfo hints = {}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (int ret = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res))
+    {
+        lol::msg::error("cannot resolve %s: %s\n", address.c_str(), gai_strerror(ret));
+        return false;
+    }
+
+    for (auto *ai = res; ai && m_listen_fd < 0; ai = ai->ai_next)
+    {
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, SOMAXCONN) == 0
+             && set_nonblocking(fd))
+            m_listen_fd = fd;
+        else
+            ::close(fd);
+    }
+    freeaddrinfo(res);
+
+    if (m_listen_fd < 0)
+    {
+        lol::msg::error("cannot listen on %s: %s\n", address.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    m_epoll_fd = epoll_create1(0);
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = m_listen_fd;
+    if (m_epoll_fd < 0 || epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &ev) != 0)
+    {
+        lol::msg::error("cannot set up epoll: %s\n", std::strerror(errno));
+        return false;
+    }
+
+    lol::msg::info("listening on %s\n", address.c_str());
+    return true;
+}
+
+std::unique_ptr<vm_base> telnet_server::create_vm() const
+{
+    std::unique_ptr<vm_base> vm;
+    if (lol::ends_with(m_cart, ".rcn.json"))
+        vm.reset((vm_base *)new raccoon::vm());
+    else
+        vm.reset((vm_base *)new pico8::vm());
+
+    // Sessions step on worker threads and would race on the same save
+    // and config files; keep their cart data in memory
+    if (!m_broadcast)
+        vm->set_external_save(true);
+
+    vm->load(m_cart);
+    vm->run();
+    return vm;
+}
+
+void telnet_server::run()
+{
+    using clock = std::chrono::steady_clock;
+    auto const frame = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / 60));
+    auto next_frame = clock::now() + frame;
+
+    for (;;)
+    {
+        auto const wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_frame - clock::now());
+        epoll_event events[64];
+        int count = epoll_wait(m_epoll_fd, events, 64, std::max(0, int(wait.count())));
+        if (count < 0 && errno != EINTR)
+        {
+            lol::msg::error("epoll_wait failed: %s\n", std::strerror(errno));
+            return;
+        }
+
+        for (int n = 0; n < count; ++n)
+        {
+            int fd = events[n].data.fd;
+            if (fd == m_listen_fd)
+            {
+                accept_clients();
+                continue;
+            }
+
+            auto it = m_sessions.find(fd);
+            if (it == m_sessions.end())
+                continue;
+
+            if (events[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                read_client(*it->second);
+            if (m_sessions.count(fd) && (events[n].events & EPOLLOUT)
+                 && !flush_client(*it->second))
+                close_client(fd);
+        }
+
+        auto const now = clock::now();
+        if (now < next_frame)
+            continue;
+
+        // Do not try to catch up after a stall; just skip the lost frames
+        next_frame = now - next_frame > frame ? now + frame : next_frame + frame;
+
+        if (m_broadcast)
+            step_broadcast();
+        else
+            step_sessions();
+
+        std::vector<int> closed;
+        for (auto &[fd, s] : m_sessions)
+            if (!flush_client(*s))
+                closed.push_back(fd);
+        for (int fd : closed)
+            close_client(fd);
+    }
+}
+
+void telnet_server::accept_clients()
+{
+    for (;;)
+    {
+        int fd = accept(m_listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            return;
+
+        if (!set_nonblocking(fd))
+        {
+            ::close(fd);
+            continue;
+        }
+
+        static buffer const negotiation = make_buffer(telnet_input::negotiation());
+
+        auto s = std::make_unique<session>();
+        s->fd = fd;
+        s->seq = m_session_seq++;
+        s->encoder = ansi_encoder(m_colors);
+        if (!m_broadcast)
+            s->vm = create_vm();
+        s->out.push_back(negotiation);
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            ::close(fd);
+            continue;
+        }
+
+        m_sessions[fd] = std::move(s);
+        if (m_broadcast && m_host_fd < 0)
+            m_host_fd = fd;
+        lol::msg::info("client %d connected, %d sessions\n", fd, int(m_sessions.size()));
+        if (!flush_client(*m_sessions[fd]))
+            close_client(fd);
+    }
+}
+
+void telnet_server::read_client(session &s)
+{
+    char buf[256];
+    for (;;)
+    {
+        ssize_t ret = ::read(s.fd, buf, sizeof(buf));
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+        {
+            close_client(s.fd);
+            return;
+        }
+
+        for (ssize_t i = 0; i < ret; ++i)
+        {
+            int key = s.input.feed(buf[i]);
+
+            // Broadcast frames are always 128×64 and cannot be resized
+            if (s.input.m_resized)
+            {
+                s.input.m_resized = false;
+                if (!m_broadcast)
+                    s.encoder.reset(); // clears the screen on the next frame
+            }
+
+            /* For now, Escape quits */
+            if (key == 0x1b)
+            {
+                close_client(s.fd);
+                return;
+            }
+
+            int button = telnet_input::button(key);
+            if (button >= 0)
+                s.buttons |= uint16_t(1 << button);
+        }
+    }
+}
+
+// Send as much pending output as the socket accepts; return false if
+// the connection is broken
+bool telnet_server::flush_client(session &s)
+{
+    while (!s.out.empty())
+    {
+        iovec iov[64];
+        int count = 0;
+        for (auto const &b : s.out)
+        {
+            size_t const skip = count ? 0 : s.out_pos;
+            iov[count].iov_base = const_cast<char *>(b->data() + skip);
+            iov[count].iov_len = b->size() - skip;
+            if (++count == int(std::size(iov)))
+                break;
+        }
+
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = size_t(count);
+        ssize_t ret = ::sendmsg(s.fd, &msg, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (ret <= 0)
+            return false;
+
+        // Release the buffers that were fully sent
+        size_t sent = size_t(ret);
+        while (!s.out.empty() && sent >= s.out.front()->size() - s.out_pos)
+        {
+            sent -= s.out.front()->size() - s.out_pos;
+            s.out.pop_front();
+            s.out_pos = 0;
+        }
+        s.out_pos += sent;
+    }
+
+    // Only ask for write notifications while output is pending
+    bool const want_write = !s.out.empty();
+    if (want_write != s.want_write)
+    {
+        epoll_event ev = {};
+        ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+        ev.data.fd = s.fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, s.fd, &ev);
+        s.want_write = want_write;
+    }
+    return true;
+}
+
+void telnet_server::close_client(int fd)
+{
+    auto it = m_sessions.find(fd);
+    if (it == m_sessions.end())
+        return;
+
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    lol::msg::info("client %d disconnected, %d frames dropped\n", fd, it->second->dropped);
+    m_sessions.erase(it);
+
+    // Hand the broadcast VM over to the oldest remaining client; file
+    // descriptors are reused, so they say nothing about connection order
+    if (fd == m_host_fd)
+    {
+        m_host_fd = -1;
+        uint64_t oldest = UINT64_MAX;
+        for (auto &[other, s] : m_sessions)
+            if (s->seq < oldest)
+            {
+                oldest = s->seq;
+                m_host_fd = other;
+            }
+    }
+}
+
+void telnet_server::step_sessions()
+{
+    m_batch.clear();
+    for (auto &[fd, s] : m_sessions)
+        m_batch.push_back(s.get());
+    m_pool->run(int(m_batch.size()), [this](int n) { step_session(*m_batch[n]); });
+}
+
+// Called from the worker threads; sessions are independent of each other
+void telnet_server::step_session(session &s)
+{
+    for (int i = 0; i < 16; ++i)
+        s.vm->button(i / 8, i % 8, (s.buttons >> i) & 1);
+    s.buttons = 0;
+
+    s.vm->step(1.f / 60.f);
+    s.vm->acquire_frame();
+
+    // Slow client: keep the VM running but drop this frame
+    if (!s.out.empty())
+    {
+        ++s.dropped;
+        return;
+    }
+
+    auto data = s.encoder.encode(*s.vm, s.input.m_term_size);
+    if (!data.empty())
+        s.out.push_back(make_buffer(data));
+}
+
+void telnet_server::step_broadcast()
+{
+    // Only the host controls the VM
+    auto host = m_sessions.find(m_host_fd);
+    uint16_t buttons = host != m_sessions.end() ? host->second->buttons : 0;
+    for (int i = 0; i < 16; ++i)
+        m_vm->button(i / 8, i % 8, (buttons >> i) & 1);
+    for (auto &[fd, s] : m_sessions)
+        s->buttons = 0;
+
+    m_vm->step(1.f / 60.f);
+    m_vm->acquire_frame();
+
+    // Encode the frame once for everyone
+    lol::ivec2 const term_size(128, 64);
+    buffer delta = make_buffer(m_delta_encoder.encode(*m_vm, term_size));
+    if (m_frame++ % keyframe_interval == 0)
+    {
+        m_keyframe_encoder.reset();
+        m_since_keyframe.assign(1, make_buffer(m_keyframe_encoder.encode(*m_vm, term_size)));
+    }
+    else if (delta->size())
+        m_since_keyframe.push_back(delta);
+
+    for (auto &[fd, s] : m_sessions)
+    {
+        // A viewer with more than max_backlog buffers pending drops
+        // everything it has not started sending, and resyncs
+        if (s->out.size() > size_t(max_backlog))
+        {
+            s->dropped += int(s->out.size()) - 1;
+            s->out.resize(s->out_pos ? 1 : 0);
+            s->synced = false;
+        }
+
+        if (s->synced)
+        {
+            if (delta->size())
+                s->out.push_back(delta);
+        }
+        else
+        {
+            s->out.insert(s->out.end(), m_since_keyframe.begin(), m_since_keyframe.end());
+            s->synced = true;
+        }
+    }
+}
+
+} // namespace z8
+
+#endif // HAVE_SYS_EPOLL_H
+
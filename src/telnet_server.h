@@ -0,0 +1,104 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstdint>       // uint64_t
+#include <memory>        // std::unique_ptr, std::shared_ptr
+#include <string>        // std::string
+#include <unordered_map> // std::unordered_map
+#include <vector>        // std::vector
+
+#include "ansi.h"
+#include "worker_pool.h"
+
+// The telnet_server class
+// ———————————————————————
+// A standalone telnet server that accepts any number of clients on a
+// single epoll loop. Each client gets its own VM and its own terminal
+// size. Every 1/60 s, all VMs are stepped and their frames encoded by a
+// pool of worker threads. Output is never allowed to pile up: while a
+// client has not received its previous frame, new frames are dropped
+// for that client only. Only available on systems with epoll.
+//
+// In broadcast mode, a single VM is controlled by the oldest client and
+// watched by all the others. Each frame is encoded once, as a delta from
+// the previous frame, plus a full keyframe every keyframe_interval
+// frames. All viewers share the same immutable buffers and send them
+// with sendmsg(), which unlike writev() can suppress SIGPIPE. New
+// viewers, and viewers that fall too far behind, start again from the
+// latest keyframe and the deltas that follow it.
+
+namespace z8
+{
+
+class vm_base;
+
+class telnet_server
+{
+    friend class benchmark;
+
+public:
+    telnet_server(std::string const &cart, bool broadcast = false, int threads = 0,
+                  ansi_encoder::color_mode colors = ansi_encoder::color_mode::ansi256);
+    ~telnet_server();
+
+    // Listen on "host:port" or ":port"
+    bool listen(std::string const &address);
+
+    // Serve clients forever
+    void run();
+
+private:
+    struct session;
+    using buffer = std::shared_ptr<std::string const>;
+
+    static int const keyframe_interval = 60;
+
+    // A viewer that just joined holds the negotiation, a keyframe and up
+    // to keyframe_interval - 1 deltas, plus the current frame; only a
+    // longer queue means that it is falling behind
+    static int const max_backlog = 2 * keyframe_interval;
+
+    std::unique_ptr<vm_base> create_vm() const;
+    void accept_clients();
+    void read_client(session &s);
+    bool flush_client(session &s);
+    void close_client(int fd);
+    void step_sessions();
+    void step_session(session &s);
+    void step_broadcast();
+
+    std::string m_cart;
+    ansi_encoder::color_mode m_colors;
+    int m_listen_fd = -1;
+    int m_epoll_fd = -1;
+    std::unordered_map<int, std::unique_ptr<session>> m_sessions;
+    uint64_t m_session_seq = 0;
+
+    // Broadcast mode: the shared VM, the client controlling it, and the
+    // buffers since the latest keyframe
+    bool m_broadcast;
+    std::unique_ptr<vm_base> m_vm;
+    int m_host_fd = -1;
+    ansi_encoder m_delta_encoder, m_keyframe_encoder;
+    std::vector<buffer> m_since_keyframe;
+    uint64_t m_frame = 0;
+
+    // Threads that step the sessions, and the sessions of the current
+    // frame, kept to avoid an allocation per frame
+    std::unique_ptr<worker_pool> m_pool;
+    std::vector<session *> m_batch;
+};
+
+} // namespace z8
+
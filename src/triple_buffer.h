@@ -0,0 +1,67 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <atomic>  // std::atomic
+#include <cstdint> // uint8_t
+
+// The triple_buffer class
+// ———————————————————————
+// A lock-free exchange of whole values between exactly one writer thread
+// and one reader thread. The writer fills back() and publishes it; the
+// reader calls update() to make the most recently published value its
+// front(). Neither side ever blocks or waits for the other, and values
+// that the reader did not pick up in time are simply overwritten.
+
+namespace z8
+{
+
+template<typename T>
+class triple_buffer
+{
+public:
+    // Writer side
+    T &back() { return m_slots[m_back]; }
+
+    void publish()
+    {
+        m_back = m_middle.exchange(uint8_t(m_back | fresh_bit), std::memory_order_acq_rel) & index_mask;
+    }
+
+    // Reader side: return false if nothing was published since the
+    // last call, in which case front() is unchanged
+    bool update()
+    {
+        if (!(m_middle.load(std::memory_order_relaxed) & fresh_bit))
+            return false;
+        m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & index_mask;
+        return true;
+    }
+
+    T &front() { return m_slots[m_front]; }
+    T const &front() const { return m_slots[m_front]; }
+
+private:
+    static uint8_t const index_mask = 0x3;
+    static uint8_t const fresh_bit = 0x4;
+
+    T m_slots[3] = {};
+
+    // The slot in the middle, plus a bit telling whether the reader has
+    // seen it yet; m_back and m_front are only touched by their owner
+    alignas(64) std::atomic<uint8_t> m_middle = 1;
+    alignas(64) uint8_t m_back = 0;
+    alignas(64) uint8_t m_front = 2;
+};
+
+} // namespace z8
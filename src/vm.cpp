@@ -15,73 +15,58 @@
 #endif
 
 #include <lol/vector> // lol::ivec2
-#include <algorithm>  // std::swap, std::min
-#include <cstring>    // memcmp()
+#include <cerrno>     // errno
+#include <cstdio>     // fflush(), fwrite()
+#if HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
 
 #include "zepto8.h"
+#include "ansi.h"
 
 namespace z8
 {
 
-void vm_base::print_ansi(lol::ivec2 term_size,
-                         uint8_t const *prev_screen) const
+void vm_base::print_ansi(ansi_encoder &encoder, lol::ivec2 term_size) const
 {
-    using std::min;
-
-    int palette[16];
-    for (int i = 0; i < 16; ++i)
-        palette[i] = get_ansi_color(i);
-
-    printf("\x1b[?25l"); // hide cursor
+    auto data = encoder.encode(*this, term_size);
+    if (data.empty())
+        return;
 
-    auto &screen = get_front_screen();
-
-    for (int y = 0; y < 2 * min(64, term_size.y); y += 2)
+    // Anything already buffered by stdio must come first
+    fflush(stdout);
+#if HAVE_UNISTD_H
+    while (!data.empty())
     {
-        if (prev_screen && !memcmp(&screen.data[y],
-                                   &prev_screen[y * 64], 128))
+        ssize_t ret = ::write(STDOUT_FILENO, data.data(), data.size());
+        if (ret < 0 && errno == EINTR)
             continue;
+        if (ret <= 0)
+            break;
+        data.remove_prefix(size_t(ret));
+    }
+#else
+    fwrite(data.data(), 1, data.size(), stdout);
+    fflush(stdout);
+#endif
+}
 
-        printf("\x1b[%d;1H", y / 2 + 1);
-
-        int oldfg = -1, oldbg = -1;
-
-        for (int x = 0; x < min(128, term_size.x); ++x)
-        {
-            uint8_t fg = screen.get(x, y);
-            uint8_t bg = screen.get(x, y + 1);
-            char const *glyph = "▀";
-
-            if (fg < bg)
-            {
-                std::swap(fg, bg);
-                glyph = "▄";
-            }
-
-            if (fg == oldfg)
-            {
-                if (bg != oldbg)
-                    printf("\x1b[48;5;%dm", palette[bg]);
-            }
-            else
-            {
-                if (bg == oldbg)
-                    printf("\x1b[38;5;%dm", palette[fg]);
-                else
-                    printf("\x1b[38;5;%d;48;5;%dm", palette[fg], palette[bg]);
-            }
-
-            printf("%s", glyph);
-
-            oldfg = fg;
-            oldbg = bg;
-        }
+bool vm_base::wait_frame(std::chrono::steady_clock::duration timeout)
+{
+    std::unique_lock<std::mutex> lock(m_frame_mutex);
+    if (!m_frame_cv.wait_for(lock, timeout, [this] { return m_frame_completed; }))
+        return false;
+    m_frame_completed = false;
+    return true;
+}
 
-        printf("\x1b[0m\x1b[K"); // reset properties and clear to end of line
+void vm_base::frame_completed()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_frame_mutex);
+        m_frame_completed = true;
     }
-
-    printf("\x1b[?25h"); // show cursor
-    fflush(stdout);
+    m_frame_cv.notify_one();
 }
 
 } // namespace z8
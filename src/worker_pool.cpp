@@ -0,0 +1,81 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include "worker_pool.h"
+
+namespace z8
+{
+
+worker_pool::worker_pool(int threads)
+{
+    for (int i = 0; i < threads; ++i)
+        m_threads.emplace_back(&worker_pool::worker, this);
+}
+
+worker_pool::~worker_pool()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+
+    for (auto &th : m_threads)
+        th.join();
+}
+
+void worker_pool::run(int count, std::function<void(int)> const &fn)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_fn = &fn;
+    m_next = 0;
+    m_count = m_pending = count;
+    m_wake.notify_all();
+
+    // Take part in the work instead of just waiting
+    while (m_next < m_count)
+    {
+        int i = m_next++;
+        lock.unlock();
+        fn(i);
+        lock.lock();
+        --m_pending;
+    }
+
+    m_done.wait(lock, [this]() { return m_pending == 0; });
+    m_fn = nullptr;
+}
+
+void worker_pool::worker()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        m_wake.wait(lock, [this]() { return m_quit || m_next < m_count; });
+        if (m_quit)
+            return;
+
+        int i = m_next++;
+        auto const *fn = m_fn;
+        lock.unlock();
+        (*fn)(i);
+        lock.lock();
+        if (--m_pending == 0)
+            m_done.notify_one();
+    }
+}
+
+} // namespace z8
@@ -0,0 +1,52 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016–2024 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <condition_variable> // std::condition_variable
+#include <functional>         // std::function
+#include <mutex>              // std::mutex
+#include <thread>             // std::thread
+#include <vector>             // std::vector
+
+// The worker_pool class
+// —————————————————————
+// A fixed set of threads that run the iterations of a loop in parallel.
+// The threads are started once and then sleep between loops, so that a
+// loop can be split every frame without paying for thread creation.
+
+namespace z8
+{
+
+class worker_pool
+{
+public:
+    worker_pool(int threads);
+    ~worker_pool();
+
+    // Call fn(i) for every i in [0, count), on the worker threads and on
+    // the calling thread, and return when all calls are done
+    void run(int count, std::function<void(int)> const &fn);
+
+private:
+    void worker();
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake, m_done;
+    std::function<void(int)> const *m_fn = nullptr;
+    int m_next = 0, m_count = 0, m_pending = 0;
+    bool m_quit = false;
+
+    std::vector<std::thread> m_threads;
+};
+
+} // namespace z8
@@ -19,6 +19,9 @@
 #include <lol/msg>    // lol::msg
 #include <lol/utils>  // lol::ends_with
 #include <lol/thread> // lol::timer
+#include <algorithm>  // std::max, std::sort
+#include <cstdlib>    // strtoul
+#include <filesystem> // std::filesystem
 #include <fstream>    // std::ofstream
 #include <sstream>
 #include <iostream>
@@ -33,10 +36,14 @@
 #include "pico8/pico8.h"
 #include "raccoon/vm.h"
 #include "telnet.h"
+#include "telnet_server.h"
 #include "splore.h"
 #include "dither.h"
 #include "minify.h"
 #include "compress.h"
+#include "benchmark.h"
+#include "ansi.h"
+#include "audio_export.h"
 
 enum class mode
 {
@@ -48,11 +55,20 @@ enum class mode
     listlua,
     printast,
     convert,
-    run, headless, telnet,
+    run, headless, telnet, telnet_server,
 
     dither,
     compress,
     splore,
+    export_audio,
+    check_determinism,
+
+    bench_render,
+    bench_print,
+    bench_synth,
+    bench_audio,
+    bench_ansi,
+    bench_broadcast,
 };
 
 void test()
@@ -171,6 +187,85 @@ void test()
 #endif
 }
 
+// Run a cart twice, one run after the other, with the same input and
+// check that both runs go through the same states, as netplay and
+// replays require. The input log has one hexadecimal button mask per
+// frame, eight bits per player; without one, a fixed pseudo-random
+// sequence is used. Disabling deterministic mode checks that a cart
+// does depend on the host, i.e. that it is worth testing.
+static bool check_determinism(std::string const &in, std::string const &input, int frames,
+                              bool deterministic)
+{
+    std::vector<uint32_t> masks;
+    if (!input.empty())
+    {
+        std::ifstream f(input);
+        if (!f)
+        {
+            lol::msg::error("could not open %s\n", input.c_str());
+            return false;
+        }
+        for (std::string line; std::getline(f, line); )
+            if (!line.empty() && line[0] != '#')
+                masks.push_back(uint32_t(strtoul(line.c_str(), nullptr, 16)));
+    }
+    else
+    {
+        // Change buttons every few frames, like a player would
+        for (uint32_t n = 0, seed = 1; n < uint32_t(frames); ++n)
+        {
+            if (n % 8 == 0)
+                seed = seed * 1664525u + 1013904223u;
+            masks.push_back((seed >> 16) & 0x3f3f);
+        }
+    }
+
+    // Run the two instances one after the other, each in a fresh VM,
+    // rather than in lockstep: two runs at the same moment could agree on
+    // state that depends on the host, such as the clock or thread timing
+    std::vector<uint64_t> checksums[2];
+    for (auto &sums : checksums)
+    {
+        std::unique_ptr<z8::vm_base> vm;
+        if (lol::ends_with(in, ".rcn.json"))
+            vm.reset((z8::vm_base *)new z8::raccoon::vm());
+        else
+            vm.reset((z8::vm_base *)new z8::pico8::vm());
+        vm->set_deterministic(deterministic, 0x5eed);
+        vm->set_audio_consumer(true);
+        vm->load(in);
+        vm->run();
+
+        // Pull the audio from this thread, as the only consumer, since
+        // the checksum must not depend on what was rendered
+        int16_t buffer[368];
+        for (size_t n = 0; n < masks.size(); ++n)
+        {
+            size_t const samples = (n + 1) * 22050 / 60 - n * 22050 / 60;
+            for (int player = 0; player < 4; ++player)
+                for (int b = 0; b < 6; ++b)
+                    vm->button(player, b, (masks[n] >> (player * 8 + b)) & 1);
+            vm->step(1.f / 60.f);
+            vm->get_audio(buffer, samples * sizeof(*buffer));
+            sums.push_back(vm->checksum());
+        }
+    }
+
+    for (size_t n = 0; n < masks.size(); ++n)
+    {
+        if (checksums[0][n] != checksums[1][n])
+        {
+            printf("determinism: %s: runs diverge at frame %d (%016llx != %016llx)\n", in.c_str(),
+                   int(n), (unsigned long long)checksums[0][n], (unsigned long long)checksums[1][n]);
+            return false;
+        }
+    }
+
+    printf("determinism: %s: %d frames, checksum %016llx\n", in.c_str(), int(masks.size()),
+           (unsigned long long)(masks.empty() ? 0 : checksums[0].back()));
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     lol::sys::init(argc, argv);
@@ -213,9 +308,20 @@ int main(int argc, char **argv)
 #if HAVE_UNISTD_H
     run->add_flag_function("--telnet", [&](int64_t) { override_mode = mode::telnet; },
                             "Act as telnet server");
+#endif
+#if HAVE_SYS_EPOLL_H
+    std::string telnet_listen;
+    bool telnet_broadcast = false;
+    run->add_option_function<std::string>("--telnet-listen", [&](std::string const &address)
+                            { override_mode = mode::telnet_server; telnet_listen = address; },
+                            "Run a multi-client telnet server on [host]:port");
+    run->add_flag("--telnet-broadcast", telnet_broadcast,
+                  "With --telnet-listen, share one VM between all clients");
 #endif
     run->add_flag_function("--headless", [&](int64_t) { override_mode = mode::headless; },
                             "Run without any output");
+    bool truecolor = false;
+    run->add_flag("--truecolor", truecolor, "Use 24-bit colours in the terminal");
     run->add_option("cart", in, "Cartridge to load")->required();;
 
 #if 0
@@ -240,10 +346,64 @@ int main(int argc, char **argv)
     compress->add_option("--skip", skip, "Number of source bytes to skip");
     compress->add_option("--raw", raw, "Number of raw bytes to store");
 
+    // Render audio offline
+    int music = -1, threads = 0, max_length = 600;
+    std::vector<int> sfx_list;
+    bool wavetable = false;
+    auto export_audio = app.add_subcommand("export-audio", "Render the music or SFX of a cart to a WAV file")
+                            ->callback([&]() { run_mode = mode::export_audio; });
+    auto music_option = export_audio->add_option("--music", music, "Render the song starting at this pattern");
+    export_audio->add_option("--sfx", sfx_list, "Render these SFX one after the other")
+                ->excludes(music_option);
+    export_audio->add_option("--out", out, "Output WAV file")->required();
+    export_audio->add_option("--threads", threads, "Number of render threads (default: one per core)");
+    export_audio->add_option("--max-length", max_length, "Maximum length in seconds");
+    export_audio->add_flag("--wavetable", wavetable, "Use the wavetable oscillators");
+    export_audio->add_option("cart", in, "Cartridge to load")->required();
+
+    std::string input_log;
+    int check_frames = 600;
+    auto check = app.add_subcommand("check-determinism", "Run a cart twice with the same input and compare states")
+                     ->callback([&]() { run_mode = mode::check_determinism; });
+    check->add_option("--input", input_log, "Input log, one hexadecimal button mask per frame");
+    check->add_option("--frames", check_frames, "Number of frames of generated input (default: 600)");
+    bool check_host = false;
+    check->add_flag("--no-deterministic", check_host, "Run in normal mode, to check that the cart depends on the host");
+    check->add_option("cart", in, "Cartridge to load")->required();
+
     // Internal test suite
     app.add_subcommand("test", "Run the test suite")
         ->callback([&]() { run_mode = mode::test; });
 
+    // Benchmarks
+    int frames = 10, seconds = 10;
+    app.add_subcommand("bench-render", "Benchmark screen rendering for all screen modes")
+        ->callback([&]() { run_mode = mode::bench_render; })
+        ->add_option("--frames", frames, "Number of frames per screen mode");
+    app.add_subcommand("bench-print", "Benchmark print() with 2000 characters per frame")
+        ->callback([&]() { run_mode = mode::bench_print; })
+        ->add_option("--frames", frames, "Number of frames per text style");
+    app.add_subcommand("bench-synth", "Benchmark and check the wavetable oscillators")
+        ->callback([&]() { run_mode = mode::bench_synth; })
+        ->add_option("--seconds", seconds, "Number of seconds of audio per instrument");
+    std::vector<std::string> carts;
+    auto bench_audio = app.add_subcommand("bench-audio", "Benchmark the music of carts (default: the bundled carts)")
+                           ->callback([&]() { run_mode = mode::bench_audio; });
+    bench_audio->add_option("--seconds", seconds, "Number of seconds of music per cart");
+    bench_audio->add_option("carts", carts, "Carts to play");
+    auto bench_ansi = app.add_subcommand("bench-ansi", "Benchmark terminal output (default: the bundled carts)")
+                          ->callback([&]() { run_mode = mode::bench_ansi; });
+    bench_ansi->add_option("--frames", frames, "Number of frames per cart");
+    bench_ansi->add_option("carts", carts, "Carts to run");
+#if HAVE_SYS_EPOLL_H
+    int viewers = 200;
+    auto bench_broadcast = app.add_subcommand("bench-broadcast", "Check the telnet broadcast mode with many viewers")
+                               ->callback([&]() { run_mode = mode::bench_broadcast; });
+    bench_broadcast->add_option("--viewers", viewers, "Number of viewers (default: 200)");
+    bench_broadcast->add_option("--frames", frames, "Number of frames");
+    bench_broadcast->add_option("cart", in, "Cartridge to run")->required();
+#endif
+
     CLI11_PARSE(app, argc, argv);
 
     if (override_mode != mode::none)
@@ -329,13 +489,16 @@ int main(int argc, char **argv)
             vm.reset((z8::vm_base *)new z8::pico8::vm());
         vm->load(in);
         vm->run();
+        z8::ansi_encoder encoder(truecolor ? z8::ansi_encoder::color_mode::truecolor
+                                           : z8::ansi_encoder::color_mode::ansi256);
         for (bool running = true; running; )
         {
             lol::timer t;
             running = vm->step(1.f / 60.f);
+            vm->acquire_frame();
             if (run_mode != mode::headless)
             {
-                vm->print_ansi(lol::ivec2(128, 64), nullptr);
+                vm->print_ansi(encoder);
                 t.wait(1.f / 60.f);
             }
         }
@@ -371,6 +534,65 @@ int main(int argc, char **argv)
         }
         break;
     }
+    case mode::bench_render: {
+        z8::benchmark bench;
+        if (!bench.render(frames))
+            return EXIT_FAILURE;
+        break;
+    }
+    case mode::bench_print: {
+        z8::benchmark bench;
+        if (!bench.print(frames))
+            return EXIT_FAILURE;
+        break;
+    }
+    case mode::bench_synth: {
+        z8::benchmark bench;
+        if (!bench.synth(seconds))
+            return EXIT_FAILURE;
+        break;
+    }
+    case mode::bench_audio:
+    case mode::bench_ansi: {
+        // Without arguments, use the carts from the source tree, once
+        // each: skip the PNG version of a cart when the text one exists
+        std::error_code ec;
+        if (carts.empty())
+            for (auto const &entry : std::filesystem::directory_iterator(LOL_CONFIG_SOLUTIONDIR "/carts", ec))
+            {
+                auto const &path = entry.path();
+                if (lol::ends_with(path.string(), ".p8")
+                     || (lol::ends_with(path.string(), ".p8.png")
+                          && !std::filesystem::exists(std::filesystem::path(path).replace_extension(), ec)))
+                    carts.push_back(path.string());
+            }
+        std::sort(carts.begin(), carts.end());
+
+        z8::benchmark bench;
+        bool ok = run_mode == mode::bench_audio ? bench.audio(carts, seconds)
+                                                : bench.ansi(carts, frames);
+        if (!ok)
+            return EXIT_FAILURE;
+        break;
+    }
+    case mode::export_audio: {
+        z8::audio_export exporter(threads, wavetable);
+        if (!exporter.load(in))
+        {
+            lol::msg::error("could not load %s\n", in.c_str());
+            return EXIT_FAILURE;
+        }
+        bool ok = sfx_list.size() ? exporter.sfx(sfx_list, max_length)
+                                  : exporter.music(std::max(music, 0), max_length);
+        if (!ok || !exporter.save(out))
+            return EXIT_FAILURE;
+        break;
+    }
+    case mode::check_determinism:
+        if (!check_determinism(in, input_log, check_frames, !check_host))
+            return EXIT_FAILURE;
+        break;
+
     case mode::splore: {
         z8::splore splore;
         splore.dump(in);
@@ -382,6 +604,23 @@ int main(int argc, char **argv)
         telnet.run(in);
         break;
     }
+#endif
+#if HAVE_SYS_EPOLL_H
+    case mode::bench_broadcast: {
+        z8::benchmark bench;
+        if (!bench.broadcast(in, viewers, frames))
+            return EXIT_FAILURE;
+        break;
+    }
+    case mode::telnet_server: {
+        z8::telnet_server server(in, telnet_broadcast, 0,
+                                 truecolor ? z8::ansi_encoder::color_mode::truecolor
+                                           : z8::ansi_encoder::color_mode::ansi256);
+        if (!server.listen(telnet_listen))
+            return EXIT_FAILURE;
+        server.run();
+        break;
+    }
 #endif
     default:
         return EXIT_FAILURE;
@@ -29,6 +29,8 @@ int main(int argc, char **argv)
 
     std::optional<std::string> cart;
     lol::ivec2 win_size(144 * 4, 144 * 4);
+    bool jit_pacing = false;
+    bool wavetable_synth = false;
 
     lol::cli::app opts("zepto8");
     opts.set_version_flag("-V,--version", PACKAGE_VERSION);
@@ -43,6 +45,8 @@ int main(int argc, char **argv)
     // -preblit_scale n
     // -draw_rect x,y,w,h
     opts.add_option("-run", cart, "Load and run a cartridge")->type_name("<cart>");
+    opts.add_flag("-jit_pacing", jit_pacing, "Sample input and step as late as possible in each frame");
+    opts.add_flag("-wavetable_synth", wavetable_synth, "Use the faster wavetable oscillators");
     // -x filename
     // -export param_str
     // -p param_str
@@ -67,6 +71,8 @@ int main(int argc, char **argv)
     bool is_raccoon = cart && lol::ends_with(*cart, ".rcn.json");
 
     z8::player *player = new z8::player(false, is_raccoon);
+    player->set_jit_pacing(jit_pacing);
+    player->set_wavetable_synth(wavetable_synth);
 
     if (cart)
     {
@@ -13,6 +13,9 @@
 #pragma once
 
 #include <any> // std::any
+#include <chrono>     // std::chrono::steady_clock
+#include <condition_variable> // std::condition_variable
+#include <mutex>      // std::mutex
 #include <lol/vector> // lol::ivec2
 #include <string>     // std::string
 #include <tuple>      // std::tuple
@@ -33,6 +36,8 @@ namespace pico8
     class bios; // TODO: get rid of this
 }
 
+class ansi_encoder;
+
 //
 // A simple 4-bit 2D array
 //
@@ -89,22 +94,51 @@ public:
 
     // Rendering
     virtual void render(lol::u8vec4 *screen) const = 0;
+    // Render directly to the packed formats used by libretro frontends;
+    // pitch is expressed in pixels, not bytes.
+    virtual void render_rgb565(uint16_t *screen, int pitch) const = 0;
+    virtual void render_xrgb8888(uint32_t *screen, int pitch) const = 0;
     virtual u4mat2<128, 128> const &get_front_screen() const = 0;
+    // Size of the frame that the rendering functions read; like them, it
+    // only changes with acquire_frame()
     virtual lol::ivec2 get_screen_resolution() const = 0;
 
+    // Make the most recently completed frame the one that the rendering
+    // functions read. Only one thread may render a given VM; returns
+    // false if no frame was completed since the last call, or if it
+    // would display exactly like the current one.
+    virtual bool acquire_frame() = 0;
+
+    // Block until a frame is completed, or until timeout expires; for
+    // frontends that render from their own thread. Returns false on
+    // timeout. A frame completed since the last call counts.
+    bool wait_frame(std::chrono::steady_clock::duration timeout);
+
+    // Frontends that measure latency say when they sampled the input for
+    // the next step; frames published during that step carry the time,
+    // and frame_input_time() returns it for the frame that acquire_frame()
+    // made current.
+    void set_input_time(std::chrono::steady_clock::time_point t) { m_input_time = t; }
+    virtual std::chrono::steady_clock::time_point frame_input_time() const = 0;
+
     virtual int get_ansi_color(uint8_t c) const = 0;
-    // FIXME: get_ansi_color() should be get_rgb(), and render()
-    // should be removed in favour of a generic function that
-    // uses get_rgb() too.
+    virtual lol::u8vec3 get_rgb(uint8_t c) const = 0;
+    // FIXME: render() should be removed in favour of a generic function
+    // that uses get_rgb() too.
 
-    void print_ansi(lol::ivec2 term_size = lol::ivec2(128, 64),
-                    uint8_t const *prev_screen = nullptr) const;
+    // Send the front screen to stdout with a single write()
+    void print_ansi(ansi_encoder &encoder,
+                    lol::ivec2 term_size = lol::ivec2(128, 64)) const;
 
     // Code
     virtual std::string const &get_code() const = 0;
 
-    // Audio streaming
+    // Audio streaming. Frontends that call get_audio() from an audio
+    // callback must say so before streaming starts; otherwise the VM
+    // renders and discards the audio of each step itself, so that sound
+    // commands and the audio stat() values still work.
     virtual void get_audio(void* buffer, size_t frames) = 0;
+    virtual void set_audio_consumer(bool enabled) = 0;
 
     // IO
     virtual void button(int player, int index, int state) = 0;
@@ -117,6 +151,28 @@ public:
     virtual std::tuple<uint8_t *, size_t> ram() = 0;
     virtual std::tuple<uint8_t *, size_t> rom() = 0;
 
+    // Writes to ram() that bypass the VM, such as those of a memory
+    // editor, must be followed by a call to ram_changed(), from any
+    // thread. The VM then drops what it derived from memory and applies
+    // the audio registers at the start of its next step.
+    virtual void ram_changed() = 0;
+
+    // Persistent cart data, inside ram(); empty if there is none. With
+    // external saves, the frontend owns its contents: the VM no longer
+    // loads or writes save files and keeps it across resets. It also
+    // stops writing its config file.
+    virtual std::tuple<uint8_t *, size_t> save_ram() = 0;
+    virtual void set_external_save(bool enabled) = 0;
+
+    // Netplay and replays need two runs fed with the same input to stay
+    // identical: in deterministic mode, time is derived from the number
+    // of steps, the PRNG is seeded with the given value on every reset,
+    // and stats that depend on the host clock are frozen. The checksum
+    // covers the console memory and the relevant VM state, so that peers
+    // can detect desynchronisation.
+    virtual void set_deterministic(bool enabled, uint32_t seed = 0) = 0;
+    virtual uint64_t checksum() const = 0;
+
     virtual void request_exit() = 0;
     virtual bool is_running() = 0;
 
@@ -158,6 +214,17 @@ public:
 
 protected:
     std::unique_ptr<pico8::bios> m_bios; // TODO: get rid of this
+
+    // Implementations call this after publishing a frame
+    void frame_completed();
+
+    // Only accessed by the thread that calls step()
+    std::chrono::steady_clock::time_point m_input_time;
+
+private:
+    std::mutex m_frame_mutex;
+    std::condition_variable m_frame_cv;
+    bool m_frame_completed = false;
 };
 
 enum
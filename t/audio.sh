@@ -0,0 +1,45 @@
+#!/bin/sh
+
+# Render music and SFX with export-audio and compare the result byte for
+# byte with the reference WAV files in audio/. After an intended change
+# to the synth, run "audio.sh --update" from this directory, with Z8TOOL
+# set, to record new references.
+
+srcdir="${srcdir:-.}"
+update=false
+if [ "$1" = "--update" ]; then
+    update=true
+    mkdir -p "${srcdir}/audio"
+fi
+
+tmp="$(mktemp)"
+trap 'rm -f "${tmp}"' EXIT
+
+status=0
+while read -r name cart args; do
+    reference="${srcdir}/audio/${name}.wav"
+    # shellcheck disable=SC2086
+    if ! "${Z8TOOL}" export-audio --max-length 3 ${args} --out "${tmp}" "${srcdir}/${cart}"; then
+        printf '%s: export-audio failed\n' "${name}"
+        status=1
+    elif ${update}; then
+        cp "${tmp}" "${reference}"
+        printf '%s: updated\n' "${name}"
+    elif [ ! -f "${reference}" ]; then
+        # Exit code 77 tells automake to report the test as skipped
+        printf '%s: no reference, run audio.sh --update\n' "${name}"
+        [ ${status} = 0 ] && status=77
+    elif ! cmp -s "${tmp}" "${reference}"; then
+        printf '%s: output differs from the reference\n' "${name}"
+        status=1
+    else
+        printf '%s: ok\n' "${name}"
+    fi
+done <<EOF_RENDERS
+zepton-music ../carts/zepton.p8 --music 0
+rulez-music ../carts/rulez.p8 --music 0
+audio-music audio.p8 --music 0
+audio-sfx audio.p8 --sfx 8 9 10 11
+EOF_RENDERS
+
+exit ${status}
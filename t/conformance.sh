@@ -0,0 +1,19 @@
+#!/bin/sh
+
+# Run the conformance carts that check their own results, and fail unless
+# each of them reports that all its tests passed. The carts print a
+# summary with printh() and then ask to exit.
+
+carts="spritesheet.p8"
+
+status=0
+for cart in $carts; do
+    output="$("${Z8TOOL}" run --headless "${srcdir}/${cart}")"
+    printf '%s: %s\n' "${cart}" "$(printf '%s\n' "${output}" | tail -n 1)"
+    if ! printf '%s\n' "${output}" | grep -q ' 0 failed\.$'; then
+        printf '%s\n' "${output}"
+        status=1
+    fi
+done
+
+exit ${status}
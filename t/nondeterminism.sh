@@ -0,0 +1,15 @@
+#!/bin/sh
+
+# The determinism cart is only useful if it notices when the VM depends
+# on the host, so check that its runs diverge without deterministic mode.
+
+cart=determinism.p8
+
+output="$("${Z8TOOL}" check-determinism --no-deterministic --input "${srcdir}/replay.log" "${srcdir}/${cart}")"
+printf '%s\n' "${output}"
+if ! printf '%s\n' "${output}" | grep -q 'runs diverge'; then
+    printf '%s: runs agree without deterministic mode\n' "${cart}"
+    exit 1
+fi
+
+exit 0